@@ -1,5 +1,6 @@
 #include "Matrix.h"
 #include "../bmp_image_codes/bitmap_image.hpp"
+#include "../../common/2005024_scene_tokenizer.h"
 
 const double eps = 1.0e-9;
 
@@ -30,8 +31,12 @@ bitmap_image image;
 
 vector<Triangle> triangles;
 
-void Modeling_Transformation(const string& input_file,const string& output_file){  
-    ifstream in(input_file);
+bool Modeling_Transformation(const string& input_file,const string& output_file){  
+    SceneTokenizer in(input_file);
+    if(!in){
+        cerr << "Error: " << in.error() << "\n";
+        return false;
+    }
     ofstream out(output_file);
     
     out << fixed << setprecision(7);
@@ -51,8 +56,8 @@ void Modeling_Transformation(const string& input_file,const string& output_file)
     stack<Matrix> S;
     Matrix M(4,4);
     S.push(M);
-    string command;
-    while(true){
+    string_view command;
+    while(in){
         in >> command;
         if(command == "triangle"){
             double x,y,z;
@@ -127,15 +132,27 @@ void Modeling_Transformation(const string& input_file,const string& output_file)
             S.push(S.top());
         }
         else if(command == "pop"){
+            if(S.size() == 1){
+                in.failAt("pop without a matching push");
+                break;
+            }
             S.pop();
         }
         else if(command == "end"){
             break;
         }
+        else if(in){
+            in.failAt("unknown command '" + string(command) + "'");
+        }
     }
 
+    if(!in){
+        cerr << "Error: " << in.error() << "\n";
+        return false;
+    }
     in.close();
     out.close();
+    return true;
 }
 
 void View_Transformation(const string& input_file,const string& output_file){
@@ -349,7 +366,9 @@ void clip_and_scan(const string& config_file,const string& input_file, const str
 int main(){
     string input = "../Test Cases/4/scene.txt";
     string output = "stage1.txt";
-    Modeling_Transformation(input,output);
+    if(!Modeling_Transformation(input,output)){
+        return 1;
+    }
 
     input = "stage1.txt";
     output = "stage2.txt";
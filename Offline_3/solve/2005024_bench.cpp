@@ -0,0 +1,380 @@
+// Microbenchmarks for the intersection and shading kernels on their own:
+// Sphere, Triangle (Moller-Trumbore), GeneralQuadric (an axis-aligned and a
+// rotated ellipsoid) and Floor hit(), each over hit, miss and grazing rays,
+// and computePhongLighting() over hits of a scene. Rays come from a seeded
+// generator, so every run and every build sees the same ones.
+//
+// Build (no GL libraries needed):
+//   g++ 2005024_bench.cpp -o 2005024_bench -O2 -pthread
+//
+// Usage:
+//   2005024_bench [options]
+//     -n, --rays N         rays per intersection case (default 2000000)
+//         --shading-rays N shaded hits per shading case (default 200000)
+//     -r, --repeat N       timed runs per case; the fastest one is reported
+//                          (default 5)
+//         --seed S         ray generator seed (default 1)
+//         --scene FILE     scene for the shading cases (default ../scene.txt)
+//         --filter TEXT    only run cases whose "kernel/distribution" name
+//                          contains TEXT
+//     -o, --output FILE    also write the results table to FILE
+//     -b, --baseline FILE  compare with a table an earlier run wrote
+//
+// The table goes to stdout, tab separated, one case per line after two
+// comment lines:
+//   kernel  distribution  rays  ns_per_ray  rays_per_s  hit_rate
+// With a baseline, console lines gain the speedup against it (baseline
+// ns_per_ray / ns_per_ray); files written with -o never do, so they can
+// serve as the next baseline. Progress and scene loading go to stderr.
+#define RT_HEADLESS
+#include "2005024_render.h"
+
+// some unit vector perpendicular to n, turned by a random angle around it
+Vector3D randomTangent(Vector3D n, SeededRandom& rng) {
+    Vector3D helper = fabs(n.x) < 0.9 ? Vector3D(1, 0, 0) : Vector3D(0, 1, 0);
+    Vector3D a = helper.cross(n);
+    a.normalize();
+    Vector3D b = n.cross(a);
+    double phi = rng.range(0.0, 2 * M_PI);
+    return a * cos(phi) + b * sin(phi);
+}
+
+// An intersection kernel under test: the object, a sphere around it and a
+// way to pick random points on its surface with their normals.
+struct BenchShape {
+    string name;
+    Object* object;
+    Vector3D center;
+    double radius;
+    bool planar;            // hit from either side
+    function<Vector3D(SeededRandom&, Vector3D&)> surfacePoint;
+};
+
+// surface point of a quadric that is negative at center and positive at
+// radius from it, found by bisection along a random direction
+Vector3D quadricSurfacePoint(const GeneralQuadric& q, const Vector3D& center, double radius,
+                             SeededRandom& rng, Vector3D& normal) {
+    auto f = [&](const Vector3D& p) {
+        return q.A*p.x*p.x + q.B*p.y*p.y + q.C*p.z*p.z + q.D*p.x*p.y + q.E*p.x*p.z + q.F*p.y*p.z +
+               q.G*p.x + q.H*p.y + q.I*p.z + q.J;
+    };
+    Vector3D u = rng.unitVector();
+    double lo = 0.0, hi = radius;
+    for (int k = 0; k < 60; k++) {
+        double mid = 0.5 * (lo + hi);
+        if (f(center + u * mid) < 0) lo = mid;
+        else hi = mid;
+    }
+    Vector3D p = center + u * lo;
+    normal = Vector3D(2*q.A*p.x + q.D*p.y + q.E*p.z + q.G,
+                      2*q.B*p.y + q.D*p.x + q.F*p.z + q.H,
+                      2*q.C*p.z + q.E*p.x + q.F*p.y + q.I);
+    normal.normalize();
+    return p;
+}
+
+// hit: from outside the surface straight at a point on it
+// miss: from afar, passing the bounding sphere at 1.1 to 3 radii
+// grazing: nearly along the surface (1e-4 to 1e-2 rad off the tangent plane)
+// into a point on it, where the hit tests are closest to their thresholds
+vector<Ray> makeRays(const BenchShape& shape, const string& distribution, int count, uint64_t seed) {
+    SeededRandom rng(seed);
+    vector<Ray> rays;
+    rays.reserve(count);
+    double distance = 10 * shape.radius;
+    for (int k = 0; k < count; k++) {
+        if (distribution == "miss") {
+            Vector3D origin = shape.center + rng.unitVector() * distance;
+            Vector3D toCenter = shape.center - origin;
+            toCenter.normalize();
+            Vector3D target = shape.center + randomTangent(toCenter, rng) * (shape.radius * rng.range(1.1, 3.0));
+            rays.push_back(Ray(origin, target - origin));
+            continue;
+        }
+
+        Vector3D normal;
+        Vector3D p = shape.surfacePoint(rng, normal);
+        if (shape.planar && rng.uniform() < 0.5) {
+            normal = -normal;
+        }
+        Vector3D away;
+        if (distribution == "grazing") {
+            double angle = exp(rng.range(log(1e-4), log(1e-2)));
+            away = randomTangent(normal, rng) * cos(angle) + normal * sin(angle);
+        } else {
+            // within 60 degrees of the normal
+            do {
+                away = rng.unitVector();
+            } while (away.dot(normal) < 0.5);
+        }
+        rays.push_back(Ray(p + away * distance, -away));
+    }
+    return rays;
+}
+
+struct BenchResult {
+    string kernel, distribution;
+    long long rays;
+    double nsPerRay;
+    double hitRate;
+};
+
+// fastest of repeat runs of test over every ray; test returns whether the ray hit
+template<class Test>
+BenchResult timeCase(const string& kernel, const string& distribution, vector<Ray>& rays,
+                     int repeat, Test test) {
+    double best = INFINITY;
+    long long hits = 0;
+    for (int run = 0; run <= repeat; run++) {
+        hits = 0;
+        auto start = chrono::steady_clock::now();
+        for (Ray& r : rays) {
+            hits += test(r);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        // run 0 warms the caches and the branch predictors
+        if (run > 0) best = min(best, seconds);
+    }
+    BenchResult result;
+    result.kernel = kernel;
+    result.distribution = distribution;
+    result.rays = rays.size();
+    result.nsPerRay = rays.empty() ? 0.0 : best * 1e9 / rays.size();
+    result.hitRate = rays.empty() ? 0.0 : (double)hits / rays.size();
+    return result;
+}
+
+// Shading cases: camera rays of the viewer's start pose through random
+// pixels, and rays from random points of the scene's bounds in random
+// directions; only rays that hit something are kept.
+bool makeShadingCase(const string& distribution, int count, uint64_t seed,
+                     vector<Ray>& rays, vector<HitRecord>& hits) {
+    SeededRandom rng(seed);
+    ViewFrame view(Camera(Vector3D(100, 60, 40), Vector3D(0, 0, 0), Vector3D(0, 1, 0)), 1000, 1000);
+    AABB box = sceneGeometry.bvh.bounds();
+    if (sceneGeometry.bvh.nodes.empty()) box = AABB(Vector3D(-50, -50, 0), Vector3D(50, 50, 50));
+
+    rays.clear();
+    hits.clear();
+    // gives up on scenes the rays almost never hit
+    for (long long attempts = 0; (int)rays.size() < count && attempts < 100LL * count; attempts++) {
+        Ray r;
+        if (distribution == "camera") {
+            r = view.centerRay((int)(rng.uniform() * 1000), (int)(rng.uniform() * 1000));
+        } else {
+            Vector3D origin(rng.range(box.lo.x, box.hi.x), rng.range(box.lo.y, box.hi.y),
+                            rng.range(box.lo.z, box.hi.z));
+            r = Ray(origin, rng.unitVector());
+        }
+        HitRecord rec;
+        if (sceneGeometry.closestHit(&r, rec)) {
+            rays.push_back(r);
+            hits.push_back(rec);
+        }
+    }
+    if ((int)rays.size() < count) {
+        cerr << "Error: only " << rays.size() << " of " << count << " " << distribution
+             << " rays hit the scene" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool readBaseline(const string& path, map<string, double>& baseline) {
+    ifstream in(path);
+    if (!in.is_open()) {
+        cerr << "Error: Could not open " << path << endl;
+        return false;
+    }
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        string kernel, distribution;
+        long long rays;
+        double nsPerRay;
+        if (fields >> kernel >> distribution >> rays >> nsPerRay) {
+            baseline[kernel + "/" + distribution] = nsPerRay;
+        }
+    }
+    return true;
+}
+
+string formatResult(const BenchResult& r) {
+    char line[256];
+    snprintf(line, sizeof line, "%s\t%s\t%lld\t%.3f\t%.0f\t%.4f", r.kernel.c_str(), r.distribution.c_str(),
+             r.rays, r.nsPerRay, r.nsPerRay > 0 ? 1e9 / r.nsPerRay : 0.0, r.hitRate);
+    return line;
+}
+
+void printUsage(const char* program) {
+    cerr << "usage: " << program << " [-n rays] [--shading-rays N] [-r repeat] [--seed S]"
+         << " [--scene FILE] [--filter TEXT] [-o FILE] [-b FILE]" << endl;
+}
+
+int main(int argc, char** argv) {
+    int rayCount = 2000000, shadingCount = 200000, repeat = 5;
+    uint64_t seed = 1;
+    string scenePath = "../scene.txt", filter, outputPath, baselinePath;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                cerr << "Error: " << arg << " needs a value" << endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-n" || arg == "--rays") {
+            rayCount = atoi(value());
+        } else if (arg == "--shading-rays") {
+            shadingCount = atoi(value());
+        } else if (arg == "-r" || arg == "--repeat") {
+            repeat = atoi(value());
+        } else if (arg == "--seed") {
+            seed = strtoull(value(), nullptr, 10);
+        } else if (arg == "--scene") {
+            scenePath = value();
+        } else if (arg == "--filter") {
+            filter = value();
+        } else if (arg == "-o" || arg == "--output") {
+            outputPath = value();
+        } else if (arg == "-b" || arg == "--baseline") {
+            baselinePath = value();
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            cerr << "Error: unknown argument " << arg << endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (rayCount <= 0 || shadingCount <= 0 || repeat <= 0) {
+        cerr << "Error: ray counts and repeat must be positive" << endl;
+        return 1;
+    }
+
+    map<string, double> baseline;
+    if (!baselinePath.empty() && !readBaseline(baselinePath, baseline)) {
+        return 1;
+    }
+
+    Sphere sphere(Vector3D(0, 0, 0), 1.0);
+    Triangle triangle(Vector3D(-1, -1, 0.2), Vector3D(1, -0.8, -0.1), Vector3D(0, 1.2, 0));
+    // x^2 + 2 y^2 + 4 z^2 = 1, classified as QUADRIC_CENTERED
+    GeneralQuadric ellipsoid(1, 2, 4, 0, 0, 0, 0, 0, 0, -1, Vector3D(0, 0, 0), 0, 0, 0);
+    // a rotated ellipsoid: cross terms take the general path
+    GeneralQuadric rotated(1.5, 2, 2.5, 0.6, 0.4, 0.3, 0, 0, 0, -1, Vector3D(0, 0, 0), 0, 0, 0);
+    Floor board(20, 1);
+
+    vector<BenchShape> shapes = {
+        {"sphere", &sphere, sphere.reference_point, 1.0, false, [&](SeededRandom& rng, Vector3D& n) {
+            n = rng.unitVector();
+            return sphere.reference_point + n * sphere.radius;
+        }},
+        {"triangle", &triangle, (triangle.a + triangle.b + triangle.c) / 3.0, 1.5, true, [&](SeededRandom& rng, Vector3D& n) {
+            double u = rng.uniform(), v = rng.uniform();
+            if (u + v > 1) {
+                u = 1 - u;
+                v = 1 - v;
+            }
+            n = triangle.normal;
+            return triangle.a + (triangle.b - triangle.a) * u + (triangle.c - triangle.a) * v;
+        }},
+        {"quadric", &ellipsoid, Vector3D(0, 0, 0), 1.0, false, [&](SeededRandom& rng, Vector3D& n) {
+            return quadricSurfacePoint(ellipsoid, Vector3D(0, 0, 0), 1.0, rng, n);
+        }},
+        {"quadric-general", &rotated, Vector3D(0, 0, 0), 1.0, false, [&](SeededRandom& rng, Vector3D& n) {
+            return quadricSurfacePoint(rotated, Vector3D(0, 0, 0), 1.0, rng, n);
+        }},
+        {"floor", &board, Vector3D(0, 0, 0), 10 * sqrt(2.0), true, [&](SeededRandom& rng, Vector3D& n) {
+            n = Vector3D(0, 0, 1);
+            return Vector3D(rng.range(-10, 10), rng.range(-10, 10), 0);
+        }},
+    };
+
+    auto wanted = [&](const string& kernel, const string& distribution) {
+        return filter.empty() || (kernel + "/" + distribution).find(filter) != string::npos;
+    };
+
+    vector<BenchResult> results;
+    auto report = [&](const BenchResult& r) {
+        string line = formatResult(r);
+        auto base = baseline.find(r.kernel + "/" + r.distribution);
+        if (base != baseline.end() && r.nsPerRay > 0) {
+            char speedup[32];
+            snprintf(speedup, sizeof speedup, "\t%.2fx", base->second / r.nsPerRay);
+            line += speedup;
+        }
+        cout << line << endl;
+        results.push_back(r);
+    };
+
+    cout << "# 2005024_bench v1, " << (sizeof(Real) == sizeof(float) ? "float" : "double")
+         << ", seed " << seed << ", fastest of " << repeat << " runs" << endl;
+    cout << "# kernel\tdistribution\trays\tns_per_ray\trays_per_s\thit_rate"
+         << (baseline.empty() ? "" : "\tspeedup") << endl;
+
+    uint64_t caseSeed = seed;
+    for (const BenchShape& shape : shapes) {
+        for (string distribution : {"hit", "miss", "grazing"}) {
+            caseSeed++;
+            if (!wanted(shape.name, distribution)) continue;
+            cerr << "Running " << shape.name << "/" << distribution << "..." << endl;
+            vector<Ray> rays = makeRays(shape, distribution, rayCount, caseSeed);
+            Object* object = shape.object;
+            HitRecord rec;
+            // through the vtable, as the tracer reaches objects without a packed form
+            report(timeCase(shape.name, distribution, rays, repeat, [&](Ray& r) {
+                return object->hit(&r, INFINITY, rec);
+            }));
+        }
+    }
+
+    bool shading = wanted("shading", "camera") || wanted("shading", "random");
+    if (shading) {
+        // the loaders report on stdout; keep it for the table
+        streambuf* out = cout.rdbuf(cerr.rdbuf());
+        bool loaded = loadData(scenePath.c_str());
+        cout.rdbuf(out);
+        if (!loaded) {
+            return 1;
+        }
+        for (string distribution : {"camera", "random"}) {
+            caseSeed++;
+            if (!wanted("shading", distribution)) continue;
+            cerr << "Running shading/" << distribution << "..." << endl;
+            vector<Ray> rays;
+            vector<HitRecord> hits;
+            if (!makeShadingCase(distribution, shadingCount, caseSeed, rays, hits)) {
+                freeScene();
+                return 1;
+            }
+            // full recursion from the first bounce, as traceRays shades
+            report(timeCase("shading", distribution, rays, repeat, [&](Ray& r) {
+                double color[3] = {0, 0, 0};
+                computePhongLighting(hits[&r - rays.data()], color, &r, 1);
+                return color[0] + color[1] + color[2] > 0;
+            }));
+        }
+        freeScene();
+    }
+
+    if (!outputPath.empty()) {
+        ofstream out(outputPath);
+        out << "# 2005024_bench v1, " << (sizeof(Real) == sizeof(float) ? "float" : "double")
+            << ", seed " << seed << ", fastest of " << repeat << " runs" << endl;
+        out << "# kernel\tdistribution\trays\tns_per_ray\trays_per_s\thit_rate" << endl;
+        for (const BenchResult& r : results) {
+            out << formatResult(r) << endl;
+        }
+        if (!out) {
+            cerr << "Error: Could not write " << outputPath << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include<bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// 24-bit BMP written band by band. open() writes the same header as
+// bitmap_image::save_image and reserves the whole file, then each band of
+// rows goes out with one positional write as soon as it is resolved, so
+// only the band has to be in memory however large the image is.
+struct BmpStreamWriter {
+    static const int HEADER_SIZE = 14 + 40;
+
+    int fd = -1;
+    int width = 0, height = 0;
+    size_t rowSize = 0;         // bytes per row, padded to a multiple of 4
+    string path;
+
+    BmpStreamWriter() {}
+    BmpStreamWriter(const BmpStreamWriter&) = delete;
+    BmpStreamWriter& operator=(const BmpStreamWriter&) = delete;
+    ~BmpStreamWriter() { close(); }
+
+    static void put16(unsigned char*& p, uint16_t v) {
+        *p++ = v & 0xFF;
+        *p++ = v >> 8;
+    }
+
+    static void put32(unsigned char*& p, uint32_t v) {
+        for (int k = 0; k < 4; k++) *p++ = (v >> (8 * k)) & 0xFF;
+    }
+
+    bool fail(const char* what) {
+        cerr << "Error: " << what << " " << path << ": " << strerror(errno) << endl;
+        close();
+        return false;
+    }
+
+    bool open(const string& filename, int w, int h) {
+        close();
+        path = filename;
+        width = w;
+        height = h;
+        rowSize = (3 * (size_t)w + 3) & ~(size_t)3;
+        uint64_t imageSize = (uint64_t)rowSize * h;
+        if (w <= 0 || h <= 0 || HEADER_SIZE + imageSize > UINT32_MAX) {
+            cerr << "Error: " << w << "x" << h << " does not fit in a BMP file" << endl;
+            return false;
+        }
+
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return fail("Could not create");
+
+        // reserve the blocks now so a full disk fails before rendering starts
+        off_t fileSize = HEADER_SIZE + imageSize;
+        int err = posix_fallocate(fd, 0, fileSize);
+        if (err != 0) {
+            if (err != EINVAL && err != EOPNOTSUPP) {
+                errno = err;
+                return fail("Could not allocate");
+            }
+            if (ftruncate(fd, fileSize) != 0) return fail("Could not allocate");
+        }
+
+        unsigned char header[HEADER_SIZE];
+        unsigned char* p = header;
+        put16(p, 19778);                    // "BM"
+        put32(p, fileSize);
+        put16(p, 0);
+        put16(p, 0);
+        put32(p, HEADER_SIZE);
+        put32(p, 40);
+        put32(p, w);
+        put32(p, h);                        // positive: rows are stored bottom-up
+        put16(p, 1);
+        put16(p, 24);
+        put32(p, 0);
+        put32(p, imageSize);
+        put32(p, 0);
+        put32(p, 0);
+        put32(p, 0);
+        put32(p, 0);
+        return writeAll(header, HEADER_SIZE, 0) || fail("Could not write");
+    }
+
+    // Reopens an image an earlier open() created, keeping its rows; fails
+    // unless the file has the size of a width x height image.
+    bool openExisting(const string& filename, int w, int h) {
+        close();
+        path = filename;
+        width = w;
+        height = h;
+        rowSize = (3 * (size_t)w + 3) & ~(size_t)3;
+        fd = ::open(filename.c_str(), O_WRONLY);
+        if (fd < 0) return fail("Could not open");
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != HEADER_SIZE + (uint64_t)rowSize * h) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // rows written so far are on disk once this returns true
+    bool sync() {
+        return fd >= 0 && fdatasync(fd) == 0;
+    }
+
+    bool writeAll(const unsigned char* data, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    // Writes count rows starting at row y0 (counted from the top). band
+    // holds them in file order: count * rowSize bytes, bottom row first.
+    bool writeBand(int y0, int count, const unsigned char* band) {
+        off_t offset = HEADER_SIZE + (off_t)(height - y0 - count) * rowSize;
+        return writeAll(band, count * rowSize, offset) || fail("Could not write");
+    }
+
+    bool close() {
+        if (fd < 0) return true;
+        int err = ::close(fd);
+        fd = -1;
+        return err == 0;
+    }
+};
@@ -0,0 +1,225 @@
+#pragma once
+#include "2005024_classes.h"
+
+struct BVHNode {
+    AABB box;
+    int axis;
+    int count;      // > 0 for leaves
+    int offset;     // first ref for leaves, right child for inner nodes
+};
+
+// Bounding volume hierarchy over opaque 32-bit references. The caller owns
+// the primitives; leaves only store refs, and traversal hands every ref of
+// a reached leaf to a visitor.
+struct BVH {
+    static const int LEAF_SIZE = 4;
+    static const int NUM_BINS = 12;
+    static const int MAX_SAH_DEPTH = 40;
+    static const int STACK_SIZE = 128;
+
+    vector<BVHNode> nodes;
+    vector<uint32_t> refs;
+    int leafSize = LEAF_SIZE;
+
+    vector<AABB> primBounds;
+    vector<Vector3D> primCentroids;
+
+    // bounds is taken by value so callers done with it can move it in
+    void build(vector<AABB> bounds, const vector<uint32_t>& primRefs, int maxLeafSize = LEAF_SIZE) {
+        leafSize = maxLeafSize;
+        nodes.clear();
+        refs.clear();
+        if (bounds.empty()) return;
+
+        primBounds = move(bounds);
+        primCentroids.resize(primBounds.size());
+        for (size_t i = 0; i < primBounds.size(); i++) {
+            primCentroids[i] = primBounds[i].centroid();
+        }
+
+        vector<int> order(primBounds.size());
+        for (int i = 0; i < (int)order.size(); i++) order[i] = i;
+
+        nodes.reserve(2 * primBounds.size());
+        buildNode(order, 0, (int)order.size(), 0);
+
+        refs.resize(order.size());
+        for (int i = 0; i < (int)order.size(); i++) {
+            refs[i] = primRefs[order[i]];
+        }
+        vector<AABB>().swap(primBounds);
+        vector<Vector3D>().swap(primCentroids);
+    }
+
+    int buildNode(vector<int>& order, int begin, int end, int depth) {
+        int index = nodes.size();
+        nodes.push_back(BVHNode());
+
+        AABB box, centroidBox;
+        for (int i = begin; i < end; i++) {
+            box.expand(primBounds[order[i]]);
+            centroidBox.expand(primCentroids[order[i]]);
+        }
+        nodes[index].box = box;
+        nodes[index].axis = 0;
+
+        int count = end - begin;
+        if (count <= leafSize) {
+            nodes[index].count = count;
+            nodes[index].offset = begin;
+            return index;
+        }
+
+        // binned SAH split on the axis with the widest centroid spread
+        int axis = 0;
+        double extent = -1.0;
+        for (int a = 0; a < 3; a++) {
+            double e = centroidBox.axisMax(a) - centroidBox.axisMin(a);
+            if (e > extent) {
+                extent = e;
+                axis = a;
+            }
+        }
+
+        int mid = begin + count / 2;
+        // past MAX_SAH_DEPTH fall back to median splits so traversal stacks stay bounded
+        if (extent > 0 && depth < MAX_SAH_DEPTH) {
+            double cmin = centroidBox.axisMin(axis);
+            auto binOf = [&](int prim) {
+                Vector3D c = primCentroids[prim];
+                double v = axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+                int b = (int)(NUM_BINS * (v - cmin) / extent);
+                return min(b, NUM_BINS - 1);
+            };
+
+            AABB binBox[NUM_BINS];
+            int binCount[NUM_BINS] = {0};
+            for (int i = begin; i < end; i++) {
+                int b = binOf(order[i]);
+                binBox[b].expand(primBounds[order[i]]);
+                binCount[b]++;
+            }
+
+            double rightArea[NUM_BINS];
+            int rightCount[NUM_BINS];
+            AABB acc;
+            int n = 0;
+            for (int b = NUM_BINS - 1; b > 0; b--) {
+                acc.expand(binBox[b]);
+                n += binCount[b];
+                rightArea[b] = acc.surfaceArea();
+                rightCount[b] = n;
+            }
+
+            double bestCost = INFINITY;
+            int bestSplit = -1;
+            acc = AABB();
+            n = 0;
+            for (int b = 0; b < NUM_BINS - 1; b++) {
+                acc.expand(binBox[b]);
+                n += binCount[b];
+                if (n == 0 || rightCount[b + 1] == 0) continue;
+                double cost = acc.surfaceArea() * n + rightArea[b + 1] * rightCount[b + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestSplit = b;
+                }
+            }
+
+            if (bestSplit >= 0) {
+                int* p = partition(order.data() + begin, order.data() + end,
+                                   [&](int prim) { return binOf(prim) <= bestSplit; });
+                mid = p - order.data();
+            }
+        }
+
+        if (mid == begin || mid == end) {
+            mid = begin + count / 2;
+            nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                        [&](int l, int r) {
+                            Vector3D a = primCentroids[l], b = primCentroids[r];
+                            if (axis == 0) return a.x < b.x;
+                            if (axis == 1) return a.y < b.y;
+                            return a.z < b.z;
+                        });
+        }
+
+        buildNode(order, begin, mid, depth + 1);
+        int right = buildNode(order, mid, end, depth + 1);
+        nodes[index].axis = axis;
+        nodes[index].count = 0;
+        nodes[index].offset = right;
+        return index;
+    }
+
+    AABB bounds() const {
+        return nodes.empty() ? AABB() : nodes[0].box;
+    }
+
+    static Vector3D inverseDir(const Ray* r) {
+        return Vector3D(1.0 / r->dir.x, 1.0 / r->dir.y, 1.0 / r->dir.z);
+    }
+
+    static bool dirNegative(const Ray* r, int axis) {
+        return (axis == 0 ? r->dir.x : (axis == 1 ? r->dir.y : r->dir.z)) < 0;
+    }
+
+    // Front-to-back traversal for closest-hit queries: visit(ref, best) is
+    // called for refs in leaves the ray reaches before best, and may lower best.
+    template<class Visit>
+    void closest(const Ray* r, Real& best, Visit visit) const {
+        if (nodes.empty()) return;
+
+        Vector3D invDir = inverseDir(r);
+        int stack[STACK_SIZE];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const BVHNode& node = nodes[stack[--sp]];
+            STAT_ADD(STAT_BVH_NODES, 1);
+            if (!node.box.intersect(r, invDir, best)) continue;
+
+            if (node.count > 0) {
+                for (int i = node.offset; i < node.offset + node.count; i++) {
+                    visit(refs[i], best);
+                }
+            } else {
+                int left = &node - nodes.data() + 1;
+                // visit the child nearer along the split axis first
+                if (dirNegative(r, node.axis)) {
+                    stack[sp++] = left;
+                    stack[sp++] = node.offset;
+                } else {
+                    stack[sp++] = node.offset;
+                    stack[sp++] = left;
+                }
+            }
+        }
+    }
+
+    // Any-hit traversal up to tMax; stops as soon as visit(ref) returns true.
+    template<class Visit>
+    bool any(const Ray* r, Real tMax, Visit visit) const {
+        if (nodes.empty()) return false;
+
+        Vector3D invDir = inverseDir(r);
+        int stack[STACK_SIZE];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const BVHNode& node = nodes[stack[--sp]];
+            STAT_ADD(STAT_BVH_NODES, 1);
+            if (!node.box.intersect(r, invDir, tMax)) continue;
+
+            if (node.count > 0) {
+                for (int i = node.offset; i < node.offset + node.count; i++) {
+                    if (visit(refs[i])) return true;
+                }
+            } else {
+                stack[sp++] = &node - nodes.data() + 1;
+                stack[sp++] = node.offset;
+            }
+        }
+        return false;
+    }
+};
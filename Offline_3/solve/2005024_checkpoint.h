@@ -0,0 +1,265 @@
+#pragma once
+#include "2005024_classes.h"
+#include "2005024_framebuffer.h"
+#include "2005024_bmp_stream.h"
+
+// Checkpoints of a streamed render, so one that is killed can resume.
+//
+// renderToFile already writes every finished band into the image file; what
+// a crash loses is the knowledge of which bands those were. A journal next
+// to the image (<image>.journal) records it: a header with the render's
+// fingerprint, then one record per finished band. Bands in progress over
+// several light passes also leave their accumulated colours in
+// <image>.partial, with the number of passes they hold (every pass gives
+// every pixel weight 1, so that is the weight too).
+//
+// Nothing touches the disk until the first checkpoint is due, and then only
+// every checkpointSeconds: the image is synced first, then the bands it
+// now safely holds are appended to the journal, which is synced in turn,
+// so the journal never claims a band the image could lose. The interval
+// stretches to 100 times what the last checkpoint took, which keeps them
+// under 1% of the render however large the partial buffer. A finished
+// render deletes both files.
+
+// 64-bit hash of bytes, eight at a time through mixBits
+uint64_t hashBytes(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = mixBits(h ^ word);
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, size);
+        h = mixBits(h ^ word ^ (uint64_t)size << 56);
+    }
+    return h;
+}
+
+template<typename T>
+uint64_t hashValue(uint64_t h, const T& value) {
+    return hashBytes(h, &value, sizeof value);
+}
+
+bool hashFile(const char* path, uint64_t& h) {
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) {
+        cout << "Error: Could not open " << path << endl;
+        return false;
+    }
+    vector<char> buffer(1 << 20);
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        h = hashBytes(h, buffer.data(), in.gcount());
+    }
+    return true;
+}
+
+bool writeFully(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+const uint32_t JOURNAL_MAGIC = 0x314a5452;     // "RTJ1"
+const uint32_t PARTIAL_MAGIC = 0x31505452;     // "RTP1"
+
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t bands;
+    uint64_t fingerprint;
+};
+
+// check ties a record to its journal, so a torn or stale tail is ignored
+struct JournalRecord {
+    uint32_t band;
+    uint32_t check;
+};
+
+struct PartialHeader {
+    uint32_t magic;
+    uint32_t band;
+    uint64_t fingerprint;
+    int32_t passes;             // light passes accumulated so far
+    int32_t width, rows;
+    uint32_t reserved;
+    uint64_t check;             // of the colours that follow
+};
+
+struct CheckpointStats {
+    int checkpoints;
+    double seconds;             // spent writing and syncing them
+};
+CheckpointStats lastCheckpointStats;
+
+double checkpointSeconds = 30.0;    // 0 turns checkpoints off
+bool resumeRenders = false;         // continue from a matching journal
+
+struct RenderJournal {
+    string imagePath, journalPath, partialPath;
+    uint64_t fingerprint = 0;
+    vector<char> done;              // per band, as far as the journal knows
+    vector<uint32_t> pending;       // finished since the last checkpoint
+    int fd = -1;
+    chrono::steady_clock::time_point last;
+    double wait = 0.0;              // until the next checkpoint, in seconds
+
+    RenderJournal() {}
+    RenderJournal(const RenderJournal&) = delete;
+    RenderJournal& operator=(const RenderJournal&) = delete;
+    ~RenderJournal() {
+        if (fd >= 0) close(fd);
+    }
+
+    uint32_t recordCheck(uint32_t band) const {
+        return (uint32_t)mixBits(fingerprint ^ band);
+    }
+
+    // Opens writer on filename: as the journal left it when resuming a
+    // render with the same fingerprint, fresh otherwise.
+    bool open(BmpStreamWriter& writer, const string& filename, int width, int height, int bands,
+              uint64_t renderFingerprint) {
+        imagePath = filename;
+        journalPath = filename + ".journal";
+        partialPath = filename + ".partial";
+        fingerprint = renderFingerprint;
+        done.assign(bands, 0);
+        pending.clear();
+        last = chrono::steady_clock::now();
+        wait = checkpointSeconds;
+        lastCheckpointStats = {0, 0.0};
+
+        if (resumeRenders && readJournal(bands)) {
+            if (writer.openExisting(filename, width, height)) {
+                int finished = count(done.begin(), done.end(), 1);
+                cerr << "Resuming " << filename << ": " << finished << " of " << bands << " bands done" << endl;
+                return true;
+            }
+            cerr << "Cannot resume " << filename << ", starting over" << endl;
+            done.assign(bands, 0);
+        } else if (resumeRenders) {
+            cerr << "No checkpoint of this render for " << filename << ", starting over" << endl;
+        }
+        // a stale journal must not outlive the image it described
+        unlink(journalPath.c_str());
+        unlink(partialPath.c_str());
+        unlink((partialPath + ".tmp").c_str());
+        return writer.open(filename, width, height);
+    }
+
+    bool readJournal(int bands) {
+        ifstream in(journalPath, ios::binary);
+        JournalHeader header;
+        if (!in.read((char*)&header, sizeof header) || header.magic != JOURNAL_MAGIC ||
+            header.fingerprint != fingerprint || (int)header.bands != bands) {
+            return false;
+        }
+        JournalRecord record;
+        while (in.read((char*)&record, sizeof record)) {
+            if (record.band >= (uint32_t)bands || record.check != recordCheck(record.band)) break;
+            done[record.band] = 1;
+        }
+        return true;
+    }
+
+    // passes held by the partial buffer of band, loaded into fb, which has
+    // the band's size; 0 without one
+    int loadPartial(int band, Framebuffer& fb) {
+        if (!resumeRenders) return 0;
+        ifstream in(partialPath, ios::binary);
+        PartialHeader header;
+        if (!in.read((char*)&header, sizeof header) || header.magic != PARTIAL_MAGIC ||
+            header.fingerprint != fingerprint || (int)header.band != band || header.width != fb.width ||
+            header.rows != fb.height || header.passes <= 0) {
+            return 0;
+        }
+        if (!in.read((char*)fb.color.data(), fb.color.size() * sizeof(float)) || header.check != partialCheck(fb)) {
+            fb.clear();
+            return 0;
+        }
+        fill(fb.weight.begin(), fb.weight.end(), (float)header.passes);
+        cerr << "Resuming band " << band << " after " << header.passes << " pass(es)" << endl;
+        return header.passes;
+    }
+
+    uint64_t partialCheck(const Framebuffer& fb) const {
+        return hashBytes(fingerprint, fb.color.data(), fb.color.size() * sizeof(float));
+    }
+
+    bool due() const {
+        return checkpointSeconds > 0 && chrono::duration<double>(chrono::steady_clock::now() - last).count() >= wait;
+    }
+
+    void bandDone(int band, BmpStreamWriter& writer) {
+        done[band] = 1;
+        pending.push_back(band);
+        if (due()) checkpoint(writer);
+    }
+
+    // after pass passes of totalPasses of band, accumulated in fb
+    void passDone(int band, int passes, int totalPasses, const Framebuffer& fb, BmpStreamWriter& writer) {
+        if (passes < totalPasses && due()) checkpoint(writer, band, passes, &fb);
+    }
+
+    // Journals the pending bands and, with fb, the partial buffer of band.
+    // A checkpoint that fails is reported and the render goes on; resuming
+    // then just has less to skip.
+    void checkpoint(BmpStreamWriter& writer, int band = -1, int passes = 0, const Framebuffer* fb = nullptr) {
+        auto start = chrono::steady_clock::now();
+        bool ok = writer.sync();
+        vector<JournalRecord> records;
+        if (ok && fd < 0) {
+            // a new journal, which also takes over the bands a resumed one held
+            fd = ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            JournalHeader header = {JOURNAL_MAGIC, (uint32_t)done.size(), fingerprint};
+            ok = fd >= 0 && writeFully(fd, &header, sizeof header);
+            pending.clear();
+            for (size_t b = 0; b < done.size(); b++) {
+                if (done[b]) pending.push_back(b);
+            }
+        }
+        for (uint32_t b : pending) records.push_back({b, recordCheck(b)});
+        ok = ok && writeFully(fd, records.data(), records.size() * sizeof(JournalRecord));
+        ok = ok && fdatasync(fd) == 0;
+        if (ok) pending.clear();
+        if (ok && fb != nullptr) ok = writePartial(band, passes, *fb);
+        if (!ok) cerr << "Warning: checkpoint of " << imagePath << " failed: " << strerror(errno) << endl;
+
+        last = chrono::steady_clock::now();
+        double cost = chrono::duration<double>(last - start).count();
+        wait = max(checkpointSeconds, 100 * cost);
+        lastCheckpointStats.checkpoints++;
+        lastCheckpointStats.seconds += cost;
+    }
+
+    // written aside and renamed over the old one, so a crash leaves either
+    bool writePartial(int band, int passes, const Framebuffer& fb) {
+        string temporary = partialPath + ".tmp";
+        int out = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) return false;
+        PartialHeader header = {PARTIAL_MAGIC, (uint32_t)band, fingerprint, passes, fb.width, fb.height, 0,
+                                partialCheck(fb)};
+        bool ok = writeFully(out, &header, sizeof header) &&
+                  writeFully(out, fb.color.data(), fb.color.size() * sizeof(float)) && fdatasync(out) == 0;
+        ok = close(out) == 0 && ok;
+        return ok && rename(temporary.c_str(), partialPath.c_str()) == 0;
+    }
+
+    // the image is complete: the journal has nothing left to say
+    void finish() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        unlink(journalPath.c_str());
+        unlink(partialPath.c_str());
+        unlink((partialPath + ".tmp").c_str());
+    }
+};
@@ -1,5 +1,9 @@
+#pragma once
 #include<bits/stdc++.h>
-#ifdef __linux__
+// RT_HEADLESS builds (2005024_headless.cpp) need neither GL headers nor libraries
+#ifdef RT_HEADLESS
+typedef unsigned int GLuint;
+#elif defined(__linux__)
 #include <GL/glut.h> // For Linux systems
 #elif defined(_WIN32) || defined(WIN32)
 #include <windows.h>
@@ -9,87 +13,97 @@
 #else
 #include <GL/glut.h> // Default fallback
 #endif
+#include "2005024_texture.h"
+#include "2005024_stats.h"
 using namespace std;
 
-const double EPSILON = 1e-6;
+// RT_FLOAT builds trace in single precision (a faster preview); the default
+// double build is the reference. Geometry (positions, directions, ray
+// parameters, the BVH and the packed primitives) uses Real; colours, light
+// sums and texture filtering stay double in both.
+#ifdef RT_FLOAT
+typedef float Real;
+// float carries ~7 digits, so self-intersection needs a wider margin
+const Real EPSILON = 1e-3f;
+#else
+typedef double Real;
+const Real EPSILON = 1e-6;
+#endif
 
 extern unsigned char* textureData;
 extern int textureWidth, textureHeight, textureChannels;
 extern bool useTexture;
+extern MipTexture floorTexture;
+extern TextureFilter textureFilter;
 
-void sampleFloorTexture(double u, double v, double* outColor) {
-    if (!textureData || textureWidth <= 0 || textureHeight <= 0) {
+// footprint is the width of the ray cone on the floor, in uv units
+void sampleFloorTexture(double u, double v, double footprint, double* outColor) {
+    if (floorTexture.empty()) {
         outColor[0] = outColor[1] = outColor[2] = 0.5;
         return;
     }
-    u = max(0.0, min(1.0, u));
-    v = max(0.0, min(1.0, v));
-    int pixel_x = (int)(u * (textureWidth - 1));
-    int pixel_y = (int)((1.0 - v) * (textureHeight - 1));
-    int idx = (pixel_y * textureWidth + pixel_x) * 3;
-    outColor[0] = textureData[idx] / 255.0;
-    outColor[1] = textureData[idx + 1] / 255.0;
-    outColor[2] = textureData[idx + 2] / 255.0;
+    floorTexture.sample(textureFilter, u, v, footprint, outColor);
 }
 
-struct Vector3D{
-    double x,y,z;
-    Vector3D(double x, double y, double z){
+template<typename T>
+struct Vector3{
+    T x,y,z;
+    Vector3(T x, T y, T z){
         this->x = x;
         this->y = y;
         this->z = z;
     }
-    Vector3D(){
+    Vector3(){
         this->x = 0;
         this->y = 0;
         this->z = 0;
     }
-    Vector3D(const Vector3D &p){
+    Vector3(const Vector3 &p){
         this->x = p.x;
         this->y = p.y;
         this->z = p.z;
     }
-    void add(const Vector3D &p){
+    void add(const Vector3 &p){
         this->x += p.x;
         this->y += p.y;
         this->z += p.z;
     }
-    void sub(const Vector3D &p){
+    void sub(const Vector3 &p){
         this->x -= p.x;
         this->y -= p.y;
         this->z -= p.z;
     }
-    void mul(double a){
+    void mul(T a){
         this->x *= a;
         this->y *= a;
         this->z *= a;
     }
-    Vector3D cross(Vector3D p){
-        return Vector3D(this->y * p.z - this->z * p.y,
+    Vector3 cross(Vector3 p){
+        return Vector3(this->y * p.z - this->z * p.y,
                      this->z * p.x - this->x * p.z,
                      this->x * p.y - this->y * p.x);
     }
-    double dot(Vector3D p){
+    T dot(Vector3 p){
         return this->x * p.x + this->y * p.y + this->z * p.z;
     }
-    double length(){
+    T length(){
         return sqrt(x*x + y*y + z*z);
     }
-    double getAngle(Vector3D p){
-        double dotProduct = this->dot(p);
+    T getAngle(Vector3 p){
+        T dotProduct = this->dot(p);
         return acos(dotProduct / (this->length()* p.length()));
     }
-    void rotate(Vector3D axis, double angle){
-        double axisLength = axis.length();
+    void rotate(Vector3 axis, T angle){
+        T axisLength = axis.length();
         axis.x /= axisLength;
         axis.y /= axisLength;
         axis.z /= axisLength;
 
-        double cosTheta = cos(angle);
-        double sinTheta = sin(angle);
-        double dotProduct = this->dot(axis);
+        T cosTheta = cos(angle);
+        T sinTheta = sin(angle);
+        T dotProduct = this->dot(axis);
 
-        Vector3D p = this->cross(axis);
+        Vector3 p = this->cross(axis);
         p.mul(sinTheta);
         axis.mul(dotProduct * (1 - cosTheta));
         this->mul(cosTheta);
@@ -97,30 +111,32 @@ struct Vector3D{
         this->add(axis);
     }
     void normalize(){
-        double len = this->length();
+        T len = this->length();
         if(len == 0) return;
         this->x /= len;
         this->y /= len;
         this->z /= len;
     }
-    Vector3D operator+(const Vector3D &p) const {
-        return Vector3D(this->x + p.x, this->y + p.y, this->z + p.z);
+    Vector3 operator+(const Vector3 &p) const {
+        return Vector3(this->x + p.x, this->y + p.y, this->z + p.z);
     }
-    Vector3D operator-(const Vector3D &p) const {
-        return Vector3D(this->x - p.x, this->y - p.y, this->z - p.z);
+    Vector3 operator-(const Vector3 &p) const {
+        return Vector3(this->x - p.x, this->y - p.y, this->z - p.z);
     }
-    Vector3D operator*(double a) const {
-        return Vector3D(this->x * a, this->y * a, this->z * a);
+    Vector3 operator*(T a) const {
+        return Vector3(this->x * a, this->y * a, this->z * a);
     }
-    Vector3D operator/(double a) const {
-        if (a == 0) return Vector3D(0, 0, 0);
-        return Vector3D(this->x / a, this->y / a, this->z / a);
+    Vector3 operator/(T a) const {
+        if (a == 0) return Vector3(0, 0, 0);
+        return Vector3(this->x / a, this->y / a, this->z / a);
     }  
-    Vector3D operator-() const {
-        return Vector3D(-x, -y, -z);
+    Vector3 operator-() const {
+        return Vector3(-x, -y, -z);
     }  
 };
 
+typedef Vector3<Real> Vector3D;
+
 struct Camera{
     Vector3D eye,center,up;
     double v = 0.1;
@@ -236,9 +252,16 @@ struct Camera{
     }
 };
 
+// The cone around a ray (coneWidth at start, widening by coneSpread per
+// unit of distance) is the footprint texture filtering uses; it is zero
+// for rays that do not come from the camera.
 struct Ray {
     Vector3D start;
     Vector3D dir;
+    double coneWidth = 0.0;
+    double coneSpread = 0.0;
+
+    Ray() {}
     
     Ray(Vector3D s, Vector3D d) {
         start = s;
@@ -247,6 +270,445 @@ struct Ray {
     }
 };
 
+struct AABB {
+    Vector3D lo, hi;
+
+    AABB() {
+        lo = Vector3D(INFINITY, INFINITY, INFINITY);
+        hi = Vector3D(-INFINITY, -INFINITY, -INFINITY);
+    }
+
+    AABB(const Vector3D &a, const Vector3D &b) {
+        lo = a;
+        hi = b;
+    }
+
+    void expand(const Vector3D &p) {
+        lo = Vector3D(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi = Vector3D(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+
+    void expand(const AABB &b) {
+        expand(b.lo);
+        expand(b.hi);
+    }
+
+    void pad(Real d) {
+        lo = lo - Vector3D(d, d, d);
+        hi = hi + Vector3D(d, d, d);
+    }
+
+    Vector3D centroid() const {
+        return (lo + hi) * 0.5;
+    }
+
+    Real axisMin(int axis) const {
+        return axis == 0 ? lo.x : (axis == 1 ? lo.y : lo.z);
+    }
+
+    Real axisMax(int axis) const {
+        return axis == 0 ? hi.x : (axis == 1 ? hi.y : hi.z);
+    }
+
+    Real surfaceArea() const {
+        Vector3D d = hi - lo;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0.0;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // slab test against [0, tMax]; invDir is 1/dir per component
+    bool intersect(const Ray* r, const Vector3D &invDir, Real tMax) const {
+        Real t0 = 0.0, t1 = tMax;
+
+        Real tx0 = (lo.x - r->start.x) * invDir.x;
+        Real tx1 = (hi.x - r->start.x) * invDir.x;
+        if (tx0 > tx1) swap(tx0, tx1);
+        t0 = tx0 > t0 ? tx0 : t0;
+        t1 = tx1 < t1 ? tx1 : t1;
+
+        Real ty0 = (lo.y - r->start.y) * invDir.y;
+        Real ty1 = (hi.y - r->start.y) * invDir.y;
+        if (ty0 > ty1) swap(ty0, ty1);
+        t0 = ty0 > t0 ? ty0 : t0;
+        t1 = ty1 < t1 ? ty1 : t1;
+
+        Real tz0 = (lo.z - r->start.z) * invDir.z;
+        Real tz1 = (hi.z - r->start.z) * invDir.z;
+        if (tz0 > tz1) swap(tz0, tz1);
+        t0 = tz0 > t0 ? tz0 : t0;
+        t1 = tz1 < t1 ? tz1 : t1;
+
+        return t0 <= t1;
+    }
+};
+
+
+struct Object;
+
+// lets the packet kernels pick a specialised test without a virtual call
+enum ObjectKind {
+    KIND_GENERIC,
+    KIND_SPHERE,
+    KIND_TRIANGLE,
+    KIND_QUADRIC
+};
+
+// Handle to a primitive in the compiled scene (2005024_geometry.h): the
+// primitive type in the top 4 bits and its index in the packed array below.
+typedef uint32_t PrimRef;
+const PrimRef PRIM_NONE = 0xFFFFFFFFu;
+
+enum PrimType {
+    PRIM_SPHERE,
+    PRIM_TRIANGLE,
+    PRIM_QUADRIC,
+    PRIM_OBJECT,    // anything else, intersected through Object::hit
+    PRIM_MESH,      // a whole TriangleMesh (2005024_mesh.h); the triangle is in HitRecord::element
+    PRIM_INSTANCE   // a placed prototype (2005024_instance.h); its prim is in HitRecord::part
+};
+
+inline PrimRef makePrimRef(int type, uint32_t index) {
+    return ((uint32_t)type << 28) | index;
+}
+
+inline int primType(PrimRef ref) {
+    return ref >> 28;
+}
+
+inline uint32_t primIndex(PrimRef ref) {
+    return ref & 0x0FFFFFFFu;
+}
+
+struct Material {
+    double color[3];
+    double coEfficients[4];
+    int shine;
+};
+
+// The scene's materials, referenced by index. add() hands out the index of
+// an equal material when there is one; the list only changes through
+// add(), assign() and clear(), which keep that index in step with it.
+struct MaterialTable {
+    vector<Material> list;
+    map<array<double, 8>, int> index;
+
+    static array<double, 8> key(const Material& m) {
+        return {m.color[0], m.color[1], m.color[2],
+                m.coEfficients[0], m.coEfficients[1], m.coEfficients[2],
+                m.coEfficients[3], (double)m.shine};
+    }
+
+    int add(const Material& m) {
+        auto it = index.emplace(key(m), (int)list.size());
+        if (it.second) list.push_back(m);
+        return it.first->second;
+    }
+
+    void assign(vector<Material>&& replacement) {
+        list = move(replacement);
+        index.clear();
+        for (size_t i = 0; i < list.size(); i++) {
+            index.emplace(key(list[i]), i);
+        }
+    }
+
+    void clear() {
+        list.clear();
+        index.clear();
+    }
+
+    const Material& operator[](size_t i) const { return list[i]; }
+    const Material* data() const { return list.data(); }
+    size_t size() const { return list.size(); }
+};
+
+// Result of a geometric query, filled in one pass so shading does not have
+// to intersect the winning object again. u, v hold the barycentric
+// coordinates of triangle hits and the plane coordinates of floor hits.
+// obj is only set for PRIM_OBJECT hits, whose colour comes from getColorAt.
+struct HitRecord {
+    Real t;
+    Vector3D point;
+    Vector3D normal;
+    Object* obj;
+    PrimRef prim;
+    uint32_t element;       // triangle within the mesh hit, directly or inside an instance
+    PrimRef part;           // prim within the prototype for PRIM_INSTANCE hits
+    int material;
+    Real u, v;
+
+    HitRecord() {
+        t = -1.0;
+        obj = nullptr;
+        prim = PRIM_NONE;
+        element = 0;
+        part = PRIM_NONE;
+        material = -1;
+        u = v = 0.0;
+    }
+};
+
+// What classifyQuadric recognises. The axis-aligned shapes are kept in the
+// form w.x (x - c.x)^2 + w.y (y - c.y)^2 + w.z (z - c.z)^2 = k, which needs
+// a third of the general quadratic's multiplies.
+enum QuadricShape : int32_t {
+    QUADRIC_GENERAL,    // cross terms, paraboloids: all ten coefficients
+    QUADRIC_PLANE,      // no second-order terms: G x + H y + I z + J = 0
+    QUADRIC_SPHERE,     // A = B = C, no cross terms; w = (1, 1, 1), k = r^2
+    QUADRIC_CYLINDER,   // one square term and its linear term missing (the axis)
+    QUADRIC_CENTERED    // other axis-aligned ones: cones (k = 0), ellipsoids, hyperboloids
+};
+
+struct PackedQuadric {
+    Real A, B, C, D, E, F, G, H, I, J;
+    Vector3D cubeRef;
+    Real cubeLength, cubeWidth, cubeHeight;
+    // set by classifyQuadric
+    int32_t shape;
+    int32_t axis;               // the cylinder's axis
+    Vector3D center, weight;
+    Real k;
+    AABB clip;                  // the clipping cube, padded; unbounded along unclipped axes
+    int32_t clipTest;           // no finite bounds: test rays against clip first
+    int32_t reserved;
+};
+
+// Bounds of a classified quadric; false when some axis is unbounded. An
+// axis is finite when the clipping cube limits it, or, for the axis-aligned
+// shapes, when its weight is positive and every negative-weight axis is
+// clipped: w_i (x_i - c_i)^2 is then at most k plus the clipped axes'
+// largest -w_j (x_j - c_j)^2. That covers ellipsoids, cylinders clipped
+// along their axis and cones clipped along theirs.
+bool quadricBounds(const PackedQuadric& g, AABB& box) {
+    Real ref[3] = {g.cubeRef.x, g.cubeRef.y, g.cubeRef.z};
+    Real dim[3] = {g.cubeLength, g.cubeWidth, g.cubeHeight};
+    Real lo[3], hi[3];
+    for (int i = 0; i < 3; i++) {
+        lo[i] = dim[i] > 0 ? ref[i] : -INFINITY;
+        hi[i] = dim[i] > 0 ? ref[i] + dim[i] : INFINITY;
+    }
+
+    if (g.shape == QUADRIC_SPHERE || g.shape == QUADRIC_CYLINDER || g.shape == QUADRIC_CENTERED) {
+        Real w[3] = {g.weight.x, g.weight.y, g.weight.z};
+        Real c[3] = {g.center.x, g.center.y, g.center.z};
+        Real spare = g.k;
+        bool limited = true;
+        for (int j = 0; j < 3; j++) {
+            if (w[j] >= 0) continue;
+            if (dim[j] <= 0) limited = false;
+            else spare -= w[j] * max((lo[j] - c[j]) * (lo[j] - c[j]), (hi[j] - c[j]) * (hi[j] - c[j]));
+        }
+        // spare < 0 leaves no real surface
+        if (limited && spare < 0) return false;
+        for (int i = 0; i < 3 && limited; i++) {
+            if (w[i] <= 0) continue;
+            Real ext = sqrt(spare / w[i]);
+            lo[i] = max(lo[i], c[i] - ext);
+            hi[i] = min(hi[i], c[i] + ext);
+        }
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (isinf(lo[i]) || isinf(hi[i])) return false;
+    }
+    box = AABB(Vector3D(lo[0], lo[1], lo[2]), Vector3D(hi[0], hi[1], hi[2]));
+    box.pad(EPSILON + 1e-9 * max(box.hi.length(), box.lo.length()));
+    return true;
+}
+
+// shape, clip and the axis-aligned form of g
+void classifyShape(PackedQuadric& g) {
+    Real ref[3] = {g.cubeRef.x, g.cubeRef.y, g.cubeRef.z};
+    Real dim[3] = {g.cubeLength, g.cubeWidth, g.cubeHeight};
+    Real lo[3], hi[3];
+    for (int i = 0; i < 3; i++) {
+        // padded so rounding never rejects a hit the exact bounds check accepts
+        Real pad = 1e-7 * (1.0 + fabs(ref[i]) + fabs(ref[i] + dim[i]));
+        lo[i] = dim[i] > 0 ? ref[i] - pad : -INFINITY;
+        hi[i] = dim[i] > 0 ? ref[i] + dim[i] + pad : INFINITY;
+    }
+    g.clip = AABB(Vector3D(lo[0], lo[1], lo[2]), Vector3D(hi[0], hi[1], hi[2]));
+
+    g.shape = QUADRIC_GENERAL;
+    g.axis = -1;
+    g.center = g.weight = Vector3D(0, 0, 0);
+    g.k = 0.0;
+    if (g.D != 0 || g.E != 0 || g.F != 0) return;
+    if (g.A == 0 && g.B == 0 && g.C == 0) {
+        if (g.G != 0 || g.H != 0 || g.I != 0) g.shape = QUADRIC_PLANE;
+        return;
+    }
+
+    Real square[3] = {g.A, g.B, g.C}, linear[3] = {g.G, g.H, g.I};
+    Real c[3];
+    int missing = -1;
+    Real k = -g.J;
+    for (int i = 0; i < 3; i++) {
+        if (square[i] == 0) {
+            // a linear term without its square is a paraboloid
+            if (linear[i] != 0 || missing >= 0) return;
+            missing = i;
+            c[i] = 0.0;
+        } else {
+            c[i] = -linear[i] / (2 * square[i]);
+            k += square[i] * c[i] * c[i];
+        }
+    }
+    g.center = Vector3D(c[0], c[1], c[2]);
+    g.weight = Vector3D(square[0], square[1], square[2]);
+    g.k = k;
+    if (missing >= 0) {
+        g.shape = QUADRIC_CYLINDER;
+        g.axis = missing;
+    } else if (g.A == g.B && g.B == g.C) {
+        g.shape = QUADRIC_SPHERE;
+        g.weight = Vector3D(1, 1, 1);
+        g.k = k / g.A;
+    } else {
+        g.shape = QUADRIC_CENTERED;
+    }
+}
+
+// derived fields of g from its coefficients and clipping cube
+void classifyQuadric(PackedQuadric& g) {
+    classifyShape(g);
+    // with finite bounds the BVH already rejects what the clip test would
+    AABB box;
+    g.clipTest = !quadricBounds(g, box) && (g.cubeLength > 0 || g.cubeWidth > 0 || g.cubeHeight > 0);
+    g.reserved = 0;
+}
+
+PackedQuadric makePackedQuadric(const double* q, const Vector3D& cubeRef,
+                                Real cubeLength, Real cubeWidth, Real cubeHeight) {
+    PackedQuadric g;
+    g.A = q[0]; g.B = q[1]; g.C = q[2]; g.D = q[3]; g.E = q[4];
+    g.F = q[5]; g.G = q[6]; g.H = q[7]; g.I = q[8]; g.J = q[9];
+    g.cubeRef = cubeRef;
+    g.cubeLength = cubeLength;
+    g.cubeWidth = cubeWidth;
+    g.cubeHeight = cubeHeight;
+    classifyQuadric(g);
+    return g;
+}
+
+// The box around the ray's segment over [0, tMax] against the clipping
+// cube. Slab entry and exit distances would also cut rays that cross the
+// cube's axis ranges at different times, but they need a division per
+// axis, which costs more than the quadratic they would save.
+bool quadricClipOverlaps(const PackedQuadric& g, const Ray* r, Real tMax) {
+    Real o[3] = {r->start.x, r->start.y, r->start.z};
+    Real d[3] = {r->dir.x, r->dir.y, r->dir.z};
+    for (int i = 0; i < 3; i++) {
+        Real end = d[i] == 0 ? o[i] : o[i] + d[i] * tMax;
+        if (max(o[i], end) < g.clip.axisMin(i) || min(o[i], end) > g.clip.axisMax(i)) return false;
+    }
+    return true;
+}
+
+// Coefficients of a t^2 + 2 hb t + c = 0 along the ray, specialised by shape.
+// The packet kernel evaluates exactly the same expressions.
+void quadricCoefficients(const PackedQuadric& g, const Ray* r, Real& a, Real& hb, Real& c) {
+    Real x0 = r->start.x, y0 = r->start.y, z0 = r->start.z;
+    Real dx = r->dir.x, dy = r->dir.y, dz = r->dir.z;
+    switch (g.shape) {
+        case QUADRIC_PLANE: {
+            a = 0.0;
+            hb = 0.5 * (g.G*dx + g.H*dy + g.I*dz);
+            c = g.G*x0 + g.H*y0 + g.I*z0 + g.J;
+            break;
+        }
+        case QUADRIC_SPHERE: {
+            Real X = x0 - g.center.x, Y = y0 - g.center.y, Z = z0 - g.center.z;
+            a = dx*dx + dy*dy + dz*dz;
+            hb = X*dx + Y*dy + Z*dz;
+            c = X*X + Y*Y + Z*Z - g.k;
+            break;
+        }
+        case QUADRIC_CYLINDER: {
+            // the two axes across the cylinder
+            Real o[3] = {x0 - g.center.x, y0 - g.center.y, z0 - g.center.z};
+            Real d[3] = {dx, dy, dz};
+            Real w[3] = {g.weight.x, g.weight.y, g.weight.z};
+            int u = g.axis == 0 ? 1 : 0, v = g.axis == 2 ? 1 : 2;
+            a = w[u]*d[u]*d[u] + w[v]*d[v]*d[v];
+            hb = w[u]*o[u]*d[u] + w[v]*o[v]*d[v];
+            c = w[u]*o[u]*o[u] + w[v]*o[v]*o[v] - g.k;
+            break;
+        }
+        case QUADRIC_CENTERED: {
+            Real X = x0 - g.center.x, Y = y0 - g.center.y, Z = z0 - g.center.z;
+            Real wx = g.weight.x, wy = g.weight.y, wz = g.weight.z;
+            a = wx*dx*dx + wy*dy*dy + wz*dz*dz;
+            hb = wx*X*dx + wy*Y*dy + wz*Z*dz;
+            c = wx*X*X + wy*Y*Y + wz*Z*Z - g.k;
+            break;
+        }
+        default: {
+            Real A = g.A, B = g.B, C = g.C, D = g.D, E = g.E;
+            Real F = g.F, G = g.G, H = g.H, I = g.I, J = g.J;
+            a = A*dx*dx + B*dy*dy + C*dz*dz + D*dx*dy + E*dx*dz + F*dy*dz;
+            hb = 0.5 * (2*A*x0*dx + 2*B*y0*dy + 2*C*z0*dz + D*(x0*dy + y0*dx) +
+                        E*(x0*dz + z0*dx) + F*(y0*dz + z0*dy) + G*dx + H*dy + I*dz);
+            c = A*x0*x0 + B*y0*y0 + C*z0*z0 + D*x0*y0 + E*x0*z0 + F*y0*z0 +
+                G*x0 + H*y0 + I*z0 + J;
+            break;
+        }
+    }
+}
+
+// Roots of a t^2 + 2 hb t + c = 0 in ascending order, false when there
+// are none. q = -(hb + sign(hb) sqrt(hb^2 - a c)) never cancels, and the
+// roots are q / a and c / q; a = 0 leaves the one root of 2 hb t + c.
+bool solveQuadratic(Real a, Real hb, Real c, Real& t1, Real& t2) {
+    if (a == 0) {
+        if (hb == 0) return false;
+        t1 = t2 = -c / (2 * hb);
+        return true;
+    }
+    Real discriminant = hb*hb - a*c;
+    if (discriminant < 0) return false;
+    Real root = sqrt(discriminant);
+    Real q = -(hb + (hb < 0 ? -root : root));
+    t1 = q / a;
+    t2 = q == 0 ? t1 : c / q;
+    if (t1 > t2) swap(t1, t2);
+    return true;
+}
+
+bool quadricInClip(const PackedQuadric& g, const Ray* r, Real t) {
+    Vector3D point = r->start + r->dir * t;
+    if (g.cubeLength > 0) {
+        if (point.x < g.cubeRef.x || point.x > g.cubeRef.x + g.cubeLength) return false;
+    }
+    if (g.cubeWidth > 0) {
+        if (point.y < g.cubeRef.y || point.y > g.cubeRef.y + g.cubeWidth) return false;
+    }
+    if (g.cubeHeight > 0) {
+        if (point.z < g.cubeRef.z || point.z > g.cubeRef.z + g.cubeHeight) return false;
+    }
+    return true;
+}
+
+// nearest positive root inside the clipping cube and before tMax
+bool hitPackedQuadric(const PackedQuadric& g, const Ray* r, Real tMax, Real& tHit) {
+    if (g.clipTest && !quadricClipOverlaps(g, r, tMax)) return false;
+
+    Real a, hb, c, t1, t2;
+    quadricCoefficients(g, r, a, hb, c);
+    if (!solveQuadratic(a, hb, c, t1, t2)) return false;
+
+    Real t = -1.0;
+    if (t1 > 0 && quadricInClip(g, r, t1)) {
+        t = t1;
+    } else if (t2 > 0 && quadricInClip(g, r, t2)) {
+        t = t2;
+    }
+    if (t <= 0 || t >= tMax) return false;
+    tHit = t;
+    return true;
+}
+
+void computePhongLighting(const HitRecord& hit, double* color, Ray* r, int level);
 
 struct Object {
     Vector3D reference_point;
@@ -254,19 +716,70 @@ struct Object {
     double color[3];
     double coEfficients[4];
     int shine;
+    int kind;
+    // assigned when the scene is compiled into packed arrays
+    PrimRef primRef;
+    int materialId;
     
     Object() {
         color[0] = color[1] = color[2] = 0.0;
         coEfficients[0] = coEfficients[1] = coEfficients[2] = coEfficients[3] = 0.0;
         shine = 0;
+        kind = KIND_GENERIC;
+        primRef = PRIM_NONE;
+        materialId = -1;
     }
     
     virtual ~Object() {}
     
     virtual void draw() {}
     
-    virtual double intersect(Ray* r, double* color, int level) {
-        return -1.0;
+    // Nearest hit of this object along r if it lies before tMax. Fills t,
+    // obj and the surface parameters; point and normal are left to
+    // finalizeHit so they are only computed for the winning object.
+    virtual bool hit(Ray* r, Real tMax, HitRecord& rec) {
+        return false;
+    }
+
+    void setHit(HitRecord& rec, Real t, Real u, Real v) {
+        rec.t = t;
+        rec.obj = this;
+        rec.prim = primRef;
+        rec.material = materialId;
+        rec.u = u;
+        rec.v = v;
+    }
+
+    void finalizeHit(Ray* r, HitRecord& rec) {
+        rec.point = r->start + r->dir * rec.t;
+        rec.normal = getNormalAt(rec.point);
+    }
+
+    Material getMaterial() const {
+        Material m;
+        for (int i = 0; i < 3; i++) m.color[i] = color[i];
+        for (int i = 0; i < 4; i++) m.coEfficients[i] = coEfficients[i];
+        m.shine = shine;
+        return m;
+    }
+
+    // level 0 only reports the distance; otherwise the hit is also shaded into color
+    double intersect(Ray* r, double* color, int level) {
+        HitRecord rec;
+        if (!hit(r, INFINITY, rec)) {
+            return -1.0;
+        }
+        if (level == 0) {
+            return rec.t;
+        }
+        finalizeHit(r, rec);
+        computePhongLighting(rec, color, r, level);
+        return rec.t;
+    }
+
+    // false for objects with no finite extent; those stay out of the BVH
+    virtual bool getBounds(AABB& box) {
+        return false;
     }
     
     void setColor(double r, double g, double b) {
@@ -287,14 +800,25 @@ struct Object {
     }
     
     virtual Vector3D getNormalAt(Vector3D point) = 0;
-    virtual double* getColorAt(Vector3D point) = 0;
+    // writes into caller-owned storage so shading can run on several threads
+    virtual void getColorAt(Vector3D point, double* outColor) = 0;
+
+    // colour averaged over a patch footprint wide around point; only
+    // textured surfaces filter
+    virtual void sampleColorAt(Vector3D point, double footprint, double* outColor) {
+        getColorAt(point, outColor);
+    }
 };
 
 
+// Lights have no falloff unless given a range: then the contribution fades
+// with rangeWindow and is exactly zero from the range on, which is what
+// lets LightGrid leave the light out of cells beyond it.
 struct PointLight {
     Vector3D position;
     double color[3];
     double intensity;
+    double range = INFINITY;
     
     PointLight(Vector3D pos, double r, double g, double b, double intensity = 1.5) {
         position = pos;
@@ -310,6 +834,7 @@ struct PointLight {
         color[1] = other.color[1];
         color[2] = other.color[2];
         intensity = other.intensity;
+        range = other.range;
     }
     
     void setColor(double r, double g, double b) {
@@ -327,13 +852,16 @@ struct SpotLight {
     Vector3D position;
     Vector3D direction;
     double angle; 
+    double cosAngle;            // cos of angle, the cone test without acos
     double color[3];
     double intensity;
+    double range = INFINITY;
     
     SpotLight(Vector3D pos, Vector3D dir, double angle, double r, double g, double b, double intensity = 1.5) {
         position = pos;
         direction = dir;
         this->angle = angle;
+        cosAngle = cos(angle * M_PI / 180.0);
         color[0] = r;
         color[1] = g;
         color[2] = b;
@@ -344,10 +872,12 @@ struct SpotLight {
         position = other.position;
         direction = other.direction;
         angle = other.angle;
+        cosAngle = other.cosAngle;
         color[0] = other.color[0];
         color[1] = other.color[1];
         color[2] = other.color[2];
         intensity = other.intensity;
+        range = other.range;
     }
 
 
@@ -364,169 +894,568 @@ struct SpotLight {
 };
 
 extern vector<Object*> objects;
+extern MaterialTable materials;
 extern vector<PointLight> pointLights;
 extern vector<SpotLight> spotLights;
 extern int recursion_level;
+extern bool hdrShading;
+
+// implemented by the compiled scene in 2005024_geometry.h
+bool findNearestHit(Ray* r, HitRecord& rec);
+// light numbers point lights first, then spot lights; it keys the occluder cache.
+// self (with selfPart inside an instance) is the shaded prim, which is skipped.
+bool occluded(const Vector3D& origin, const Vector3D& target, PrimRef self, PrimRef selfPart, int light);
 
-void computePhongLighting(Object* obj, const Vector3D& intersectionPoint,double* color,Ray* r,int level) {
-    Vector3D normal = obj->getNormalAt(intersectionPoint);
+// What the light loop needs about a hit. Shared by the recursive tracer
+// below and the wavefront tracer (2005024_wavefront.h) so both evaluate
+// exactly the same expressions.
+struct ShadingPoint {
+    Material mat;
+    Vector3D point;
+    Vector3D normal;        // flipped to face the incoming ray
+    Vector3D viewDir;
+    double surfaceColor[3];
+    PrimRef prim;
+    PrimRef part;           // HitRecord::part, for instance hits
+    double coneWidth;       // of the ray's cone where it hit
+};
 
-    if(r->dir.dot(normal) > 0) {
-        normal = -normal;
+// fills sp from the hit seen along r and writes the ambient term into color
+void prepareShading(const HitRecord& hit, const Ray* r, ShadingPoint& sp, double* color) {
+    sp.mat = hit.material >= 0 ? materials[hit.material] : hit.obj->getMaterial();
+    sp.point = hit.point;
+    sp.prim = hit.prim;
+    sp.part = hit.part;
+    sp.normal = hit.normal;
+
+    Vector3D dir = r->dir;
+    if (dir.dot(sp.normal) > 0) {
+        sp.normal = -sp.normal;
     }
 
-    double* intersectionPointColor = obj->getColorAt(intersectionPoint);
-    color[0] = intersectionPointColor[0] * obj->coEfficients[0];
-    color[1] = intersectionPointColor[1] * obj->coEfficients[0];
-    color[2] = intersectionPointColor[2] * obj->coEfficients[0];
+    sp.viewDir = (r->start - sp.point);
+    sp.viewDir.normalize();
 
-    for (const auto& pl : pointLights) {
-        Vector3D lightDir = pl.position - intersectionPoint;
-        double lightDistance = lightDir.length();
-        lightDir.normalize();
+    sp.coneWidth = r->coneWidth + r->coneSpread * hit.t;
+    if (hit.obj != nullptr) {
+        // the cone cuts an ellipse stretched by 1 / cos along one axis; the
+        // filter width is the geometric mean of the axes (same area)
+        double cosine = max((double)fabs(dir.dot(sp.normal)), 1e-6);
+        hit.obj->sampleColorAt(sp.point, sp.coneWidth / sqrt(cosine), sp.surfaceColor);
+    } else {
+        sp.surfaceColor[0] = sp.mat.color[0];
+        sp.surfaceColor[1] = sp.mat.color[1];
+        sp.surfaceColor[2] = sp.mat.color[2];
+    }
+    color[0] = sp.surfaceColor[0] * sp.mat.coEfficients[0];
+    color[1] = sp.surfaceColor[1] * sp.mat.coEfficients[0];
+    color[2] = sp.surfaceColor[2] * sp.mat.coEfficients[0];
+}
 
-        Ray shadowRay(pl.position, intersectionPoint - pl.position);
-        bool inShadow = false;
-        for (Object* other : objects) {
-            if (other != obj) {
-                double t = other->intersect(&shadowRay, nullptr, 0);
-                if (t > EPSILON && t < (lightDistance - EPSILON)) {
-                    inShadow = true;
-                    break;
-                }
+int lightCount() {
+    return pointLights.size() + spotLights.size();
+}
+
+// (1 - (d / range)^4)^2 for a point d2 = d^2 from the light; 0 from the
+// range on
+inline double rangeWindow(double d2, double range) {
+    double x = d2 / (range * range);
+    if (x >= 1.0) return 0.0;
+    double w = 1.0 - x * x;
+    return w * w;
+}
+
+// Position, colour and intensity of light li (point lights first, then spot
+// lights); false when point lies outside the cone of a spot light or beyond
+// the range of either.
+bool lightReaches(int li, const Vector3D& point, Vector3D& position,
+                  const double*& lightColor, double& intensity) {
+    if (li < (int)pointLights.size()) {
+        const PointLight& pl = pointLights[li];
+        position = pl.position;
+        lightColor = pl.color;
+        intensity = pl.intensity;
+        if (pl.range < INFINITY) {
+            Vector3D d = pl.position - point;
+            double window = rangeWindow(d.dot(d), pl.range);
+            if (window == 0.0) return false;
+            intensity *= window;
+        }
+        return true;
+    }
+
+    const SpotLight& sl = spotLights[li - pointLights.size()];
+    Vector3D lightDir = sl.position - point;
+    double d2 = lightDir.dot(lightDir);
+    lightDir.normalize();
+    // the cosine decides; acos only settles points within rounding of the
+    // edge, where it keeps the original angle comparison's answer
+    double c = lightDir.dot(-sl.direction);
+    if (c < sl.cosAngle - 1e-9) return false;
+    if (c <= sl.cosAngle + 1e-9 && acos(c) * 180.0 / M_PI > sl.angle) return false;
+
+    position = sl.position;
+    lightColor = sl.color;
+    intensity = sl.intensity;
+    if (sl.range < INFINITY) {
+        double window = rangeWindow(d2, sl.range);
+        if (window == 0.0) return false;
+        intensity *= window;
+    }
+    return true;
+}
+
+// intensity times the colour sum; what LightSampler draws by
+double lightPower(int li) {
+    const double* c;
+    double intensity;
+    if (li < (int)pointLights.size()) {
+        c = pointLights[li].color;
+        intensity = pointLights[li].intensity;
+    } else {
+        c = spotLights[li - pointLights.size()].color;
+        intensity = spotLights[li - pointLights.size()].intensity;
+    }
+    return max(0.0, intensity * (c[0] + c[1] + c[2]));
+}
+
+// Walker's alias table over a list of lights, weighted by lightPower.
+// Drawing a light costs O(1) whatever the list length.
+struct LightSampler {
+    vector<int> lights;             // ascending light numbers
+    vector<double> probability;     // of drawing lights[k]
+    vector<double> threshold;
+    vector<int> alias;
+    double total = 0.0;             // power of the whole list
+
+    size_t size() const {
+        return lights.size();
+    }
+
+    // Vose's construction; uniform when every light is black
+    void build(vector<int> list) {
+        lights = move(list);
+        int n = lights.size();
+        vector<double> power(n);
+        total = 0.0;
+        for (int k = 0; k < n; k++) {
+            power[k] = lightPower(lights[k]);
+            total += power[k];
+        }
+
+        probability.assign(n, 0.0);
+        threshold.assign(n, 1.0);
+        alias.assign(n, 0);
+        vector<double> scaled(n);
+        vector<int> small, large;
+        for (int k = 0; k < n; k++) {
+            probability[k] = total > 0.0 ? power[k] / total : 1.0 / n;
+            scaled[k] = probability[k] * n;
+            (scaled[k] < 1.0 ? small : large).push_back(k);
+        }
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(), l = large.back();
+            small.pop_back();
+            threshold[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
             }
         }
-        if (!inShadow) {
-            double lambert = max(0.0, normal.dot(lightDir));
+        // leftovers are 1 up to rounding
+        for (int k : small) threshold[k] = 1.0;
+        for (int k : large) threshold[k] = 1.0;
+    }
 
-            Vector3D reflectDir = lightDir - normal * (2.0 * normal.dot(lightDir));
-            reflectDir.normalize();
+    // position in lights for two uniforms in [0, 1)
+    int sample(double u1, double u2) const {
+        int n = threshold.size();
+        int column = min((int)(u1 * n), n - 1);
+        return u2 < threshold[column] ? column : alias[column];
+    }
 
-            Vector3D viewDir = (r->start - intersectionPoint);
-            viewDir.normalize();
+    size_t memoryBytes() const {
+        return lights.size() * (2 * sizeof(int) + 2 * sizeof(double));
+    }
+};
 
-            double phong = max(0.0, viewDir.dot(reflectDir));
+// Uniform grid over the region where shading happens, listing per cell the
+// lights whose range and cone can reach it, so shading visits only the
+// lights near the point. Point lights without a range go to everywhere and
+// are visited at every point; points outside the region visit every light.
+// Every list is in ascending light order, so culled shading sums in the
+// same order as the full loop, and each carries its alias table for
+// many-light sampling.
+struct LightGrid {
+    AABB box;
+    int dims[3] = {0, 0, 0};
+    Vector3D cellSize;
+    LightSampler everywhere;
+    LightSampler bounded;           // the rest, for points outside the region
+    vector<LightSampler> cells;     // x fastest, then y, then z
 
-            for (int i = 0; i < 3; i++) {
-                color[i] += pl.color[i] * pl.intensity * obj->coEfficients[1] * lambert * intersectionPointColor[i];
-                color[i] += pl.color[i] * pl.intensity * obj->coEfficients[2] * pow(phong, obj->shine);
+    // cell bounds that might intersect a light's sphere or cone
+    static bool cellMayReach(const Vector3D& position, double range, const Vector3D* axis,
+                             double angle, const AABB& cell) {
+        if (range < INFINITY) {
+            double d2 = 0.0;
+            for (int a = 0; a < 3; a++) {
+                double p = a == 0 ? position.x : (a == 1 ? position.y : position.z);
+                double e = max(cell.axisMin(a) - p, max(0.0, p - cell.axisMax(a)));
+                d2 += e * e;
             }
+            if (d2 >= range * range) return false;
         }
+        if (axis == nullptr || angle >= 180.0) return true;
+
+        // the cone against the cell's bounding sphere
+        Vector3D center = cell.centroid();
+        Vector3D half = cell.hi - center;
+        double radius = sqrt(half.dot(half));
+        Vector3D v = center - position;
+        double distance = sqrt(v.dot(v));
+        if (distance <= radius) return true;
+        double toAxis = acos(max(-1.0, min(1.0, v.dot(*axis) / distance)));
+        double spread = asin(radius / distance);
+        return toAxis - spread <= angle * M_PI / 180.0 + 1e-6;
     }
 
-    for (const auto& sl : spotLights) {
-        Vector3D lightDir = sl.position - intersectionPoint;
-        double lightDistance = lightDir.length();
-        lightDir.normalize();
-        double angle = acos(lightDir.dot(-sl.direction)) * 180.0 / M_PI;
-        if (angle > sl.angle) continue;
+    // region is where shading points can lie, e.g. the scene's bounds
+    void build(const AABB& region) {
+        box = region;
+        dims[0] = dims[1] = dims[2] = 0;
+        cells.clear();
+
+        int n = lightCount();
+        vector<int> unlimited, limited;
+        for (int li = 0; li < n; li++) {
+            // a cone can miss part of the region even without a range
+            bool reachBounded = li >= (int)pointLights.size() || pointLights[li].range < INFINITY;
+            (reachBounded ? limited : unlimited).push_back(li);
+        }
+        Vector3D extent = region.hi - region.lo;
+        if (limited.empty() || !(extent.x >= 0 && extent.y >= 0 && extent.z >= 0)) {
+            unlimited.clear();
+            for (int li = 0; li < n; li++) unlimited.push_back(li);
+            limited.clear();
+        }
+        everywhere.build(move(unlimited));
+        bounded.build(limited);
+        if (limited.empty()) return;
+
+        // about 16 cells per light, 32768 at most, as cubic as the region allows
+        double target = min(32768.0, max(64.0, 16.0 * limited.size()));
+        double e[3] = {max((double)extent.x, 1e-9), max((double)extent.y, 1e-9), max((double)extent.z, 1e-9)};
+        double side = cbrt(e[0] * e[1] * e[2] / target);
+        for (int a = 0; a < 3; a++) dims[a] = max(1, min(64, (int)ceil(e[a] / side)));
+        cellSize = Vector3D(e[0] / dims[0], e[1] / dims[1], e[2] / dims[2]);
+
+        // points are binned with rounding; padded cells still see every
+        // light that reaches a point binned into them
+        double pad = 1e-7 * max(cellSize.x, max(cellSize.y, cellSize.z));
 
+        vector<vector<int>> lists(dims[0] * dims[1] * dims[2]);
+        for (int li : limited) {
+            Vector3D position;
+            double range;
+            const Vector3D* axis = nullptr;
+            double angle = 180.0;
+            if (li < (int)pointLights.size()) {
+                position = pointLights[li].position;
+                range = pointLights[li].range;
+            } else {
+                const SpotLight& sl = spotLights[li - pointLights.size()];
+                position = sl.position;
+                range = sl.range;
+                axis = &sl.direction;
+                angle = sl.angle;
+            }
 
-        Ray shadowRay(sl.position, intersectionPoint - sl.position);
-        bool inShadow = false;
-        for (Object* other : objects) {
-            if (other != obj) {
-                double t = other->intersect(&shadowRay, nullptr, 0);
-                if (t > EPSILON && t < (lightDistance - EPSILON)) {
-                    inShadow = true;
-                    break;
+            // only cells overlapping the range's box are candidates
+            int lo[3] = {0, 0, 0}, hi[3] = {dims[0] - 1, dims[1] - 1, dims[2] - 1};
+            if (range < INFINITY) {
+                AABB reach(position, position);
+                reach.pad(range);
+                cellOf(reach.lo, lo);
+                cellOf(reach.hi, hi);
+            }
+            for (int z = lo[2]; z <= hi[2]; z++) {
+                for (int y = lo[1]; y <= hi[1]; y++) {
+                    for (int x = lo[0]; x <= hi[0]; x++) {
+                        AABB cell = cellBox(x, y, z);
+                        cell.pad(pad);
+                        if (cellMayReach(position, range, axis, angle, cell)) {
+                            lists[(z * dims[1] + y) * dims[0] + x].push_back(li);
+                        }
+                    }
                 }
             }
         }
-        if (!inShadow) {
-            double lambert = max(0.0, normal.dot(lightDir));
-            
-            Vector3D reflectDir = lightDir - normal * (2.0 * normal.dot(lightDir));
-            reflectDir.normalize();
 
-            Vector3D viewDir = (r->start - intersectionPoint);
-            viewDir.normalize();
+        cells.resize(lists.size());
+        for (size_t c = 0; c < lists.size(); c++) cells[c].build(move(lists[c]));
+    }
 
-            double phong = max(0.0, viewDir.dot(reflectDir));
-            for (int i = 0; i < 3; i++) {
-                color[i] += sl.color[i] * sl.intensity * obj->coEfficients[1] * lambert * intersectionPointColor[i];
-                color[i] += sl.color[i] * sl.intensity *obj->coEfficients[2] * pow(phong, obj->shine);
-            }
+    // cell of p, clamped into the grid
+    void cellOf(const Vector3D& p, int* k) const {
+        double rel[3] = {(p.x - box.lo.x) / cellSize.x, (p.y - box.lo.y) / cellSize.y,
+                         (p.z - box.lo.z) / cellSize.z};
+        for (int a = 0; a < 3; a++) k[a] = (int)max(0.0, min((double)dims[a] - 1, floor(rel[a])));
+    }
+
+    AABB cellBox(int x, int y, int z) const {
+        Vector3D lo(box.lo.x + x * cellSize.x, box.lo.y + y * cellSize.y, box.lo.z + z * cellSize.z);
+        return AABB(lo, lo + cellSize);
+    }
+
+    // the lights besides everywhere that may reach p
+    const LightSampler& localLights(const Vector3D& p) const {
+        if (dims[0] == 0 || p.x < box.lo.x || p.y < box.lo.y || p.z < box.lo.z ||
+            p.x > box.hi.x || p.y > box.hi.y || p.z > box.hi.z) {
+            return bounded;
         }
+        int k[3];
+        cellOf(p, k);
+        return cells[(k[2] * dims[1] + k[1]) * dims[0] + k[0]];
+    }
+
+    size_t cellEntries() const {
+        size_t n = 0;
+        for (const LightSampler& cell : cells) n += cell.size();
+        return n;
+    }
+
+    size_t memoryBytes() const {
+        size_t n = everywhere.memoryBytes() + bounded.memoryBytes() + cells.size() * sizeof(LightSampler);
+        for (const LightSampler& cell : cells) n += cell.memoryBytes();
+        return n;
+    }
+};
+
+extern LightGrid lightGrid;
+extern int lightSamples;        // 0 evaluates every light
+extern int lightPass;           // varies the draws from pass to pass
+
+inline uint64_t mixBits(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// uniform doubles in [0, 1) from the same mixer forEachLight draws with,
+// for the tools that generate scenes and rays from a seed
+struct SeededRandom {
+    uint64_t state;
+
+    SeededRandom(uint64_t seed) {
+        state = mixBits(seed);
+    }
+
+    double uniform() {
+        state = mixBits(state);
+        return (state >> 11) * 0x1.0p-53;
+    }
+
+    double range(double lo, double hi) {
+        return lo + (hi - lo) * uniform();
+    }
+
+    // standard normal, Box-Muller
+    double normal() {
+        double u = max(uniform(), 1e-300);
+        return sqrt(-2 * log(u)) * cos(2 * M_PI * uniform());
     }
 
-    if (level < recursion_level && obj->coEfficients[3] > 0) {
-        Vector3D reflectDir = r->dir - normal * (2.0 * r->dir.dot(normal));
-        reflectDir.normalize();
-        Vector3D reflectStart = intersectionPoint + normal * EPSILON;
-        Ray reflectRay(reflectStart, reflectDir);
+    Vector3D unitVector() {
+        double z = range(-1.0, 1.0);
+        double phi = range(0.0, 2 * M_PI);
+        double s = sqrt(max(0.0, 1 - z * z));
+        return Vector3D(s * cos(phi), s * sin(phi), z);
+    }
+};
 
-        double minT = -1.0;
-        Object* nearest = nullptr;
-        for (Object* other : objects) {
-            double t = other->intersect(&reflectRay, nullptr, 0);
-            if (t > 0 && (minT < 0 || t < minT)) {
-                minT = t;
-                nearest = other;
+// Calls visit(light, weight) for the lights shading point should sum, in
+// the order they are summed: every light lightGrid finds near the point
+// with weight 1, or, when there are more of those than lightSamples,
+// lightSamples draws among them by power, weighted 1 / (lightSamples * p),
+// which has the full sum as its expectation. The draws are seeded by the
+// point rounded to a 1/1024 grid, so both tracers, every packet ISA (whose
+// hits may differ in the last bit) and any thread count pick the same
+// lights.
+template <typename F>
+void forEachLight(const Vector3D& point, int level, F visit) {
+    const LightSampler& global = lightGrid.everywhere;
+    const LightSampler& local = lightGrid.localLights(point);
+    if (lightSamples <= 0 || global.size() + local.size() <= (size_t)lightSamples) {
+        // merge the two ascending lists
+        const int* a = global.lights.data();
+        const int* aEnd = a + global.size();
+        const int* b = local.lights.data();
+        const int* bEnd = b + local.size();
+        while (a != aEnd || b != bEnd) {
+            if (b == bEnd || (a != aEnd && *a < *b)) {
+                visit(*a++, 1.0);
+            } else {
+                visit(*b++, 1.0);
             }
         }
-        if (nearest != nullptr) {
+        return;
+    }
+
+    // black lights only: nothing to add
+    double total = global.total + local.total;
+    if (total <= 0.0) return;
+
+    // rounding puts planes at integer coordinates, such as the floor,
+    // in the middle of a cell rather than on its border
+    uint64_t cell[3] = {(uint64_t)llround(point.x * 1024.0),
+                        (uint64_t)llround(point.y * 1024.0),
+                        (uint64_t)llround(point.z * 1024.0)};
+    uint64_t state = mixBits(mixBits(mixBits(cell[0]) ^ cell[1]) ^ cell[2]) ^
+                     mixBits((uint64_t)lightPass << 8 | (uint64_t)level);
+    auto uniform = [&] {
+        state = mixBits(state);
+        return (state >> 11) * 0x1.0p-53;
+    };
+    for (int k = 0; k < lightSamples; k++) {
+        // a list by its share of the power, then a light within it
+        const LightSampler& list = uniform() * total < global.total ? global : local;
+        double u1 = uniform();
+        double u2 = uniform();
+        int j = list.sample(u1, u2);
+        double p = list.probability[j] * (list.total / total);
+        visit(list.lights[j], 1.0 / (lightSamples * p));
+    }
+}
+
+// diffuse and specular contribution of an unoccluded light
+void addLightTerm(const ShadingPoint& sp, const Vector3D& lightPos,
+                  const double* lightColor, double intensity, double* color) {
+    Vector3D lightDir = lightPos - sp.point;
+    lightDir.normalize();
+    Vector3D normal = sp.normal;
+
+    double lambert = max(0.0, (double)normal.dot(lightDir));
+
+    Vector3D reflectDir = lightDir - normal * (2.0 * normal.dot(lightDir));
+    reflectDir.normalize();
+
+    Vector3D viewDir = sp.viewDir;
+    double phong = max(0.0, (double)viewDir.dot(reflectDir));
+
+    for (int i = 0; i < 3; i++) {
+        color[i] += lightColor[i] * intensity * sp.mat.coEfficients[1] * lambert * sp.surfaceColor[i];
+        color[i] += lightColor[i] * intensity * sp.mat.coEfficients[2] * pow(phong, sp.mat.shine);
+    }
+}
+
+// mirror ray leaving sp for a ray arriving along r
+Ray reflectedRay(const ShadingPoint& sp, const Ray* r) {
+    Vector3D dir = r->dir;
+    Vector3D reflectDir = dir - sp.normal * (2.0 * dir.dot(sp.normal));
+    reflectDir.normalize();
+    Vector3D reflectStart = sp.point + sp.normal * EPSILON;
+    // mirrors keep the spread; curved ones would widen it
+    Ray reflected(reflectStart, reflectDir);
+    reflected.coneWidth = sp.coneWidth;
+    reflected.coneSpread = r->coneSpread;
+    return reflected;
+}
+
+void computePhongLighting(const HitRecord& hit, double* color, Ray* r, int level) {
+    ShadingPoint sp;
+    prepareShading(hit, r, sp, color);
+    STAT_DEPTH(level);
+
+    forEachLight(sp.point, level, [&](int li, double weight) {
+        Vector3D position;
+        const double* lightColor;
+        double intensity;
+        if (!lightReaches(li, sp.point, position, lightColor, intensity)) {
+            STAT_ADD(STAT_SHADOW_RAYS_CULLED, 1);
+            return;
+        }
+
+        if (!occluded(position, sp.point, sp.prim, sp.part, li)) {
+            addLightTerm(sp, position, lightColor, intensity * weight, color);
+        }
+    });
+
+    if (level < recursion_level && sp.mat.coEfficients[3] > 0) {
+        Ray reflectRay = reflectedRay(sp, r);
+        STAT_ADD(STAT_REFLECTION_RAYS, 1);
+
+        HitRecord reflectHit;
+        if (findNearestHit(&reflectRay, reflectHit)) {
             double reflectedColor[3] = {0, 0, 0};
-            nearest->intersect(&reflectRay, reflectedColor, level + 1);
+            computePhongLighting(reflectHit, reflectedColor, &reflectRay, level + 1);
             for (int i = 0; i < 3; i++) {
-                color[i] += reflectedColor[i] * obj->coEfficients[3];
+                color[i] += reflectedColor[i] * sp.mat.coEfficients[3];
             }
         }
     }
 
-    for (int i = 0; i < 3; i++) {
-        color[i] = max(0.0, min(1.0, color[i]));
+    if (!hdrShading) {
+        for (int i = 0; i < 3; i++) {
+            color[i] = max(0.0, min(1.0, color[i]));
+        }
     }
 
 }
 
 struct Sphere : public Object {
-    double radius;
-    Sphere(Vector3D center, double r) {
+    Real radius;
+    Sphere(Vector3D center, Real r) {
+        kind = KIND_SPHERE;
         reference_point = center;
         radius = r;
         length = radius; 
     }
     
     void draw() override {
+#ifndef RT_HEADLESS
         glPushMatrix();
         glTranslatef(reference_point.x, reference_point.y, reference_point.z);
         glColor3f(color[0], color[1], color[2]);
         glutSolidSphere(radius, 100, 100);
         glPopMatrix();
+#endif
+    }
+
+    bool getBounds(AABB& box) override {
+        box = AABB(reference_point - Vector3D(radius, radius, radius),
+                   reference_point + Vector3D(radius, radius, radius));
+        box.pad(EPSILON);
+        return true;
     }
     
-    double intersect(Ray* r, double* color, int level) override {
+    bool hit(Ray* r, Real tMax, HitRecord& rec) override {
         Vector3D oc = r->start - reference_point;
         
-        double a = r->dir.dot(r->dir);
-        double b = 2.0 * oc.dot(r->dir);
-        double c = oc.dot(oc) - radius * radius;
+        Real a = r->dir.dot(r->dir);
+        Real b = 2 * oc.dot(r->dir);
+        Real c = oc.dot(oc) - radius * radius;
         
-        double discriminant = b * b - 4 * a * c;
+        Real discriminant = b * b - 4 * a * c;
         
         if (discriminant < 0) {
-            return -1.0; 
+            return false; 
         }
         
-        double t1 = (-b - sqrt(discriminant)) / (2 * a);
-        double t2 = (-b + sqrt(discriminant)) / (2 * a);
+        Real t1 = (-b - sqrt(discriminant)) / (2 * a);
+        Real t2 = (-b + sqrt(discriminant)) / (2 * a);
         
-        double t = (t1 > 0) ? t1 : t2;
+        Real t = (t1 > 0) ? t1 : t2;
         
-        if (t <= 0) {
-            return -1.0;
-        }
-        
-        if (level == 0) {
-            return t;
+        if (t <= 0 || t >= tMax) {
+            return false;
         }
-        
-        Vector3D intersectionPoint = r->start + r->dir * t;
-        
-        computePhongLighting(this, intersectionPoint, color, r, level);
-        
-        return t;
+
+        setHit(rec, t, 0.0, 0.0);
+        return true;
     }
     
     Vector3D getNormalAt(Vector3D point) override {
@@ -535,14 +1464,17 @@ struct Sphere : public Object {
         return normal;
     }
     
-    double* getColorAt(Vector3D point) override {
-        return color;
+    void getColorAt(Vector3D point, double* outColor) override {
+        outColor[0] = color[0];
+        outColor[1] = color[1];
+        outColor[2] = color[2];
     }
 };
 struct Triangle : public Object {
     Vector3D a, b, c;
     Vector3D normal;
     Triangle(Vector3D v1, Vector3D v2, Vector3D v3) {
+        kind = KIND_TRIANGLE;
         a = v1;
         b = v2;
         c = v3;
@@ -555,62 +1487,68 @@ struct Triangle : public Object {
     }
     
     void draw() override {
+#ifndef RT_HEADLESS
         glColor3f(color[0], color[1], color[2]);
         glBegin(GL_TRIANGLES);
         glVertex3f(a.x, a.y, a.z);
         glVertex3f(b.x, b.y, b.z);
         glVertex3f(c.x, c.y, c.z);
         glEnd();
+#endif
+    }
+
+    bool getBounds(AABB& box) override {
+        box = AABB();
+        box.expand(a);
+        box.expand(b);
+        box.expand(c);
+        box.pad(EPSILON);
+        return true;
     }
     
-    double intersect(Ray* r, double* color, int level) override {
+    bool hit(Ray* r, Real tMax, HitRecord& rec) override {
         Vector3D edge1 = b - a;
         Vector3D edge2 = c - a;
         Vector3D h = r->dir.cross(edge2);
-        double det = edge1.dot(h);
+        Real det = edge1.dot(h);
         
         if (det > -EPSILON && det < EPSILON) {
-            return -1.0;
+            return false;
         }
         
-        double invDet = 1.0 / det;
+        Real invDet = 1 / det;
         Vector3D s = r->start - a;
-        double u = invDet * s.dot(h);
+        Real u = invDet * s.dot(h);
         
-        if (u < 0.0 || u > 1.0) {
-            return -1.0;
+        if (u < 0 || u > 1) {
+            return false;
         }
         
         Vector3D q = s.cross(edge1);
-        double v = invDet * r->dir.dot(q);
+        Real v = invDet * r->dir.dot(q);
         
-        if (v < 0.0 || u + v > 1.0) {
-            return -1.0;
+        if (v < 0 || u + v > 1) {
+            return false;
         }
         
-        double t = invDet * edge2.dot(q);
+        Real t = invDet * edge2.dot(q);
         
-        if (t <= EPSILON) {
-            return -1.0;
+        if (t <= EPSILON || t >= tMax) {
+            return false;
         }
-        
-        if (level == 0) {
-            return t;
-        }
-
-        Vector3D intersectionPoint = r->start + r->dir * t;   
-        
-        computePhongLighting(this, intersectionPoint, color, r, level);
 
-        return t;
+        setHit(rec, t, u, v);
+        return true;
     }
     
     Vector3D getNormalAt(Vector3D point) override {
         return normal;
     }
     
-    double* getColorAt(Vector3D point) override {
-        return color;
+    void getColorAt(Vector3D point, double* outColor) override {
+        outColor[0] = color[0];
+        outColor[1] = color[1];
+        outColor[2] = color[2];
     }
 };
 
@@ -618,9 +1556,11 @@ struct GeneralQuadric : public Object {
     double A, B, C, D, E, F, G, H, I, J;
     Vector3D cubeRef;
     double cubeLength, cubeWidth, cubeHeight;
+    PackedQuadric packed;       // classified once, intersected by hitPackedQuadric
     GeneralQuadric(double a, double b, double c, double d, double e, double f,
                    double g, double h, double i, double j,
                    Vector3D ref, double len, double wid, double hei) {
+        kind = KIND_QUADRIC;
         A = a; B = b; C = c; D = d; E = e; F = f;
         G = g; H = h; I = i; J = j;
         cubeRef = ref;
@@ -628,65 +1568,21 @@ struct GeneralQuadric : public Object {
         cubeWidth = wid;
         cubeHeight = hei;
         reference_point = ref;
+        double q[10] = {A, B, C, D, E, F, G, H, I, J};
+        packed = makePackedQuadric(q, cubeRef, cubeLength, cubeWidth, cubeHeight);
     }
     
     void draw() override {}
-    
-    double intersect(Ray* r, double* color, int level) override {
-        double x0 = r->start.x, y0 = r->start.y, z0 = r->start.z;
-        double dx = r->dir.x, dy = r->dir.y, dz = r->dir.z;
-        
-        double a = A*dx*dx + B*dy*dy + C*dz*dz + D*dx*dy + E*dx*dz + F*dy*dz;
-        double b = 2*A*x0*dx + 2*B*y0*dy + 2*C*z0*dz + D*(x0*dy + y0*dx) + 
-                   E*(x0*dz + z0*dx) + F*(y0*dz + z0*dy) + G*dx + H*dy + I*dz;
-        double c = A*x0*x0 + B*y0*y0 + C*z0*z0 + D*x0*y0 + E*x0*z0 + F*y0*z0 + 
-                   G*x0 + H*y0 + I*z0 + J;
-        
-        double discriminant = b*b - 4*a*c;
-        
-        if (discriminant < 0) {
-            return -1.0;
-        }
-        
-        double t1 = (-b - sqrt(discriminant)) / (2*a);
-        double t2 = (-b + sqrt(discriminant)) / (2*a);
-        
-        auto isInBounds = [&](double t) -> bool {
-            Vector3D point = r->start + r->dir * t;
-            
-            if (cubeLength > 0) {
-                if (point.x < cubeRef.x || point.x > cubeRef.x + cubeLength) return false;
-            }
-            if (cubeWidth > 0) {
-                if (point.y < cubeRef.y || point.y > cubeRef.y + cubeWidth) return false;
-            }
-            if (cubeHeight > 0) {
-                if (point.z < cubeRef.z || point.z > cubeRef.z + cubeHeight) return false;
-            }
-            return true;
-        };
-        
-        double t = -1.0;
-        if (t1 > 0 && isInBounds(t1)) {
-            t = t1;
-        } 
-        else if (t2 > 0 && isInBounds(t2)) {
-            t = t2;
-        }
-        
-        if (t <= 0) {
-            return -1.0;
-        }
-        
-        if (level == 0) {
-            return t;
-        }
-        
-        Vector3D intersectionPoint = r->start + r->dir * t;
-        
-        computePhongLighting(this, intersectionPoint, color, r, level);
 
-        return t;
+    bool getBounds(AABB& box) override {
+        return quadricBounds(packed, box);
+    }
+    
+    bool hit(Ray* r, Real tMax, HitRecord& rec) override {
+        Real t;
+        if (!hitPackedQuadric(packed, r, tMax, t)) return false;
+        setHit(rec, t, 0.0, 0.0);
+        return true;
     }
     
     Vector3D getNormalAt(Vector3D point) override {
@@ -702,15 +1598,16 @@ struct GeneralQuadric : public Object {
         return normal;
     }
     
-    double* getColorAt(Vector3D point) override {
-        return color;
+    void getColorAt(Vector3D point, double* outColor) override {
+        outColor[0] = color[0];
+        outColor[1] = color[1];
+        outColor[2] = color[2];
     }
 };
 
 struct Floor : public Object{
     double tileWidth;
     double color2[3] = {0.0, 0.0, 0.0};
-    double colorTex[3];
     GLuint textureID; 
 
     Floor(double w, double tw){
@@ -721,6 +1618,7 @@ struct Floor : public Object{
     }
 
     void draw() override {
+#ifndef RT_HEADLESS
         int boardSize = width / tileWidth;
         
         if (useTexture && textureID > 0) {
@@ -768,9 +1666,11 @@ struct Floor : public Object{
                 }
             }
         }
+#endif
     }
 
     void loadTextureForOpenGL() {
+#ifndef RT_HEADLESS
         if (!textureData || textureWidth <= 0 || textureHeight <= 0) {
             return;
         }
@@ -787,14 +1687,18 @@ struct Floor : public Object{
                     0, GL_RGB, GL_UNSIGNED_BYTE, textureData);
         
         glBindTexture(GL_TEXTURE_2D, 0);
+#endif
     }
 
     Vector3D getNormalAt(Vector3D point) override {
         return Vector3D(0,0,1);
     }
 
-    double* getColorAt(Vector3D point) override {
+    void getColorAt(Vector3D point, double* outColor) override {
+        sampleColorAt(point, 0.0, outColor);
+    }
 
+    void sampleColorAt(Vector3D point, double footprint, double* outColor) override {
         if (useTexture) {
             int i = (point.x - reference_point.x) / tileWidth;
             int j = (point.y - reference_point.y) / tileWidth;
@@ -808,45 +1712,41 @@ struct Floor : public Object{
             double u = localX / tileWidth;
             double v = localY / tileWidth;
 
-            sampleFloorTexture(u, v, colorTex);
-            return colorTex;
+            sampleFloorTexture(u, v, footprint / tileWidth, outColor);
         } 
         else {
             int i = (point.x - reference_point.x) / tileWidth;
             int j = (point.y - reference_point.y) / tileWidth;
-            if ((i + j) % 2 == 0) return color2;
-            else return color;
+            double* c = ((i + j) % 2 == 0) ? color2 : color;
+            outColor[0] = c[0];
+            outColor[1] = c[1];
+            outColor[2] = c[2];
         }
     }
 
 
-    double intersect(Ray* r, double* color, int level) override {
+    bool hit(Ray* r, Real tMax, HitRecord& rec) override {
         Vector3D normal = getNormalAt(reference_point);
-        double denom = normal.dot(r->dir);
+        Real denom = normal.dot(r->dir);
 
         if (fabs(denom) < EPSILON) {
-            return -1.0;
+            return false;
         }
 
-        double t = -r->start.z / r->dir.z;
+        Real t = -r->start.z / r->dir.z;
 
-        if (t < 0) {
-            return -1.0;
+        if (t < 0 || t >= tMax) {
+            return false;
         }
 
         Vector3D intersectionPoint = r->start + r->dir * t;
 
         if (intersectionPoint.x < reference_point.x || intersectionPoint.x > reference_point.x + width ||
             intersectionPoint.y < reference_point.y || intersectionPoint.y > reference_point.y + width) {
-            return -1.0;
+            return false;
         }
 
-        if (level == 0) {
-            return t;
-        }
-        
-        computePhongLighting(this, intersectionPoint, color, r, level);
-
-        return t;
+        setHit(rec, t, intersectionPoint.x - reference_point.x, intersectionPoint.y - reference_point.y);
+        return true;
     }
 };
@@ -0,0 +1,602 @@
+#pragma once
+#include "2005024_render.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// Distributed rendering. A coordinator splits each view into bands of
+// streamBandRows rows and hands them to worker processes over stream
+// sockets, then writes each band into the BMP file as it comes back, the
+// way renderToFile streams its own.
+//
+// Workers are forked from the coordinator once the scene is loaded, each
+// on its own socketpair, or started on their own with the same scene,
+// texture and options (2005024_headless <scene> --worker PATH), connecting
+// to a Unix socket the coordinator listens on; ssh can forward that socket
+// from another machine.
+//
+// Balancing is dynamic: every worker keeps DIST_IN_FLIGHT bands queued so
+// it never waits for a round trip, and takes the next band when one comes
+// back. The bands of a worker that disconnects or dies go back to the
+// queue; once the queue is empty, idle workers duplicate bands still out,
+// so one slow worker does not hold up the view. When no band has come back
+// for distStallSeconds, the workers still holding bands count as hung and
+// are dropped, and their bands go back to the queue. With every worker
+// gone and nobody able to connect, or with none ready after such a stall,
+// the coordinator renders the rest itself.
+//
+// Workers render a band with renderPasses and resolve it exactly as
+// renderToFile does, so the image matches a local render with the same
+// --band (with anti-aliasing off, with any --band).
+//
+// The coordinator journals finished bands like renderToFile, so with
+// resumeRenders a killed distributed render resumes too.
+//
+// Messages are a DistHeader and a payload in host byte order: both ends
+// must be builds of the same code on the same architecture. HELLO checks
+// that, and that they render the same thing, with renderFingerprint.
+
+const uint32_t DIST_MAGIC = 0x31575452;     // "RTW1" in little-endian order
+const int DIST_IN_FLIGHT = 2;
+double distStallSeconds = 60.0;     // without a band back, see above
+
+enum DistMessage : uint32_t {
+    DIST_HELLO = 1,     // worker -> coordinator, once: DistHello
+    DIST_VIEW,          // coordinator -> worker: DistView, before the view's bands
+    DIST_BAND,          // coordinator -> worker: DistBand to render
+    DIST_PIXELS         // worker -> coordinator: DistBand, then its rows as the BMP file holds them
+};
+
+struct DistHeader {
+    uint32_t type;
+    uint32_t size;      // payload bytes
+};
+
+struct DistHello {
+    uint32_t magic;
+    int32_t threads;
+    uint64_t fingerprint;
+    int64_t pid;
+};
+
+struct DistView {
+    int32_t job;        // numbers the views; bands of older ones are stale
+    int32_t width, height;
+    int32_t reserved;
+    double eye[3], center[3], up[3];
+};
+
+struct DistBand {
+    int32_t job;
+    int32_t band;
+    int32_t y0, rows;
+};
+
+size_t bmpRowSize(int width) {
+    return (3 * (size_t)width + 3) & ~(size_t)3;
+}
+
+// false on a closed connection or an error; send() instead of write() so a
+// dead peer fails the call instead of raising SIGPIPE
+bool sendFully(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool receiveFully(int fd, void* data, size_t size) {
+    char* p = (char*)data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// payload, then extra appended to it
+bool sendMessage(int fd, DistMessage type, const void* payload, size_t size,
+                 const void* extra = nullptr, size_t extraSize = 0) {
+    DistHeader header = {type, (uint32_t)(size + extraSize)};
+    return sendFully(fd, &header, sizeof header) && sendFully(fd, payload, size) &&
+           (extraSize == 0 || sendFully(fd, extra, extraSize));
+}
+
+// limit bounds the payload, so a confused peer cannot make us allocate
+bool receiveMessage(int fd, DistHeader& header, vector<unsigned char>& payload, size_t limit) {
+    if (!receiveFully(fd, &header, sizeof header) || header.size > limit) return false;
+    payload.resize(header.size);
+    return receiveFully(fd, payload.data(), header.size);
+}
+
+// Serves bands until the coordinator closes the connection, which is how
+// it ends a worker (or turns one away), counting them in bands; false when
+// it sends something unexpected.
+bool runWorker(int fd, uint64_t fingerprint, int& bands) {
+    bands = 0;
+    DistHello hello = {DIST_MAGIC, renderThreads > 0 ? renderThreads : defaultThreadCount(), fingerprint,
+                       (int64_t)getpid()};
+    if (!sendMessage(fd, DIST_HELLO, &hello, sizeof hello)) return true;
+
+    DistView view = {};
+    bool haveView = false;
+    Framebuffer fb;
+    vector<unsigned char> payload, pixels;
+    DistHeader header;
+    while (true) {
+        if (!receiveFully(fd, &header, sizeof header)) return true;
+        if (header.size > sizeof(DistView)) break;
+        payload.resize(header.size);
+        if (!receiveFully(fd, payload.data(), header.size)) return true;
+
+        if (header.type == DIST_VIEW && header.size == sizeof view) {
+            memcpy(&view, payload.data(), sizeof view);
+            haveView = view.width > 0 && view.height > 0;
+            if (!haveView) break;
+        } else if (header.type == DIST_BAND && header.size == sizeof(DistBand) && haveView) {
+            DistBand band;
+            memcpy(&band, payload.data(), sizeof band);
+            if (band.job != view.job || band.y0 < 0 || band.rows <= 0 || band.y0 + band.rows > view.height) break;
+
+            Camera camera(Vector3D(view.eye[0], view.eye[1], view.eye[2]),
+                          Vector3D(view.center[0], view.center[1], view.center[2]),
+                          Vector3D(view.up[0], view.up[1], view.up[2]));
+            fb.resize(view.width, band.rows);
+            renderPasses(camera, view.width, view.height, fb, band.y0);
+            // bottom row first, rows padded to 4 bytes
+            size_t rowSize = bmpRowSize(view.width);
+            pixels.assign(rowSize * band.rows, 0);
+            resolveFramebuffer(fb, resolveSettings, pixels.data() + (band.rows - 1) * rowSize, -(ptrdiff_t)rowSize);
+            // a band nobody waits for any more is no error
+            if (!sendMessage(fd, DIST_PIXELS, &band, sizeof band, pixels.data(), pixels.size())) return true;
+            bands++;
+        } else {
+            break;
+        }
+    }
+    cerr << "Error: unexpected message from the coordinator" << endl;
+    return false;
+}
+
+// Worker mode of a separately started process: connects to the
+// coordinator's socket and serves it.
+bool connectWorker(const string& socketPath, uint64_t fingerprint) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof address.sun_path) {
+        cerr << "Error: socket path too long: " << socketPath << endl;
+        return false;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof address) != 0) {
+        cerr << "Error: Could not connect to " << socketPath << ": " << strerror(errno) << endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    cerr << "Connected to " << socketPath << endl;
+    int bands;
+    bool ok = runWorker(fd, fingerprint, bands);
+    close(fd);
+    cerr << "Disconnected after " << bands << " band(s)" << endl;
+    return ok;
+}
+
+struct DistWorker {
+    int fd = -1;
+    pid_t pid = -1;             // forked workers only
+    string name;
+    bool ready = false;         // HELLO accepted
+    int viewJob = -1;           // last view sent
+    vector<DistBand> inFlight;
+    int bandsDone = 0;
+};
+
+struct DistributedRenderer {
+    vector<DistWorker> workers;
+    int listenFd = -1;
+    string listenPath;
+    uint64_t fingerprint = 0;
+    int job = 0;
+
+    DistributedRenderer() {}
+    DistributedRenderer(const DistributedRenderer&) = delete;
+    DistributedRenderer& operator=(const DistributedRenderer&) = delete;
+    ~DistributedRenderer() { stop(); }
+
+    // Forks localWorkers workers and, with a path, listens there for more.
+    // Forked workers split the render threads between them unless -j gave
+    // a count, which each then uses.
+    bool start(int localWorkers, const string& socketPath, uint64_t renderFingerprint) {
+        fingerprint = renderFingerprint;
+        if (!socketPath.empty() && !listenOn(socketPath)) return false;
+
+        int threads = renderThreads > 0 ? renderThreads : max(1, defaultThreadCount() / max(1, localWorkers));
+        for (int k = 0; k < localWorkers; k++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+                cerr << "Error: Could not create a socket pair: " << strerror(errno) << endl;
+                return false;
+            }
+            cout.flush();
+            cerr.flush();
+            pid_t pid = fork();
+            if (pid < 0) {
+                cerr << "Error: Could not fork a worker: " << strerror(errno) << endl;
+                close(pair[0]);
+                close(pair[1]);
+                return false;
+            }
+            if (pid == 0) {
+                // the worker keeps only its own end
+                close(pair[0]);
+                if (listenFd >= 0) close(listenFd);
+                for (DistWorker& w : workers) close(w.fd);
+                renderThreads = threads;
+                int bands;
+                bool ok = runWorker(pair[1], fingerprint, bands);
+                cerr.flush();
+                _exit(ok ? 0 : 1);
+            }
+            close(pair[1]);
+            DistWorker w;
+            w.fd = pair[0];
+            w.pid = pid;
+            w.name = "worker " + to_string(pid);
+            workers.push_back(w);
+        }
+        return true;
+    }
+
+    bool listenOn(const string& socketPath) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof address.sun_path) {
+            cerr << "Error: socket path too long: " << socketPath << endl;
+            return false;
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof address) != 0 || listen(listenFd, 16) != 0) {
+            cerr << "Error: Could not listen on " << socketPath << ": " << strerror(errno) << endl;
+            if (listenFd >= 0) close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        listenPath = socketPath;
+        cerr << "Listening for workers on " << socketPath << endl;
+        return true;
+    }
+
+    int liveWorkers() const {
+        int n = 0;
+        for (const DistWorker& w : workers) n += w.fd >= 0;
+        return n;
+    }
+
+    int readyWorkers() const {
+        int n = 0;
+        for (const DistWorker& w : workers) n += w.fd >= 0 && w.ready;
+        return n;
+    }
+
+    // Closes the connections, which ends the workers, and reaps forked ones.
+    void stop() {
+        for (DistWorker& w : workers) {
+            if (w.fd >= 0) close(w.fd);
+            w.fd = -1;
+        }
+        for (DistWorker& w : workers) {
+            if (w.pid > 0) waitpid(w.pid, nullptr, 0);
+            w.pid = -1;
+        }
+        workers.clear();
+        if (listenFd >= 0) {
+            close(listenFd);
+            unlink(listenPath.c_str());
+            listenFd = -1;
+        }
+    }
+
+    // Per view: the bands and how far each got.
+    struct ViewState {
+        vector<DistBand> bands;
+        vector<char> done;
+        vector<int> out;                // copies being rendered
+        deque<int> queue;
+        int remaining = 0;
+        int reassigned = 0, duplicated = 0;
+    };
+
+    void lose(DistWorker& w, ViewState& view, const string& why) {
+        cerr << w.name << (w.ready ? " lost: " : " turned away: ") << why;
+        close(w.fd);
+        w.fd = -1;
+        if (w.pid > 0) {
+            // a worker that closed its end is exiting; give it a moment, then
+            // make sure of it
+            int status;
+            pid_t reaped = 0;
+            for (int tries = 0; tries < 20 && reaped == 0; tries++) {
+                reaped = waitpid(w.pid, &status, WNOHANG);
+                if (reaped == 0) this_thread::sleep_for(chrono::milliseconds(5));
+            }
+            if (reaped == 0) {
+                kill(w.pid, SIGKILL);
+                reaped = waitpid(w.pid, &status, 0);
+            }
+            if (reaped == w.pid) {
+                if (WIFSIGNALED(status)) cerr << " (killed by signal " << WTERMSIG(status) << ")";
+                else if (WIFEXITED(status)) cerr << " (exit status " << WEXITSTATUS(status) << ")";
+            }
+            w.pid = -1;
+        }
+        int requeued = 0;
+        for (const DistBand& band : w.inFlight) {
+            if (band.job != job) continue;
+            view.out[band.band]--;
+            if (!view.done[band.band] && view.out[band.band] == 0) {
+                view.queue.push_front(band.band);
+                requeued++;
+            }
+        }
+        view.reassigned += requeued;
+        w.inFlight.clear();
+        if (w.ready) cerr << ", " << requeued << " band(s) requeued";
+        cerr << endl;
+    }
+
+    // next band for w: the queue first, then, for an idle worker, a copy of
+    // the oldest band that only one worker has; -1 when there is none
+    int nextBand(const DistWorker& w, ViewState& view) {
+        while (!view.queue.empty()) {
+            int b = view.queue.front();
+            view.queue.pop_front();
+            if (!view.done[b]) return b;
+        }
+        if (!w.inFlight.empty()) return -1;
+        for (size_t b = 0; b < view.bands.size(); b++) {
+            if (!view.done[b] && view.out[b] == 1) {
+                view.duplicated++;
+                return b;
+            }
+        }
+        return -1;
+    }
+
+    void accept() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) return;
+            DistWorker w;
+            w.fd = fd;
+            w.name = "worker #" + to_string(workers.size() + 1);
+            workers.push_back(w);
+        }
+    }
+
+    // reads one message from w; false once w has been lost
+    bool receive(DistWorker& w, ViewState& view, BmpStreamWriter& writer, RenderJournal& journal, bool& written) {
+        DistHeader header;
+        vector<unsigned char> payload;
+        size_t limit = sizeof(DistBand) + writer.rowSize * max(1, streamBandRows);
+        if (!receiveMessage(w.fd, header, payload, max(limit, sizeof(DistHello)))) {
+            lose(w, view, "connection closed");
+            return false;
+        }
+
+        if (!w.ready) {
+            DistHello hello;
+            if (header.type != DIST_HELLO || header.size != sizeof hello) {
+                lose(w, view, "no greeting");
+                return false;
+            }
+            memcpy(&hello, payload.data(), sizeof hello);
+            if (w.pid < 0) w.name = "worker " + to_string(hello.pid);
+            if (hello.magic != DIST_MAGIC) {
+                lose(w, view, "not a worker of this build");
+                return false;
+            }
+            if (hello.fingerprint != fingerprint) {
+                lose(w, view, "different scene, texture or render options");
+                return false;
+            }
+            cerr << w.name << " ready with " << hello.threads << " thread(s)" << endl;
+            w.ready = true;
+            return true;
+        }
+
+        DistBand band;
+        if (header.type != DIST_PIXELS || header.size < sizeof band) {
+            lose(w, view, "unexpected message");
+            return false;
+        }
+        memcpy(&band, payload.data(), sizeof band);
+        auto it = find_if(w.inFlight.begin(), w.inFlight.end(), [&](const DistBand& b) {
+            return b.job == band.job && b.band == band.band;
+        });
+        if (it == w.inFlight.end()) {
+            lose(w, view, "a band it was not given");
+            return false;
+        }
+        w.inFlight.erase(it);
+        // a late copy from an earlier view, or a duplicate that lost the race
+        if (band.job != job) return true;
+        view.out[band.band]--;
+        if (view.done[band.band]) return true;
+
+        const DistBand& expected = view.bands[band.band];
+        if (band.y0 != expected.y0 || band.rows != expected.rows ||
+            header.size != sizeof band + writer.rowSize * band.rows) {
+            lose(w, view, "malformed band");
+            return false;
+        }
+        if (!writer.writeBand(band.y0, band.rows, payload.data() + sizeof band)) {
+            written = false;
+            return true;
+        }
+        journal.bandDone(band.band, writer);
+        view.done[band.band] = 1;
+        view.remaining--;
+        w.bandsDone++;
+        return true;
+    }
+
+    // Renders one view across the workers into filename; false when the
+    // image cannot be written.
+    bool render(Camera camera, int width, int height, const string& filename) {
+        int bandRows = max(1, min(streamBandRows, height));
+        int bands = (height + bandRows - 1) / bandRows;
+        BmpStreamWriter writer;
+        RenderJournal journal;
+        if (!journal.open(writer, filename, width, height, bands, viewFingerprint(camera, width, height, bandRows))) {
+            return false;
+        }
+        job++;
+        DistView setup = {};
+        setup.job = job;
+        setup.width = width;
+        setup.height = height;
+        Vector3D* vectors[3] = {&camera.eye, &camera.center, &camera.up};
+        double* fields[3] = {setup.eye, setup.center, setup.up};
+        for (int k = 0; k < 3; k++) {
+            fields[k][0] = vectors[k]->x;
+            fields[k][1] = vectors[k]->y;
+            fields[k][2] = vectors[k]->z;
+        }
+
+        ViewState view;
+        for (int y0 = 0, b = 0; y0 < height; y0 += bandRows, b++) {
+            view.bands.push_back({job, b, y0, min(bandRows, height - y0)});
+            if (!journal.done[b]) view.queue.push_back(b);
+        }
+        view.done = journal.done;
+        view.out.assign(bands, 0);
+        view.remaining = view.queue.size();
+        for (DistWorker& w : workers) w.bandsDone = 0;
+
+        bool written = true;
+        auto lastBand = chrono::steady_clock::now();
+        int remainingThen = view.remaining;
+        while (view.remaining > 0 && written) {
+            // keep every ready worker DIST_IN_FLIGHT bands deep
+            for (DistWorker& w : workers) {
+                if (w.fd < 0 || !w.ready) continue;
+                if (w.viewJob != job) {
+                    if (!sendMessage(w.fd, DIST_VIEW, &setup, sizeof setup)) {
+                        lose(w, view, "send failed");
+                        continue;
+                    }
+                    w.viewJob = job;
+                }
+                while (w.fd >= 0 && (int)w.inFlight.size() < DIST_IN_FLIGHT) {
+                    int b = nextBand(w, view);
+                    if (b < 0) break;
+                    view.out[b]++;
+                    w.inFlight.push_back(view.bands[b]);
+                    if (!sendMessage(w.fd, DIST_BAND, &view.bands[b], sizeof(DistBand))) {
+                        lose(w, view, "send failed");
+                    }
+                }
+            }
+
+            if (liveWorkers() == 0 && listenFd < 0) {
+                cerr << "No workers left, rendering the remaining " << view.remaining << " band(s) here" << endl;
+                written = renderLocally(camera, width, height, view, writer, journal);
+                break;
+            }
+
+            double waited = chrono::duration<double>(chrono::steady_clock::now() - lastBand).count();
+            if (waited >= distStallSeconds) {
+                for (DistWorker& w : workers) {
+                    if (w.fd >= 0 && !w.inFlight.empty()) {
+                        lose(w, view, "no band back in " + to_string((int)waited) + " s");
+                    }
+                }
+                lastBand = chrono::steady_clock::now();
+                if (readyWorkers() == 0) {
+                    cerr << "No workers ready, rendering the remaining " << view.remaining << " band(s) here" << endl;
+                    written = renderLocally(camera, width, height, view, writer, journal);
+                    break;
+                }
+                continue;
+            }
+
+            vector<pollfd> fds;
+            vector<int> owners;
+            for (size_t k = 0; k < workers.size(); k++) {
+                if (workers[k].fd < 0) continue;
+                fds.push_back({workers[k].fd, POLLIN, 0});
+                owners.push_back(k);
+            }
+            if (listenFd >= 0) fds.push_back({listenFd, POLLIN, 0});
+            int timeout = (int)ceil((distStallSeconds - waited) * 1000);
+            if (poll(fds.data(), fds.size(), timeout) < 0) {
+                if (errno == EINTR) continue;
+                cerr << "Error: poll failed: " << strerror(errno) << endl;
+                return false;
+            }
+            for (size_t k = 0; k < owners.size(); k++) {
+                if (fds[k].revents == 0) continue;
+                if (written) receive(workers[owners[k]], view, writer, journal, written);
+            }
+            if (listenFd >= 0 && fds.back().revents != 0) accept();
+            if (view.remaining < remainingThen) {
+                remainingThen = view.remaining;
+                lastBand = chrono::steady_clock::now();
+            }
+        }
+
+        cerr << "Bands per worker:";
+        for (const DistWorker& w : workers) {
+            if (w.bandsDone > 0) cerr << " " << w.bandsDone;
+        }
+        cerr << " (" << view.bands.size() << " bands, " << view.reassigned << " reassigned, "
+             << view.duplicated << " duplicated)" << endl;
+
+        // forget workers that are gone
+        workers.erase(remove_if(workers.begin(), workers.end(), [](const DistWorker& w) {
+            return w.fd < 0 && w.pid < 0;
+        }), workers.end());
+
+        if (!written) return false;
+        if (!writer.close()) {
+            cerr << "Error: Could not write " << filename << endl;
+            return false;
+        }
+        journal.finish();
+        return true;
+    }
+
+    bool renderLocally(Camera camera, int width, int height, ViewState& view, BmpStreamWriter& writer,
+                       RenderJournal& journal) {
+        Framebuffer fb;
+        vector<unsigned char> band;
+        for (size_t b = 0; b < view.bands.size(); b++) {
+            if (view.done[b]) continue;
+            const DistBand& d = view.bands[b];
+            fb.resize(width, d.rows);
+            renderPasses(camera, width, height, fb, d.y0);
+            band.assign(d.rows * writer.rowSize, 0);
+            resolveFramebuffer(fb, resolveSettings, band.data() + (d.rows - 1) * writer.rowSize,
+                               -(ptrdiff_t)writer.rowSize);
+            if (!writer.writeBand(d.y0, d.rows, band.data())) return false;
+            journal.bandDone(b, writer);
+            view.done[b] = 1;
+            view.remaining--;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include<bits/stdc++.h>
+#include "bitmap_image.hpp"
+using namespace std;
+
+enum ToneMap {
+    TONEMAP_CLAMP,          // legacy: clip to [0, 1]
+    TONEMAP_REINHARD,       // x / (1 + x)
+    TONEMAP_ACES            // Narkowicz's fit of the ACES filmic curve
+};
+
+struct ResolveSettings {
+    double exposure = 1.0;
+    ToneMap toneMap = TONEMAP_CLAMP;
+    bool srgb = false;      // encode with the sRGB curve instead of writing linear values
+};
+
+// Linear RGB32F accumulation buffer. Samples and passes are summed with a
+// weight per pixel; resolve() divides by it, so progressive rendering only
+// has to keep adding.
+struct Framebuffer {
+    int width = 0, height = 0;
+    vector<float> color;        // 3 per pixel, row-major from the top row
+    vector<float> weight;
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        color.assign(3 * (size_t)w * h, 0.0f);
+        weight.assign((size_t)w * h, 0.0f);
+    }
+
+    void clear() {
+        fill(color.begin(), color.end(), 0.0f);
+        fill(weight.begin(), weight.end(), 0.0f);
+    }
+
+    void add(int x, int y, const double* rgb, double w = 1.0) {
+        size_t p = (size_t)y * width + x;
+        color[3 * p] += rgb[0] * w;
+        color[3 * p + 1] += rgb[1] * w;
+        color[3 * p + 2] += rgb[2] * w;
+        weight[p] += w;
+    }
+};
+
+// sRGB encoding table over [0, 1]; linear output needs no table because
+// scaling and truncating is exactly the legacy quantization
+struct SrgbLut {
+    static const int SIZE = 16384;
+    unsigned char table[SIZE + 1];
+
+    SrgbLut() {
+        for (int k = 0; k <= SIZE; k++) {
+            double v = (double)k / SIZE;
+            double s = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+            table[k] = (unsigned char)min(255.0, floor(s * 255.0 + 0.5));
+        }
+    }
+};
+
+// Exposure, tone mapping and quantization of fb into BGR rows: row y starts
+// at dst + y * stride, so a negative stride writes bottom-up like a BMP file.
+// Each row goes through two passes: a branch-free float loop the compiler
+// vectorizes, then a byte loop that swaps to BGR and writes the bytes.
+void resolveFramebuffer(const Framebuffer& fb, const ResolveSettings& settings,
+                        unsigned char* dst, ptrdiff_t stride) {
+    static const SrgbLut lut;
+    const int n = 3 * fb.width;
+    vector<float> linear(n);
+    vector<int> code(n);
+    const float exposure = settings.exposure;
+    const float scale = settings.srgb ? (float)SrgbLut::SIZE : 255.0f;
+
+    for (int y = 0; y < fb.height; y++) {
+        const float* __restrict src = &fb.color[3 * (size_t)y * fb.width];
+        const float* __restrict w = &fb.weight[(size_t)y * fb.width];
+        float* __restrict v = linear.data();
+        int* __restrict q = code.data();
+
+        for (int x = 0; x < fb.width; x++) {
+            float inv = w[x] > 0.0f ? exposure / w[x] : 0.0f;
+            v[3 * x] = src[3 * x] * inv;
+            v[3 * x + 1] = src[3 * x + 1] * inv;
+            v[3 * x + 2] = src[3 * x + 2] * inv;
+        }
+
+        switch (settings.toneMap) {
+            case TONEMAP_REINHARD:
+                for (int i = 0; i < n; i++) {
+                    float c = max(v[i], 0.0f);
+                    v[i] = c / (1.0f + c);
+                }
+                break;
+            case TONEMAP_ACES:
+                for (int i = 0; i < n; i++) {
+                    float c = max(v[i], 0.0f);
+                    v[i] = (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+                }
+                break;
+            default:
+                break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            float c = min(max(v[i], 0.0f), 1.0f);
+            q[i] = (int)(c * scale);
+        }
+
+        unsigned char* row = dst + y * stride;
+        if (settings.srgb) {
+            for (int x = 0; x < fb.width; x++) {
+                row[3 * x] = lut.table[q[3 * x + 2]];
+                row[3 * x + 1] = lut.table[q[3 * x + 1]];
+                row[3 * x + 2] = lut.table[q[3 * x]];
+            }
+        } else {
+            for (int x = 0; x < fb.width; x++) {
+                row[3 * x] = (unsigned char)q[3 * x + 2];
+                row[3 * x + 1] = (unsigned char)q[3 * x + 1];
+                row[3 * x + 2] = (unsigned char)q[3 * x];
+            }
+        }
+    }
+}
+
+// resolves into image, which must be the size of fb
+void resolveFramebuffer(const Framebuffer& fb, const ResolveSettings& settings, bitmap_image& image) {
+    resolveFramebuffer(fb, settings, image.row(0), 3 * (ptrdiff_t)fb.width);
+}
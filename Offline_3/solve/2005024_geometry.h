@@ -0,0 +1,456 @@
+#pragma once
+#include "2005024_mesh.h"
+#include "2005024_instance.h"
+
+// Hot geometry only: everything an intersection test reads, nothing else.
+struct PackedSphere {
+    Vector3D center;
+    Real radius;
+};
+
+struct PackedTriangle {
+    Vector3D a;
+    Vector3D edge1, edge2;      // b - a, c - a
+};
+
+// The scene compiled after loading: per-type packed primitive arrays plus a
+// BVH over their refs. Materials live in the global materials table and are
+// referenced by index from parallel cold arrays, so intersection loops only
+// touch contiguous geometry. Objects without a packed form (the floor) are
+// kept as PRIM_OBJECT and intersected through their virtual hit(). Meshes
+// are single PRIM_MESH entries that descend into their own BVH.
+//
+// Instancing is two-level: each prototype is a SceneGeometry of its own
+// (the bottom level, without objects or instances), and a PRIM_INSTANCE
+// entry in this BVH (the top level) carries the ray into prototype space.
+struct SceneGeometry {
+    vector<PackedSphere> spheres;
+    vector<PackedTriangle> triangles;
+    vector<PackedQuadric> quadrics;
+    vector<Object*> objects;
+    vector<TriangleMesh> meshes;
+    vector<SceneGeometry> prototypes;
+    vector<Instance> instances;
+
+    vector<Vector3D> triangleNormals;
+    vector<uint32_t> sphereMaterial, triangleMaterial, quadricMaterial;
+
+    BVH bvh;
+    vector<PrimRef> unbounded;
+    int generation = 0;     // bumped by build() so cached refs can be invalidated
+
+    void clear() {
+        spheres.clear();
+        triangles.clear();
+        quadrics.clear();
+        objects.clear();
+        meshes.clear();
+        prototypes.clear();
+        instances.clear();
+        triangleNormals.clear();
+        sphereMaterial.clear();
+        triangleMaterial.clear();
+        quadricMaterial.clear();
+        unbounded.clear();
+        bvh = BVH();
+    }
+
+    PrimRef add(Object* obj) {
+        int mat = materials.add(obj->getMaterial());
+        PrimRef ref;
+
+        if (obj->kind == KIND_SPHERE) {
+            Sphere* s = (Sphere*)obj;
+            spheres.push_back({s->reference_point, s->radius});
+            sphereMaterial.push_back(mat);
+            ref = makePrimRef(PRIM_SPHERE, spheres.size() - 1);
+        } else if (obj->kind == KIND_TRIANGLE) {
+            Triangle* t = (Triangle*)obj;
+            triangles.push_back({t->a, t->b - t->a, t->c - t->a});
+            triangleNormals.push_back(t->normal);
+            triangleMaterial.push_back(mat);
+            ref = makePrimRef(PRIM_TRIANGLE, triangles.size() - 1);
+        } else if (obj->kind == KIND_QUADRIC) {
+            GeneralQuadric* g = (GeneralQuadric*)obj;
+            quadrics.push_back(g->packed);
+            quadricMaterial.push_back(mat);
+            ref = makePrimRef(PRIM_QUADRIC, quadrics.size() - 1);
+        } else {
+            objects.push_back(obj);
+            ref = makePrimRef(PRIM_OBJECT, objects.size() - 1);
+        }
+
+        obj->primRef = ref;
+        obj->materialId = mat;
+        return ref;
+    }
+
+    // takes over a loaded, built mesh
+    PrimRef add(TriangleMesh&& mesh, const Material& m) {
+        mesh.material = materials.add(m);
+        meshes.push_back(move(mesh));
+        return makePrimRef(PRIM_MESH, meshes.size() - 1);
+    }
+
+    // inst.prototype must already be in prototypes
+    PrimRef add(const Instance& inst) {
+        instances.push_back(inst);
+        return makePrimRef(PRIM_INSTANCE, instances.size() - 1);
+    }
+
+    size_t meshTriangles() const {
+        size_t n = 0;
+        for (const TriangleMesh& mesh : meshes) n += mesh.triangleCount();
+        return n;
+    }
+
+    size_t meshBytes() const {
+        size_t n = 0;
+        for (const TriangleMesh& mesh : meshes) n += mesh.memoryBytes();
+        return n;
+    }
+
+    // spheres, triangles, quadrics and mesh triangles, not counting instances
+    size_t primitiveCount() const {
+        return spheres.size() + triangles.size() + quadrics.size() + meshTriangles();
+    }
+
+    // primitives as placed by the instances, i.e. without instancing
+    size_t instancedPrimitives() const {
+        size_t n = 0;
+        for (const Instance& inst : instances) n += prototypes[inst.prototype].primitiveCount();
+        return n;
+    }
+
+    bool primBounds(PrimRef ref, AABB& box) const {
+        uint32_t i = primIndex(ref);
+        switch (primType(ref)) {
+            case PRIM_SPHERE: {
+                const PackedSphere& s = spheres[i];
+                Vector3D r(s.radius, s.radius, s.radius);
+                box = AABB(s.center - r, s.center + r);
+                box.pad(EPSILON);
+                return true;
+            }
+            case PRIM_TRIANGLE: {
+                const PackedTriangle& t = triangles[i];
+                box = AABB();
+                box.expand(t.a);
+                box.expand(t.a + t.edge1);
+                box.expand(t.a + t.edge2);
+                box.pad(EPSILON);
+                return true;
+            }
+            case PRIM_QUADRIC: {
+                return quadricBounds(quadrics[i], box);
+            }
+            case PRIM_MESH: {
+                box = meshes[i].bounds();
+                return !meshes[i].nodes.empty();
+            }
+            case PRIM_INSTANCE: {
+                // an unbounded prim leaves the whole instance unbounded
+                const SceneGeometry& proto = prototypes[instances[i].prototype];
+                if (!proto.unbounded.empty() || proto.bvh.nodes.empty()) return false;
+                box = instances[i].toWorld.bounds(proto.bvh.bounds());
+                box.pad(EPSILON);
+                return true;
+            }
+            default:
+                return objects[i]->getBounds(box);
+        }
+    }
+
+    void build() {
+        vector<AABB> bounds;
+        vector<uint32_t> refs;
+        unbounded.clear();
+
+        auto collect = [&](int type, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                PrimRef ref = makePrimRef(type, i);
+                AABB box;
+                if (primBounds(ref, box)) {
+                    bounds.push_back(box);
+                    refs.push_back(ref);
+                } else {
+                    unbounded.push_back(ref);
+                }
+            }
+        };
+        collect(PRIM_SPHERE, spheres.size());
+        collect(PRIM_TRIANGLE, triangles.size());
+        collect(PRIM_QUADRIC, quadrics.size());
+        collect(PRIM_OBJECT, objects.size());
+        collect(PRIM_MESH, meshes.size());
+        collect(PRIM_INSTANCE, instances.size());
+
+        bvh.build(move(bounds), refs);
+        generation++;
+    }
+
+    bool hitSphere(uint32_t i, Ray* r, Real tMax, HitRecord& rec) const {
+        const PackedSphere& s = spheres[i];
+        Vector3D oc = r->start - s.center;
+
+        Real a = r->dir.dot(r->dir);
+        Real b = 2 * oc.dot(r->dir);
+        Real c = oc.dot(oc) - s.radius * s.radius;
+
+        Real discriminant = b * b - 4 * a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+
+        Real t1 = (-b - sqrt(discriminant)) / (2 * a);
+        Real t2 = (-b + sqrt(discriminant)) / (2 * a);
+        Real t = (t1 > 0) ? t1 : t2;
+
+        if (t <= 0 || t >= tMax) {
+            return false;
+        }
+        rec.t = t;
+        rec.u = rec.v = 0.0;
+        return true;
+    }
+
+    bool hitTriangle(uint32_t i, Ray* r, Real tMax, HitRecord& rec) const {
+        const PackedTriangle& tri = triangles[i];
+        return rayTriangle(r, tri.a, tri.edge1, tri.edge2, tMax, rec.t, rec.u, rec.v);
+    }
+
+    bool hitQuadric(uint32_t i, Ray* r, Real tMax, HitRecord& rec) const {
+        if (!hitPackedQuadric(quadrics[i], r, tMax, rec.t)) return false;
+        rec.u = rec.v = 0.0;
+        return true;
+    }
+
+    // the nearest prototype prim is kept in rec.part, its mesh triangle in rec.element
+    bool hitInstance(uint32_t i, Ray* r, Real tMax, HitRecord& rec) const {
+        const Instance& inst = instances[i];
+        Ray local = inst.localRay(r);
+        HitRecord inner;
+        if (!prototypes[inst.prototype].nearestHit(&local, tMax, inner)) return false;
+        rec.t = inner.t;
+        rec.u = inner.u;
+        rec.v = inner.v;
+        rec.element = inner.element;
+        rec.part = inner.prim;
+        return true;
+    }
+
+    // t, u, v and prim of the hit of ref before tMax; see finalizeHit for the rest
+    bool hitPrim(PrimRef ref, Ray* r, Real tMax, HitRecord& rec) const {
+        STAT_ADD(STAT_PRIM_TESTS, 1);
+        uint32_t i = primIndex(ref);
+        bool found;
+        switch (primType(ref)) {
+            case PRIM_SPHERE: found = hitSphere(i, r, tMax, rec); break;
+            case PRIM_TRIANGLE: found = hitTriangle(i, r, tMax, rec); break;
+            case PRIM_QUADRIC: found = hitQuadric(i, r, tMax, rec); break;
+            case PRIM_MESH: found = meshes[i].closest(r, tMax, rec.t, rec.u, rec.v, rec.element); break;
+            case PRIM_INSTANCE: found = hitInstance(i, r, tMax, rec); break;
+            default: return objects[i]->hit(r, tMax, rec);
+        }
+        if (found) {
+            rec.prim = ref;
+            rec.obj = nullptr;
+        }
+        return found;
+    }
+
+    // point, normal and material for the winning hit; touches the cold arrays only once
+    void finalizeHit(Ray* r, HitRecord& rec) const {
+        uint32_t i = primIndex(rec.prim);
+        rec.point = r->start + r->dir * rec.t;
+        switch (primType(rec.prim)) {
+            case PRIM_SPHERE: {
+                rec.normal = rec.point - spheres[i].center;
+                rec.normal.normalize();
+                rec.material = sphereMaterial[i];
+                break;
+            }
+            case PRIM_TRIANGLE: {
+                rec.normal = triangleNormals[i];
+                rec.material = triangleMaterial[i];
+                break;
+            }
+            case PRIM_QUADRIC: {
+                const PackedQuadric& g = quadrics[i];
+                Real x = rec.point.x, y = rec.point.y, z = rec.point.z;
+                rec.normal = Vector3D(2*g.A*x + g.D*y + g.E*z + g.G,
+                                      2*g.B*y + g.D*x + g.F*z + g.H,
+                                      2*g.C*z + g.E*x + g.F*y + g.I);
+                rec.normal.normalize();
+                rec.material = quadricMaterial[i];
+                break;
+            }
+            case PRIM_MESH: {
+                rec.normal = meshes[i].normal(rec.element);
+                rec.material = meshes[i].material;
+                break;
+            }
+            case PRIM_INSTANCE: {
+                // finish the prototype's hit in its own space, then bring the normal back
+                const Instance& inst = instances[i];
+                Ray local = inst.localRay(r);
+                HitRecord inner = rec;
+                inner.prim = rec.part;
+                prototypes[inst.prototype].finalizeHit(&local, inner);
+                rec.normal = inst.worldNormal(inner.normal);
+                rec.material = inst.material >= 0 ? inst.material : inner.material;
+                break;
+            }
+            default: {
+                objects[i]->finalizeHit(r, rec);
+                break;
+            }
+        }
+    }
+
+    // nearest hit with 0 < t < tMax, not yet finalized
+    bool nearestHit(Ray* r, Real tMax, HitRecord& rec) const {
+        Real best = tMax;
+        bool found = false;
+        HitRecord candidate;
+
+        for (PrimRef ref : unbounded) {
+            if (hitPrim(ref, r, best, candidate) && candidate.t > 0) {
+                best = candidate.t;
+                rec = candidate;
+                found = true;
+            }
+        }
+
+        bvh.closest(r, best, [&](PrimRef ref, Real& tBest) {
+            if (hitPrim(ref, r, tBest, candidate) && candidate.t > 0) {
+                tBest = candidate.t;
+                rec = candidate;
+                found = true;
+            }
+        });
+        return found;
+    }
+
+    // nearest hit with t > 0; rec comes back finalized
+    bool closestHit(Ray* r, HitRecord& rec) const {
+        if (!nearestHit(r, INFINITY, rec)) return false;
+        finalizeHit(r, rec);
+        return true;
+    }
+
+    // Any-hit query for the segment origin -> target: true as soon as some
+    // primitive other than self is hit in (EPSILON, distance - EPSILON).
+    // lastOccluder is tested before any traversal and replaced by the blocker
+    // found, since neighbouring shading points tend to share their occluder.
+    bool occluded(const Vector3D& origin, const Vector3D& target, PrimRef self, PrimRef selfPart,
+                  PrimRef& lastOccluder) const {
+        Ray r(origin, target - origin);
+        Real maxDistance = (target - origin).length();
+        return anyHit(&r, maxDistance, self, selfPart, lastOccluder);
+    }
+
+    // occluded() for a ray that is already set up, r->dir need not be unit length
+    bool anyHit(Ray* r, Real maxDistance, PrimRef self, PrimRef selfPart,
+                PrimRef& lastOccluder) const {
+        HitRecord rec;
+        auto blocks = [&](PrimRef ref) {
+            bool hit;
+            uint32_t i = primIndex(ref);
+            if (primType(ref) == PRIM_MESH) {
+                // a mesh may shadow itself; the shaded triangle ends the
+                // segment and falls outside the range
+                hit = meshes[i].any(r, maxDistance - EPSILON);
+            } else if (primType(ref) == PRIM_INSTANCE) {
+                // t carries over into prototype space; the shaded instance
+                // skips only the shaded prim, as the top level would
+                const Instance& inst = instances[i];
+                Ray local = inst.localRay(r);
+                PrimRef innerSelf = ref == self ? selfPart : PRIM_NONE;
+                PrimRef scratch = PRIM_NONE;
+                hit = prototypes[inst.prototype].anyHit(&local, maxDistance, innerSelf, PRIM_NONE, scratch);
+            } else {
+                hit = ref != self && hitPrim(ref, r, INFINITY, rec) &&
+                      rec.t > EPSILON && rec.t < maxDistance - EPSILON;
+            }
+            if (hit) lastOccluder = ref;
+            return hit;
+        };
+
+        if (lastOccluder != PRIM_NONE && blocks(lastOccluder)) return true;
+        for (PrimRef ref : unbounded) {
+            if (blocks(ref)) return true;
+        }
+        return bvh.any(r, maxDistance, blocks);
+    }
+
+    // OpenGL preview of the instances; top-level objects and meshes draw themselves
+    void drawInstances() const {
+#ifndef RT_HEADLESS
+        for (const Instance& inst : instances) {
+            double columnMajor[16];
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) columnMajor[4 * j + i] = inst.toWorld.m[i][j];
+            }
+            glPushMatrix();
+            glMultMatrixd(columnMajor);
+            prototypes[inst.prototype].drawPacked(inst.material);
+            glPopMatrix();
+        }
+#endif
+    }
+
+    // draws spheres, triangles and meshes from the packed arrays, all in
+    // material's colour when it is >= 0 (quadrics have no preview anyway)
+    void drawPacked(int material) const {
+#ifndef RT_HEADLESS
+        auto setColor = [&](int own) {
+            const Material& m = materials[material >= 0 ? material : own];
+            glColor3f(m.color[0], m.color[1], m.color[2]);
+        };
+        for (size_t i = 0; i < spheres.size(); i++) {
+            setColor(sphereMaterial[i]);
+            glPushMatrix();
+            glTranslatef(spheres[i].center.x, spheres[i].center.y, spheres[i].center.z);
+            glutSolidSphere(spheres[i].radius, 100, 100);
+            glPopMatrix();
+        }
+        for (size_t i = 0; i < triangles.size(); i++) {
+            const PackedTriangle& t = triangles[i];
+            Vector3D b = t.a + t.edge1, c = t.a + t.edge2;
+            setColor(triangleMaterial[i]);
+            glBegin(GL_TRIANGLES);
+            glVertex3f(t.a.x, t.a.y, t.a.z);
+            glVertex3f(b.x, b.y, b.z);
+            glVertex3f(c.x, c.y, c.z);
+            glEnd();
+        }
+        for (const TriangleMesh& mesh : meshes) {
+            mesh.draw(material);
+        }
+#endif
+    }
+};
+
+extern SceneGeometry sceneGeometry;
+
+bool findNearestHit(Ray* r, HitRecord& rec) {
+    return sceneGeometry.closestHit(r, rec);
+}
+
+bool occluded(const Vector3D& origin, const Vector3D& target, PrimRef self, PrimRef selfPart, int light) {
+    // per thread so workers never share (or fight over) cache lines
+    thread_local vector<PrimRef> lastOccluder;
+    thread_local int generation = -1;
+    if (generation != sceneGeometry.generation) {
+        lastOccluder.clear();
+        generation = sceneGeometry.generation;
+    }
+    if (light >= (int)lastOccluder.size()) {
+        lastOccluder.resize(light + 1, PRIM_NONE);
+    }
+    STAT_ADD(STAT_SHADOW_RAYS, 1);
+    bool blocked = sceneGeometry.occluded(origin, target, self, selfPart, lastOccluder[light]);
+    if (blocked) STAT_ADD(STAT_SHADOW_RAYS_BLOCKED, 1);
+    return blocked;
+}
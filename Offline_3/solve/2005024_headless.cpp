@@ -0,0 +1,416 @@
+// Headless batch renderer: loads a scene once and renders any number of
+// camera poses without a window or GL context.
+//
+// Build (no GL libraries needed):
+//   g++ 2005024_headless.cpp -o 2005024_headless -O2 -pthread
+// Add -DRT_FLOAT for the single-precision preview build (see
+// 2005024_precision_report.sh for how it compares with the default).
+//
+// Usage:
+//   2005024_headless <scene file> [options]
+//     -p, --poses FILE     camera poses, one per line (use - for stdin):
+//                            eyeX eyeY eyeZ centerX centerY centerZ upX upY upZ
+//                          blank lines and lines starting with # are skipped;
+//                          without poses the viewer's start pose is rendered
+//     -s, --size WxH       output resolution (default: the size in the scene file)
+//     -o, --output PAT     output file pattern with one integer conversion for the
+//                          1-based view number (default: Output_1%d.bmp)
+//     -t, --texture FILE   floor texture image
+//     -j, --threads N      render threads (default: one per hardware thread)
+//     -w, --wavefront      use the wavefront tracer
+//         --isa N          cap the packet ISA (0 scalar, 1 SSE4.2, 2 AVX2, 3 AVX-512)
+//     -a, --aa BASE:MAX    adaptive anti-aliasing with BASE samples per pixel, refined
+//                          up to MAX where needed (square counts whose sides
+//                          differ by a power of two, e.g. 1:16 or 4:16)
+//         --aa-threshold T colour error/contrast that triggers refinement
+//                          (default 0.05)
+//         --tonemap NAME   clamp (default, clamps every bounce like the original
+//                          tracer), reinhard or aces (both keep HDR colours
+//                          through the bounces)
+//         --exposure E     linear scale applied before tone mapping (default 1)
+//         --srgb           sRGB-encode the output instead of writing linear values
+//         --band N         rows rendered and written per band (default 64); memory
+//                          use grows with the band, not the image
+//         --texfilter NAME nearest (the original lookup), bilinear, or trilinear
+//                          (default, mip levels chosen by the ray footprint)
+//         --light-samples K shade with K lights drawn by power instead of all lights
+//                          (0, the default, sums every light)
+//         --passes N       average N passes with fresh light draws (default 1)
+//         --reference PAT  after each view, print its PSNR against the BMP this
+//                          pattern names for the same view number
+//         --stats PAT      write a JSON report of each view's counters and timers
+//                          (rays/s, tests per ray, culled shadow rays, depth
+//                          histogram, time per tile); needs -DRT_STATS
+//         --trace PAT      write a Chrome trace (chrome://tracing, Perfetto) of
+//                          each view's tiles and bands; needs -DRT_STATS
+//         --checkpoint S   seconds between checkpoints of finished bands and of
+//                          the passes of the band in progress (default 30, 0
+//                          turns them off); see 2005024_checkpoint.h
+//         --resume         continue each view from the checkpoint an interrupted
+//                          render of it left, skipping the finished work
+//         --workers N      render across N forked worker processes, which split
+//                          the threads unless -j sets each one's count; --band
+//                          sets the rows handed out at a time
+//         --listen PATH    also take workers that connect to a Unix socket at PATH
+//         --stall S        seconds without a band back before the workers holding
+//                          bands are dropped (default 60)
+//         --worker PATH    run as a worker of the coordinator listening at PATH;
+//                          give it the coordinator's scene, texture and options
+//                          (see 2005024_distributed.h)
+//
+// Every saved file name is printed on its own line to stdout, so the output
+// can be piped into other tools; progress goes to stderr.
+#define RT_HEADLESS
+#include "2005024_render.h"
+#include "2005024_distributed.h"
+
+struct Pose {
+    Vector3D eye, center, up;
+};
+
+void printUsage(const char* program) {
+    cerr << "usage: " << program << " <scene file> [-p poses] [-s WxH] [-o pattern]"
+         << " [-t texture] [-j threads] [-w] [--isa N] [-a BASE:MAX] [--aa-threshold T]"
+         << " [--tonemap clamp|reinhard|aces] [--exposure E] [--srgb]"
+         << " [--band N] [--texfilter nearest|bilinear|trilinear]"
+         << " [--light-samples K] [--passes N] [--reference pattern]"
+         << " [--stats pattern] [--trace pattern] [--checkpoint S] [--resume]"
+         << " [--workers N] [--listen path] [--stall S] [--worker path]" << endl;
+}
+
+bool readPoses(istream& in, vector<Pose>& poses) {
+    string line;
+    int lineNumber = 0;
+    while (getline(in, line)) {
+        lineNumber++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') continue;
+
+        istringstream fields(line);
+        Pose p;
+        fields >> p.eye.x >> p.eye.y >> p.eye.z
+               >> p.center.x >> p.center.y >> p.center.z
+               >> p.up.x >> p.up.y >> p.up.z;
+        if (!fields) {
+            cerr << "Error: pose line " << lineNumber << " needs 9 numbers" << endl;
+            return false;
+        }
+        poses.push_back(p);
+    }
+    return true;
+}
+
+// accepts patterns with exactly one %d-style conversion (flags and width allowed)
+bool validOutputPattern(const string& pattern) {
+    int conversions = 0;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') continue;
+        if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < pattern.size() && (isdigit((unsigned char)pattern[j]) || pattern[j] == '-')) j++;
+        if (j >= pattern.size() || pattern[j] != 'd') return false;
+        conversions++;
+        i = j;
+    }
+    return conversions == 1;
+}
+
+string outputName(const string& pattern, int view) {
+    int n = snprintf(nullptr, 0, pattern.c_str(), view);
+    string name(n, '\0');
+    snprintf(&name[0], n + 1, pattern.c_str(), view);
+    return name;
+}
+
+// peak signal-to-noise ratio of two BMPs of the same size, over all channels
+bool imagePsnr(const string& a, const string& b, double& psnr) {
+    bitmap_image x(a), y(b);
+    if (!x || !y) {
+        cerr << "Error: Could not read " << (!x ? a : b) << endl;
+        return false;
+    }
+    if (x.width() != y.width() || x.height() != y.height()) {
+        cerr << "Error: " << a << " and " << b << " differ in size" << endl;
+        return false;
+    }
+    const unsigned char* p = x.data();
+    const unsigned char* q = y.data();
+    size_t n = (size_t)x.width() * x.height() * x.bytes_per_pixel();
+    double sum = 0.0;
+    for (size_t k = 0; k < n; k++) {
+        double d = (double)p[k] - q[k];
+        sum += d * d;
+    }
+    psnr = sum == 0 ? INFINITY : 10.0 * log10(255.0 * 255.0 * n / sum);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* scenePath = nullptr;
+    const char* posesPath = nullptr;
+    const char* texturePath = nullptr;
+    string pattern = "Output_1%d.bmp";
+    string referencePattern;
+    string statsPattern, tracePattern;
+    int width = 0, height = 0;
+    int localWorkers = 0;
+    string listenPath, coordinatorPath;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                cerr << "Error: " << arg << " needs a value" << endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-p" || arg == "--poses") {
+            posesPath = value();
+        } else if (arg == "-s" || arg == "--size") {
+            const char* size = value();
+            if (sscanf(size, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                cerr << "Error: bad size " << size << ", expected WxH" << endl;
+                return 1;
+            }
+        } else if (arg == "-o" || arg == "--output") {
+            pattern = value();
+        } else if (arg == "-t" || arg == "--texture") {
+            texturePath = value();
+        } else if (arg == "-j" || arg == "--threads") {
+            renderThreads = atoi(value());
+        } else if (arg == "-w" || arg == "--wavefront") {
+            wavefrontMode = true;
+        } else if (arg == "--isa") {
+            packetIsaOverride = atoi(value());
+        } else if (arg == "-a" || arg == "--aa") {
+            const char* spec = value();
+            int base, maxSamples;
+            if (sscanf(spec, "%d:%d", &base, &maxSamples) != 2 || !setAntialiasing(base, maxSamples)) {
+                cerr << "Error: bad sample counts " << spec
+                     << ", expected BASE:MAX, square counts whose sides differ by a power of two" << endl;
+                return 1;
+            }
+        } else if (arg == "--aa-threshold") {
+            aaThreshold = atof(value());
+        } else if (arg == "--tonemap") {
+            string name = value();
+            if (name == "clamp") {
+                resolveSettings.toneMap = TONEMAP_CLAMP;
+            } else if (name == "reinhard") {
+                resolveSettings.toneMap = TONEMAP_REINHARD;
+            } else if (name == "aces") {
+                resolveSettings.toneMap = TONEMAP_ACES;
+            } else {
+                cerr << "Error: unknown tone mapping " << name << endl;
+                return 1;
+            }
+            hdrShading = resolveSettings.toneMap != TONEMAP_CLAMP;
+        } else if (arg == "--exposure") {
+            resolveSettings.exposure = atof(value());
+        } else if (arg == "--srgb") {
+            resolveSettings.srgb = true;
+        } else if (arg == "--band") {
+            streamBandRows = atoi(value());
+            if (streamBandRows <= 0) {
+                cerr << "Error: band height must be positive" << endl;
+                return 1;
+            }
+        } else if (arg == "--texfilter") {
+            string name = value();
+            if (name == "nearest") {
+                textureFilter = FILTER_NEAREST;
+            } else if (name == "bilinear") {
+                textureFilter = FILTER_BILINEAR;
+            } else if (name == "trilinear") {
+                textureFilter = FILTER_TRILINEAR;
+            } else {
+                cerr << "Error: unknown texture filter " << name << endl;
+                return 1;
+            }
+        } else if (arg == "--light-samples") {
+            lightSamples = atoi(value());
+            if (lightSamples < 0) {
+                cerr << "Error: light samples must not be negative" << endl;
+                return 1;
+            }
+        } else if (arg == "--passes") {
+            lightPasses = atoi(value());
+            if (lightPasses <= 0) {
+                cerr << "Error: passes must be positive" << endl;
+                return 1;
+            }
+        } else if (arg == "--reference") {
+            referencePattern = value();
+        } else if (arg == "--stats" || arg == "--trace") {
+            (arg == "--stats" ? statsPattern : tracePattern) = value();
+#ifndef RT_STATS
+            cerr << "Error: " << arg << " needs a build with -DRT_STATS" << endl;
+            return 1;
+#endif
+        } else if (arg == "--checkpoint") {
+            checkpointSeconds = atof(value());
+            if (checkpointSeconds < 0) {
+                cerr << "Error: checkpoint interval must not be negative" << endl;
+                return 1;
+            }
+        } else if (arg == "--resume") {
+            resumeRenders = true;
+        } else if (arg == "--workers") {
+            localWorkers = atoi(value());
+            if (localWorkers <= 0) {
+                cerr << "Error: workers must be positive" << endl;
+                return 1;
+            }
+        } else if (arg == "--listen") {
+            listenPath = value();
+        } else if (arg == "--stall") {
+            distStallSeconds = atof(value());
+            if (!(distStallSeconds > 0)) {
+                cerr << "Error: stall must be positive" << endl;
+                return 1;
+            }
+        } else if (arg == "--worker") {
+            coordinatorPath = value();
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (arg[0] != '-' && scenePath == nullptr) {
+            scenePath = argv[i];
+        } else {
+            cerr << "Error: unknown argument " << arg << endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (scenePath == nullptr) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (!validOutputPattern(pattern)) {
+        cerr << "Error: output pattern needs exactly one %d conversion: " << pattern << endl;
+        return 1;
+    }
+    for (const string* p : {&referencePattern, &statsPattern, &tracePattern}) {
+        if (!p->empty() && !validOutputPattern(*p)) {
+            cerr << "Error: pattern needs exactly one %d conversion: " << *p << endl;
+            return 1;
+        }
+    }
+
+    bool distributed = localWorkers > 0 || !listenPath.empty();
+    if (distributed && !coordinatorPath.empty()) {
+        cerr << "Error: a worker cannot also coordinate" << endl;
+        return 1;
+    }
+    if (distributed && (!statsPattern.empty() || !tracePattern.empty())) {
+        cerr << "Error: --stats and --trace only count local renders" << endl;
+        return 1;
+    }
+
+    vector<Pose> poses;
+    if (posesPath != nullptr) {
+        bool ok;
+        if (string(posesPath) == "-") {
+            ok = readPoses(cin, poses);
+        } else {
+            ifstream in(posesPath);
+            if (!in.is_open()) {
+                cerr << "Error: Could not open " << posesPath << endl;
+                return 1;
+            }
+            ok = readPoses(in, poses);
+        }
+        if (!ok) return 1;
+    } else {
+        poses.push_back({Vector3D(100, 60, 40), Vector3D(0, 0, 0), Vector3D(0, 1, 0)});
+    }
+
+    // the loaders report on stdout; keep it for file names only
+    streambuf* out = cout.rdbuf(cerr.rdbuf());
+    if (!loadData(scenePath)) {
+        return 1;
+    }
+    if (texturePath != nullptr && !loadFloorTexture(texturePath)) {
+        return 1;
+    }
+    cout.rdbuf(out);
+
+    uint64_t fingerprint = renderFingerprint();
+    if (!coordinatorPath.empty()) {
+        bool ok = connectWorker(coordinatorPath, fingerprint);
+        freeScene();
+        return ok ? 0 : 1;
+    }
+    DistributedRenderer cluster;
+    if (distributed && !cluster.start(localWorkers, listenPath, fingerprint)) {
+        freeScene();
+        return 1;
+    }
+
+    if (width == 0) {
+        width = imageWidth;
+        height = imageHeight;
+    }
+
+    cerr << "Rendering " << poses.size() << " view(s) at " << width << "x" << height << " ("
+         << packetIsaName(activePacketIsa()) << " packets" << (wavefrontMode ? ", wavefront" : "")
+         << ", " << (sizeof(Real) == sizeof(float) ? "float" : "double")
+         << (distributed ? ", distributed" : "") << ")" << endl;
+
+    for (size_t k = 0; k < poses.size(); k++) {
+#ifdef RT_STATS
+        statsBegin(!tracePattern.empty());
+#endif
+        auto start = chrono::steady_clock::now();
+        string filename = outputName(pattern, k + 1);
+        Camera camera(poses[k].eye, poses[k].center, poses[k].up);
+        bool rendered = distributed ? cluster.render(camera, width, height, filename)
+                                    : renderToFile(camera, width, height, filename);
+        if (!rendered) {
+            cluster.stop();
+            freeScene();
+            return 1;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cerr << "View " << k + 1 << "/" << poses.size() << ": " << seconds << " s" << endl;
+        if (lastCheckpointStats.checkpoints > 0) {
+            cerr << "Checkpoints: " << lastCheckpointStats.checkpoints << " in " << lastCheckpointStats.seconds
+                 << " s (" << fixed << setprecision(3) << 100.0 * lastCheckpointStats.seconds / seconds
+                 << "% of the render)" << defaultfloat << endl;
+        }
+        // the workers count the samples of a distributed render
+        if (aaMaxSamples > 1 && !distributed) {
+            cerr << samplingReport() << endl;
+        }
+#ifdef RT_STATS
+        StatsCapture capture = describeCapture(filename, width, height, seconds);
+        cerr << statsSummary(capture) << endl;
+        if ((!statsPattern.empty() && !writeStatsReport(outputName(statsPattern, k + 1), capture)) ||
+            (!tracePattern.empty() && !writeTrace(outputName(tracePattern, k + 1), capture))) {
+            freeScene();
+            return 1;
+        }
+#endif
+        if (!referencePattern.empty()) {
+            double psnr;
+            if (!imagePsnr(filename, outputName(referencePattern, k + 1), psnr)) {
+                cluster.stop();
+                freeScene();
+                return 1;
+            }
+            cerr << "PSNR vs reference: " << psnr << " dB" << endl;
+        }
+        cout << filename << endl;
+    }
+
+    cluster.stop();
+    freeScene();
+    return 0;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include "2005024_classes.h"
+
+// Row-major 4x4 matrix acting on column vectors: p' = m * (p, 1).
+struct Transform {
+    double m[4][4];
+
+    static Transform identity() {
+        Transform t;
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) t.m[i][j] = i == j ? 1.0 : 0.0;
+        }
+        return t;
+    }
+
+    Vector3D point(const Vector3D& p) const {
+        return Vector3D(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3D vector(const Vector3D& v) const {
+        return Vector3D(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    // multiplies by the transpose; on an inverse this maps normals outwards
+    Vector3D transposedVector(const Vector3D& v) const {
+        return Vector3D(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                        m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                        m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+    }
+
+    // rays stay straight lines only under affine maps
+    bool affine() const {
+        return m[3][0] == 0.0 && m[3][1] == 0.0 && m[3][2] == 0.0 && m[3][3] == 1.0;
+    }
+
+    // Gauss-Jordan with partial pivoting; false for singular matrices
+    bool inverse(Transform& out) const {
+        double a[4][8];
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                a[i][j] = m[i][j];
+                a[i][j + 4] = i == j ? 1.0 : 0.0;
+            }
+        }
+        for (int col = 0; col < 4; col++) {
+            int pivot = col;
+            for (int row = col + 1; row < 4; row++) {
+                if (fabs(a[row][col]) > fabs(a[pivot][col])) pivot = row;
+            }
+            if (fabs(a[pivot][col]) < 1e-12) return false;
+            swap(a[col], a[pivot]);
+            double scale = 1.0 / a[col][col];
+            for (int j = 0; j < 8; j++) a[col][j] *= scale;
+            for (int row = 0; row < 4; row++) {
+                if (row == col || a[row][col] == 0.0) continue;
+                double factor = a[row][col];
+                for (int j = 0; j < 8; j++) a[row][j] -= factor * a[col][j];
+            }
+        }
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) out.m[i][j] = a[i][j + 4];
+        }
+        // the last row of an affine inverse is exact by construction
+        out.m[3][0] = out.m[3][1] = out.m[3][2] = 0.0;
+        out.m[3][3] = 1.0;
+        return true;
+    }
+
+    // box around the eight transformed corners
+    AABB bounds(const AABB& box) const {
+        AABB out;
+        for (int corner = 0; corner < 8; corner++) {
+            Vector3D p(corner & 1 ? box.hi.x : box.lo.x,
+                       corner & 2 ? box.hi.y : box.lo.y,
+                       corner & 4 ? box.hi.z : box.lo.z);
+            out.expand(point(p));
+        }
+        return out;
+    }
+};
+
+// One placement of a prototype (a SceneGeometry of its own, see
+// SceneGeometry::prototypes). Only the transform pair and the material
+// override are per instance; the geometry and its BVH are shared.
+struct Instance {
+    uint32_t prototype;
+    Transform toWorld, toLocal;
+    int material;       // replaces every prototype material when >= 0
+
+    // r in prototype space. The direction is not renormalised, so distances
+    // along it, and with them t, tMax and EPSILON, mean the same in both.
+    Ray localRay(const Ray* r) const {
+        Ray local;
+        local.start = toLocal.point(r->start);
+        local.dir = toLocal.vector(r->dir);
+        return local;
+    }
+
+    Vector3D worldNormal(const Vector3D& n) const {
+        Vector3D out = toLocal.transposedVector(n);
+        out.normalize();
+        return out;
+    }
+};
@@ -0,0 +1,269 @@
+#pragma once
+#include "2005024_bvh.h"
+
+// Moller-Trumbore, shared by packed triangles and mesh triangles so both
+// give the same hits. Fills t, u, v for a hit in (EPSILON, tMax).
+inline bool rayTriangle(Ray* r, const Vector3D& a, Vector3D edge1, Vector3D edge2, Real tMax,
+                        Real& tOut, Real& uOut, Real& vOut) {
+    Vector3D h = r->dir.cross(edge2);
+    Real det = edge1.dot(h);
+
+    if (det > -EPSILON && det < EPSILON) {
+        return false;
+    }
+
+    Real invDet = 1 / det;
+    Vector3D s = r->start - a;
+    Real u = invDet * s.dot(h);
+    if (u < 0 || u > 1) {
+        return false;
+    }
+
+    Vector3D q = s.cross(edge1);
+    Real v = invDet * r->dir.dot(q);
+    if (v < 0 || u + v > 1) {
+        return false;
+    }
+
+    Real t = invDet * edge2.dot(q);
+    if (t <= EPSILON || t >= tMax) {
+        return false;
+    }
+    tOut = t;
+    uOut = u;
+    vOut = v;
+    return true;
+}
+
+struct MeshVertex {
+    float x, y, z;
+};
+
+// BVHNode with a float box: half the size, and a mesh has a lot of them.
+// Boxes are rounded outwards so they still contain their triangles.
+struct MeshNode {
+    float lo[3], hi[3];
+    uint32_t offset;    // first triangle for leaves, right child for inner nodes
+    uint16_t count;     // > 0 for leaves
+    uint16_t axis;
+};
+
+// Indexed triangle mesh: one shared float vertex buffer, 32-bit indices and
+// its own BVH. build() reorders the triangles into leaf order, so leaves
+// address the index buffer directly and no ref array is kept. The whole
+// mesh is a single PRIM_MESH entry in the scene BVH, with one material.
+struct TriangleMesh {
+    static const int LEAF_SIZE = 8;
+
+    vector<MeshVertex> vertices;
+    vector<uint32_t> indices;       // 3 per triangle
+    vector<MeshNode> nodes;
+    int material = -1;
+    string name;                    // source file, for reports
+
+    size_t triangleCount() const {
+        return indices.size() / 3;
+    }
+
+    Vector3D vertex(uint32_t i) const {
+        const MeshVertex& p = vertices[i];
+        return Vector3D(p.x, p.y, p.z);
+    }
+
+    // corner a and the two edges of triangle tri, as hitTriangle expects them
+    void corners(uint32_t tri, Vector3D& a, Vector3D& edge1, Vector3D& edge2) const {
+        const uint32_t* idx = &indices[3 * (size_t)tri];
+        a = vertex(idx[0]);
+        edge1 = vertex(idx[1]) - a;
+        edge2 = vertex(idx[2]) - a;
+    }
+
+    Vector3D normal(uint32_t tri) const {
+        Vector3D a, edge1, edge2;
+        corners(tri, a, edge1, edge2);
+        Vector3D n = edge1.cross(edge2);
+        n.normalize();
+        return n;
+    }
+
+    size_t memoryBytes() const {
+        return vertices.size() * sizeof(MeshVertex) + indices.size() * sizeof(uint32_t) +
+               nodes.size() * sizeof(MeshNode);
+    }
+
+    AABB bounds() const {
+        if (nodes.empty()) return AABB();
+        const MeshNode& n = nodes[0];
+        return AABB(Vector3D(n.lo[0], n.lo[1], n.lo[2]), Vector3D(n.hi[0], n.hi[1], n.hi[2]));
+    }
+
+    // Builds the BVH with the scene's SAH builder, then compacts it. Drops
+    // degenerate triangles, which can never be hit.
+    void build() {
+        vector<AABB> boxes;
+        vector<uint32_t> refs;
+        boxes.reserve(triangleCount());
+        refs.reserve(triangleCount());
+        for (uint32_t tri = 0; tri < triangleCount(); tri++) {
+            Vector3D a, edge1, edge2;
+            corners(tri, a, edge1, edge2);
+            if (edge1.cross(edge2).length() == 0.0) continue;
+            AABB box;
+            box.expand(a);
+            box.expand(a + edge1);
+            box.expand(a + edge2);
+            box.pad(EPSILON);
+            boxes.push_back(box);
+            refs.push_back(tri);
+        }
+
+        BVH bvh;
+        bvh.build(move(boxes), refs, LEAF_SIZE);
+
+        vector<uint32_t> sorted(3 * bvh.refs.size());
+        for (size_t i = 0; i < bvh.refs.size(); i++) {
+            for (int k = 0; k < 3; k++) sorted[3 * i + k] = indices[3 * (size_t)bvh.refs[i] + k];
+        }
+        indices.swap(sorted);
+
+        nodes.resize(bvh.nodes.size());
+        for (size_t n = 0; n < bvh.nodes.size(); n++) {
+            const BVHNode& src = bvh.nodes[n];
+            MeshNode& dst = nodes[n];
+            for (int a = 0; a < 3; a++) {
+                dst.lo[a] = roundDown(src.box.axisMin(a));
+                dst.hi[a] = roundUp(src.box.axisMax(a));
+            }
+            dst.offset = src.offset;
+            dst.count = src.count;
+            dst.axis = src.axis;
+        }
+    }
+
+    static float roundDown(double x) {
+        float f = (float)x;
+        return f > x ? nextafterf(f, -INFINITY) : f;
+    }
+
+    static float roundUp(double x) {
+        float f = (float)x;
+        return f < x ? nextafterf(f, INFINITY) : f;
+    }
+
+    // false for meshes whose indices or nodes point outside their arrays
+    bool valid() const {
+        if (indices.size() % 3 != 0) return false;
+        for (uint32_t i : indices) {
+            if (i >= vertices.size()) return false;
+        }
+        vector<int> depth(nodes.size(), 0);
+        for (size_t n = 0; n < nodes.size(); n++) {
+            const MeshNode& node = nodes[n];
+            bool ok = node.count > 0
+                ? (size_t)node.offset + node.count <= triangleCount()
+                : node.offset > n + 1 && node.offset < nodes.size() && depth[n] + 1 < BVH::STACK_SIZE;
+            if (!ok) return false;
+            if (node.count == 0) depth[n + 1] = depth[node.offset] = depth[n] + 1;
+        }
+        return true;
+    }
+
+    static bool boxHit(const MeshNode& node, const Ray* r, const Vector3D& invDir, Real tMax) {
+        Real t0 = 0.0, t1 = tMax;
+        const Real origin[3] = {r->start.x, r->start.y, r->start.z};
+        const Real inv[3] = {invDir.x, invDir.y, invDir.z};
+        for (int a = 0; a < 3; a++) {
+            Real near = (node.lo[a] - origin[a]) * inv[a];
+            Real far = (node.hi[a] - origin[a]) * inv[a];
+            if (near > far) swap(near, far);
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+        return t0 <= t1;
+    }
+
+    // Nearest triangle before tMax: t, u, v and the triangle index.
+    bool closest(Ray* r, Real tMax, Real& t, Real& u, Real& v, uint32_t& tri) const {
+        if (nodes.empty()) return false;
+        Vector3D invDir = BVH::inverseDir(r);
+        bool negative[3] = {r->dir.x < 0, r->dir.y < 0, r->dir.z < 0};
+        bool found = false;
+
+        uint32_t stack[BVH::STACK_SIZE];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            uint32_t index = stack[--sp];
+            const MeshNode& node = nodes[index];
+            STAT_ADD(STAT_BVH_NODES, 1);
+            if (!boxHit(node, r, invDir, tMax)) continue;
+
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    STAT_ADD(STAT_PRIM_TESTS, 1);
+                    Vector3D a, edge1, edge2;
+                    corners(i, a, edge1, edge2);
+                    if (rayTriangle(r, a, edge1, edge2, tMax, t, u, v)) {
+                        tMax = t;
+                        tri = i;
+                        found = true;
+                    }
+                }
+            } else if (negative[node.axis]) {
+                stack[sp++] = index + 1;
+                stack[sp++] = node.offset;
+            } else {
+                stack[sp++] = node.offset;
+                stack[sp++] = index + 1;
+            }
+        }
+        // rayTriangle only writes on a hit, and every hit lowers tMax, so t, u, v
+        // already belong to the nearest triangle
+        return found;
+    }
+
+    // true if some triangle is hit in (EPSILON, tMax)
+    bool any(Ray* r, Real tMax) const {
+        if (nodes.empty()) return false;
+        Vector3D invDir = BVH::inverseDir(r);
+        Real t, u, v;
+
+        uint32_t stack[BVH::STACK_SIZE];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            uint32_t index = stack[--sp];
+            const MeshNode& node = nodes[index];
+            STAT_ADD(STAT_BVH_NODES, 1);
+            if (!boxHit(node, r, invDir, tMax)) continue;
+
+            if (node.count > 0) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                    STAT_ADD(STAT_PRIM_TESTS, 1);
+                    Vector3D a, edge1, edge2;
+                    corners(i, a, edge1, edge2);
+                    if (rayTriangle(r, a, edge1, edge2, tMax, t, u, v)) return true;
+                }
+            } else {
+                stack[sp++] = index + 1;
+                stack[sp++] = node.offset;
+            }
+        }
+        return false;
+    }
+
+    // colorMaterial, when >= 0, replaces the mesh's own material for the colour
+    void draw(int colorMaterial = -1) const {
+#ifndef RT_HEADLESS
+        int shown = colorMaterial >= 0 ? colorMaterial : material;
+        if (shown >= 0) {
+            const Material& m = materials[shown];
+            glColor3f(m.color[0], m.color[1], m.color[2]);
+        }
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, vertices.data());
+        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, indices.data());
+        glDisableClientState(GL_VERTEX_ARRAY);
+#endif
+    }
+};
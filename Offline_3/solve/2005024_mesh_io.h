@@ -0,0 +1,288 @@
+#pragma once
+#include "2005024_mesh.h"
+#include "../../common/2005024_scene_tokenizer.h"
+
+// Mesh import for the `mesh <file>` scene command: Wavefront OBJ (v and f
+// lines; polygons are fanned into triangles, everything else is skipped)
+// and PLY with a vertex element holding x, y, z and a face element holding
+// a vertex_indices list, in binary of either byte order or ASCII. Both
+// fill the vertex and index buffers only; TriangleMesh::build() follows.
+
+bool loadObjMesh(const string& path, TriangleMesh& mesh, string& error) {
+    SceneTokenizer in(path);
+    vector<uint32_t> polygon;
+
+    while (in && !in.atEnd()) {
+        string_view key;
+        in >> key;
+        if (key == "v") {
+            double x, y, z;
+            in >> x >> y >> z;
+            mesh.vertices.push_back({(float)x, (float)y, (float)z});
+        } else if (key == "f") {
+            polygon.clear();
+            while (in && !in.atLineEnd()) {
+                // "v", "v/vt", "v//vn" or "v/vt/vn"; only the position index matters
+                string_view ref;
+                in >> ref;
+                long long index = 0;
+                auto result = from_chars(ref.data(), ref.data() + ref.size(), index);
+                if (result.ec != errc() || (result.ptr != ref.data() + ref.size() && *result.ptr != '/')) {
+                    in.failAt("bad face vertex '" + string(ref) + "'");
+                    break;
+                }
+                // negative indices count back from the latest vertex
+                long long resolved = index < 0 ? (long long)mesh.vertices.size() + index : index - 1;
+                if (index == 0 || resolved < 0 || resolved >= (long long)mesh.vertices.size()) {
+                    in.failAt("face vertex " + to_string(index) + " does not exist");
+                    break;
+                }
+                polygon.push_back(resolved);
+            }
+            for (size_t k = 2; k < polygon.size(); k++) {
+                mesh.indices.insert(mesh.indices.end(), {polygon[0], polygon[k - 1], polygon[k]});
+            }
+        }
+        if (in) in.skipLine();
+    }
+
+    if (!in) {
+        error = in.error();
+        return false;
+    }
+    return true;
+}
+
+// Values of one PLY property type, read from binary data or ASCII tokens.
+struct PlyReader {
+    enum Format { ASCII, BINARY_LE, BINARY_BE };
+
+    SceneTokenizer& in;
+    Format format;
+
+    static int typeSize(const string& type) {
+        if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+        if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+        if (type == "int" || type == "uint" || type == "int32" || type == "uint32" ||
+            type == "float" || type == "float32") return 4;
+        if (type == "double" || type == "float64") return 8;
+        return 0;
+    }
+
+    bool read(const string& type, double& value) {
+        if (format == ASCII) {
+            in >> value;
+            return (bool)in;
+        }
+
+        int size = typeSize(type);
+        if (in.end - in.cur < size) return in.fail(in.path + ": binary data is truncated");
+        unsigned char bytes[8];
+        memcpy(bytes, in.cur, size);
+        in.cur += size;
+        bool swapBytes = (format == BINARY_BE) == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+        if (swapBytes) reverse(bytes, bytes + size);
+
+        auto as = [&](auto sample) {
+            memcpy(&sample, bytes, sizeof(sample));
+            return (double)sample;
+        };
+        if (type == "char" || type == "int8") value = as(int8_t());
+        else if (type == "uchar" || type == "uint8") value = as(uint8_t());
+        else if (type == "short" || type == "int16") value = as(int16_t());
+        else if (type == "ushort" || type == "uint16") value = as(uint16_t());
+        else if (type == "int" || type == "int32") value = as(int32_t());
+        else if (type == "uint" || type == "uint32") value = as(uint32_t());
+        else if (type == "float" || type == "float32") value = as(float());
+        else value = as(double());
+        return true;
+    }
+};
+
+bool loadPlyMesh(const string& path, TriangleMesh& mesh, string& error) {
+    struct Property {
+        string name, type;
+        string countType;       // non-empty for lists
+    };
+    struct Element {
+        string name;
+        uint64_t count;
+        vector<Property> properties;
+    };
+
+    SceneTokenizer in(path);
+    vector<Element> elements;
+    PlyReader::Format format = PlyReader::ASCII;
+    bool formatSeen = false;
+
+    string_view word;
+    in >> word;
+    if (in && word != "ply") in.failAt("not a PLY file");
+    in.skipLine();
+    while (in) {
+        in >> word;
+        if (!in) break;
+        if (word == "end_header") {
+            in.skipLine();
+            break;
+        }
+        if (word == "format") {
+            string_view name;
+            in >> name;
+            if (name == "ascii") format = PlyReader::ASCII;
+            else if (name == "binary_little_endian") format = PlyReader::BINARY_LE;
+            else if (name == "binary_big_endian") format = PlyReader::BINARY_BE;
+            else in.failAt("unknown format '" + string(name) + "'");
+            formatSeen = true;
+        } else if (word == "element") {
+            Element e;
+            in >> e.name;
+            double count = -1;
+            in >> count;
+            if (in && (count < 0 || count != floor(count))) in.failAt("bad element count");
+            e.count = count;
+            elements.push_back(e);
+        } else if (word == "property") {
+            if (elements.empty()) {
+                in.failAt("property outside an element");
+                break;
+            }
+            Property p;
+            in >> p.type;
+            if (p.type == "list") {
+                p.countType = p.type;
+                in >> p.countType >> p.type;
+                if (in && PlyReader::typeSize(p.countType) == 0) in.failAt("unknown type '" + p.countType + "'");
+            }
+            in >> p.name;
+            if (in && PlyReader::typeSize(p.type) == 0) in.failAt("unknown type '" + p.type + "'");
+            elements.back().properties.push_back(p);
+        } else if (word != "comment" && word != "obj_info") {
+            in.failAt("unexpected header line '" + string(word) + "'");
+        }
+        if (in) in.skipLine();
+    }
+    if (in && !formatSeen) in.fail(path + ": PLY header has no format line");
+
+    // every row takes some bytes (one per token in ASCII), so the counts
+    // must fit in what is left of the file before anything is reserved
+    uint64_t left = in ? in.end - in.cur : 0;
+    for (const Element& e : elements) {
+        if (!in) break;
+        uint64_t rowBytes = 0;
+        for (const Property& p : e.properties) {
+            const string& type = p.countType.empty() ? p.type : p.countType;
+            rowBytes += format == PlyReader::ASCII ? 1 : PlyReader::typeSize(type);
+        }
+        if (rowBytes > 0 && e.count > left / rowBytes) {
+            in.fail(path + ": bad element count " + to_string(e.count) + " for '" + e.name + "'");
+            break;
+        }
+        left -= e.count * rowBytes;
+    }
+
+    PlyReader reader{in, format};
+    for (const Element& e : elements) {
+        if (!in) break;
+        int x = -1, y = -1, z = -1, faceList = -1;
+        for (int k = 0; k < (int)e.properties.size(); k++) {
+            const Property& p = e.properties[k];
+            if (p.countType.empty()) {
+                if (p.name == "x") x = k;
+                if (p.name == "y") y = k;
+                if (p.name == "z") z = k;
+            } else if (p.name == "vertex_indices" || p.name == "vertex_index") {
+                faceList = k;
+            }
+        }
+        bool isVertex = e.name == "vertex", isFace = e.name == "face";
+        if (isVertex && (x < 0 || y < 0 || z < 0)) {
+            in.fail(path + ": vertex element lacks x, y or z");
+            break;
+        }
+        if (isFace && faceList < 0) {
+            in.fail(path + ": face element lacks a vertex_indices list");
+            break;
+        }
+        // ASCII rows can be as short as their tokens; past a cap, let the
+        // buffers grow as the rows arrive
+        uint64_t expected = format == PlyReader::ASCII ? min<uint64_t>(e.count, 1 << 20) : e.count;
+        if (isVertex) mesh.vertices.reserve(mesh.vertices.size() + expected);
+        if (isFace) mesh.indices.reserve(mesh.indices.size() + 3 * expected);
+
+        vector<double> values(e.properties.size());
+        vector<uint32_t> polygon;
+        for (uint64_t row = 0; row < e.count && in; row++) {
+            for (int k = 0; k < (int)e.properties.size() && in; k++) {
+                const Property& p = e.properties[k];
+                if (p.countType.empty()) {
+                    reader.read(p.type, values[k]);
+                    continue;
+                }
+                double n;
+                if (!reader.read(p.countType, n)) break;
+                polygon.clear();
+                for (int item = 0; item < (int)n && in; item++) {
+                    double index;
+                    if (!reader.read(p.type, index)) break;
+                    if (k == faceList && isFace) {
+                        if (index < 0 || index >= mesh.vertices.size()) {
+                            in.fail(path + ": face " + to_string(row) + " uses vertex " +
+                                    to_string((long long)index) + " of " + to_string(mesh.vertices.size()));
+                            break;
+                        }
+                        polygon.push_back(index);
+                    }
+                }
+                for (size_t c = 2; c < polygon.size(); c++) {
+                    mesh.indices.insert(mesh.indices.end(), {polygon[0], polygon[c - 1], polygon[c]});
+                }
+            }
+            if (isVertex && in) {
+                mesh.vertices.push_back({(float)values[x], (float)values[y], (float)values[z]});
+            }
+        }
+    }
+
+    if (!in) {
+        error = in.error();
+        return false;
+    }
+    return true;
+}
+
+// Loads a mesh file by its extension (.obj or .ply) and builds its BVH.
+bool loadMesh(const string& path, TriangleMesh& mesh, string& error) {
+    string ext = path.substr(path.find_last_of('.') == string::npos ? path.size() : path.find_last_of('.'));
+    for (char& c : ext) c = tolower((unsigned char)c);
+
+    // a mesh too large for memory fails its load rather than the process
+    try {
+        bool ok;
+        if (ext == ".obj") {
+            ok = loadObjMesh(path, mesh, error);
+        } else if (ext == ".ply") {
+            ok = loadPlyMesh(path, mesh, error);
+        } else {
+            error = path + ": unknown mesh format (expected .obj or .ply)";
+            return false;
+        }
+        if (!ok) return false;
+        if (mesh.vertices.size() > UINT32_MAX) {
+            error = path + ": more than 2^32 vertices";
+            return false;
+        }
+
+        mesh.name = path;
+        mesh.build();
+    } catch (const bad_alloc&) {
+        mesh = TriangleMesh();
+        error = path + ": out of memory";
+        return false;
+    }
+    if (mesh.nodes.empty()) {
+        error = path + ": mesh has no triangles";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include "2005024_geometry.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKET_X86 1
+#endif
+
+// Up to MAX_WIDTH coherent rays (neighbouring primary rays) stored as
+// structure-of-arrays. Lanes [0, count) are live; the results come back in
+// t/prim/element/part/u/v with prim == PRIM_NONE for misses.
+struct PacketQuery {
+    static const int MAX_WIDTH = 16;
+
+    int count;
+    Ray* rays[MAX_WIDTH];
+    alignas(64) Real ox[MAX_WIDTH], oy[MAX_WIDTH], oz[MAX_WIDTH];
+    alignas(64) Real dx[MAX_WIDTH], dy[MAX_WIDTH], dz[MAX_WIDTH];
+    alignas(64) Real t[MAX_WIDTH], u[MAX_WIDTH], v[MAX_WIDTH];
+    PrimRef prim[MAX_WIDTH];
+    uint32_t element[MAX_WIDTH];
+    PrimRef part[MAX_WIDTH];
+
+    PacketQuery() {
+        count = 0;
+    }
+
+    void add(Ray* r) {
+        int k = count++;
+        rays[k] = r;
+        ox[k] = r->start.x; oy[k] = r->start.y; oz[k] = r->start.z;
+        dx[k] = r->dir.x; dy[k] = r->dir.y; dz[k] = r->dir.z;
+    }
+
+    // pads the unused lanes with a copy of lane 0 so every lane holds finite data
+    void pad(int width) {
+        for (int k = count; k < width; k++) {
+            ox[k] = ox[0]; oy[k] = oy[0]; oz[k] = oz[0];
+            dx[k] = dx[0]; dy[k] = dy[0]; dz[k] = dz[0];
+        }
+    }
+
+    bool finishHit(const SceneGeometry& geo, int k, HitRecord& rec) {
+        if (prim[k] == PRIM_NONE) return false;
+        rec.t = t[k];
+        rec.prim = prim[k];
+        rec.u = u[k];
+        rec.v = v[k];
+        rec.element = element[k];
+        rec.part = part[k];
+        if (primType(prim[k]) == PRIM_OBJECT) {
+            rec.obj = geo.objects[primIndex(prim[k])];
+            rec.material = rec.obj->materialId;
+        }
+        geo.finalizeHit(rays[k], rec);
+        return true;
+    }
+};
+
+enum PacketIsa {
+    ISA_SCALAR,
+    ISA_SSE4,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+#ifdef PACKET_X86
+
+// A packet is exactly one register of Real (twice the lanes in RT_FLOAT
+// builds): GCC splits wider generic
+// vectors into scalar code for comparisons, which loses the whole gain.
+// The helpers are force-inlined so no vector crosses a call boundary.
+#define PACKET_INLINE static inline __attribute__((always_inline))
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#define PACKET_NS packet_sse4
+#define PACKET_W (16 / (int)sizeof(Real))
+#ifdef RT_FLOAT
+#define PACKET_SQRT(p) _mm_storeu_ps(p, _mm_sqrt_ps(_mm_loadu_ps(p)))
+#define PACKET_MOVEMASK(p) _mm_movemask_ps(_mm_loadu_ps((const float*)(p)))
+#else
+#define PACKET_SQRT(p) _mm_storeu_pd(p, _mm_sqrt_pd(_mm_loadu_pd(p)))
+#define PACKET_MOVEMASK(p) _mm_movemask_pd(_mm_loadu_pd((const double*)(p)))
+#endif
+#include "2005024_packet_kernels.inc"
+#undef PACKET_NS
+#undef PACKET_W
+#undef PACKET_SQRT
+#undef PACKET_MOVEMASK
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define PACKET_NS packet_avx2
+#define PACKET_W (32 / (int)sizeof(Real))
+#ifdef RT_FLOAT
+#define PACKET_SQRT(p) _mm256_storeu_ps(p, _mm256_sqrt_ps(_mm256_loadu_ps(p)))
+#define PACKET_MOVEMASK(p) _mm256_movemask_ps(_mm256_loadu_ps((const float*)(p)))
+#else
+#define PACKET_SQRT(p) _mm256_storeu_pd(p, _mm256_sqrt_pd(_mm256_loadu_pd(p)))
+#define PACKET_MOVEMASK(p) _mm256_movemask_pd(_mm256_loadu_pd((const double*)(p)))
+#endif
+#include "2005024_packet_kernels.inc"
+#undef PACKET_NS
+#undef PACKET_W
+#undef PACKET_SQRT
+#undef PACKET_MOVEMASK
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq")
+// avx512f brings FMA along; a fused a * b + c rounds once and would no
+// longer match the scalar code
+#pragma GCC optimize("fp-contract=off")
+#define PACKET_NS packet_avx512
+#define PACKET_W (64 / (int)sizeof(Real))
+#ifdef RT_FLOAT
+#define PACKET_SQRT(p) _mm512_storeu_ps(p, _mm512_sqrt_ps(_mm512_loadu_ps(p)))
+#define PACKET_MOVEMASK(p) (int)_mm512_test_epi32_mask(_mm512_loadu_si512(p), _mm512_loadu_si512(p))
+#else
+#define PACKET_SQRT(p) _mm512_storeu_pd(p, _mm512_sqrt_pd(_mm512_loadu_pd(p)))
+#define PACKET_MOVEMASK(p) (int)_mm512_test_epi64_mask(_mm512_loadu_si512(p), _mm512_loadu_si512(p))
+#endif
+#include "2005024_packet_kernels.inc"
+#undef PACKET_NS
+#undef PACKET_W
+#undef PACKET_SQRT
+#undef PACKET_MOVEMASK
+#pragma GCC pop_options
+
+#undef PACKET_INLINE
+
+#endif
+
+// -1 picks the widest instruction set the CPU supports
+int packetIsaOverride = -1;
+
+PacketIsa detectPacketIsa() {
+#ifdef PACKET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return ISA_SSE4;
+#endif
+    return ISA_SCALAR;
+}
+
+PacketIsa activePacketIsa() {
+    static PacketIsa detected = detectPacketIsa();
+    if (packetIsaOverride >= 0 && packetIsaOverride < detected) {
+        return (PacketIsa)packetIsaOverride;
+    }
+    return detected;
+}
+
+const char* packetIsaName(PacketIsa isa) {
+    switch (isa) {
+        case ISA_SSE4: return "SSE4.2";
+        case ISA_AVX2: return "AVX2";
+        case ISA_AVX512: return "AVX-512";
+        default: return "scalar";
+    }
+}
+
+int packetWidth(PacketIsa isa) {
+    switch (isa) {
+        case ISA_SSE4: return 16 / sizeof(Real);
+        case ISA_AVX2: return 32 / sizeof(Real);
+        case ISA_AVX512: return 64 / sizeof(Real);
+        default: return 1;
+    }
+}
+
+// closest hit for every live lane of q
+void closestHitPacket(const SceneGeometry& geo, PacketQuery& q, PacketIsa isa) {
+    if (isa != ISA_SCALAR) STAT_ADD(STAT_PACKETS, 1);
+    q.pad(packetWidth(isa));
+    switch (isa) {
+#ifdef PACKET_X86
+        case ISA_SSE4: packet_sse4::closestHit(geo, q); return;
+        case ISA_AVX2: packet_avx2::closestHit(geo, q); return;
+        case ISA_AVX512: packet_avx512::closestHit(geo, q); return;
+#endif
+        default: break;
+    }
+    for (int k = 0; k < q.count; k++) {
+        HitRecord rec;
+        if (geo.closestHit(q.rays[k], rec)) {
+            q.prim[k] = rec.prim;
+            q.element[k] = rec.element;
+            q.part[k] = rec.part;
+            q.t[k] = rec.t;
+            q.u[k] = rec.u;
+            q.v[k] = rec.v;
+        } else {
+            q.prim[k] = PRIM_NONE;
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#!/usr/bin/bash
+
+# Compares the single-precision preview build (-DRT_FLOAT) with the default
+# double-precision reference build: render time of each and the PSNR of the
+# float image against the double one.
+#
+# Usage: ./2005024_precision_report.sh [scene file] [headless options...]
+# (default scene: ../scene.txt, rendered from the viewer's start pose)
+
+cd "$(dirname "$0")" || exit 1
+
+scene="${1:-../scene.txt}"
+shift
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+for precision in double float; do
+    flags=""
+    if [ "$precision" = float ]; then
+        flags="-DRT_FLOAT"
+    fi
+    g++ 2005024_headless.cpp -o "$work/headless_$precision" -O2 -pthread $flags
+    if [ $? -ne 0 ]; then
+        echo "Compilation of the $precision build failed."
+        exit 1
+    fi
+done
+
+seconds() {
+    grep "^View 1/" | sed 's/.*: \(.*\) s$/\1/'
+}
+
+reference=$("$work/headless_double" "$scene" -o "$work/double_%d.bmp" "$@" 2>&1 >/dev/null | seconds)
+"$work/headless_float" "$scene" -o "$work/float_%d.bmp" --reference "$work/double_%d.bmp" "$@" \
+    2>"$work/float.log" >/dev/null
+preview=$(seconds < "$work/float.log")
+psnr=$(grep "^PSNR" "$work/float.log" | sed 's/.*: //')
+
+if [ -z "$reference" ] || [ -z "$preview" ]; then
+    echo "Rendering failed:"
+    cat "$work/float.log"
+    exit 1
+fi
+
+echo "Scene:   $scene"
+echo "double:  $reference s"
+echo "float:   $preview s"
+echo "Speedup: $(awk -v a="$reference" -v b="$preview" 'BEGIN { printf "%.2fx", a / b }')"
+echo "PSNR:    $psnr (float against double)"
@@ -0,0 +1,896 @@
+#pragma once
+#include "2005024_classes.h"
+#include "2005024_geometry.h"
+#include "2005024_tiles.h"
+#include "2005024_packet.h"
+#include "2005024_wavefront.h"
+#include "2005024_framebuffer.h"
+#include "2005024_bmp_stream.h"
+#include "2005024_checkpoint.h"
+#include "2005024_scene_binary.h"
+#include "2005024_mesh_io.h"
+#include "bitmap_image.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+// Scene state and the offline renderer, shared by the interactive GLUT
+// viewer (2005024_main.cpp) and the headless batch renderer
+// (2005024_headless.cpp).
+
+vector<Object*> objects;
+MaterialTable materials;
+SceneGeometry sceneGeometry;
+vector<PointLight> pointLights;
+vector<SpotLight> spotLights;
+int recursion_level;
+int imageWidth, imageHeight;
+int renderThreads = 0;      // 0 = one per hardware thread
+int renderTileSize = 32;
+bool wavefrontMode = false;
+int wavefrontTileSize = 64;     // one wavefront batch per tile
+// HDR shading keeps colours above 1 through every bounce and leaves the
+// range to the tone mapper; off, each bounce clamps like the original tracer
+bool hdrShading = false;
+ResolveSettings resolveSettings;
+// Texture data for the floor
+unsigned char* textureData = nullptr;
+int textureWidth = 0, textureHeight = 0, textureChannels = 0;
+bool useTexture = false;
+// what the tracer samples; textureData stays for the GL preview
+MipTexture floorTexture;
+TextureFilter textureFilter = FILTER_TRILINEAR;
+// the lights that may reach each part of the scene, see LightGrid
+LightGrid lightGrid;
+// Many-light mode: with lightSamples > 0 every shading point draws that
+// many of those lights instead of summing all of them, and lightPasses
+// passes with fresh draws are averaged per frame.
+int lightSamples = 0;
+int lightPasses = 1;
+int lightPass = 0;
+// of the scene file with the mesh files it loads, and of the decoded floor
+// texture, see renderFingerprint
+uint64_t sceneFingerprint = 0;
+uint64_t textureFingerprint = 0;
+
+bool loadFloorTexture(const char* filename) {
+    if (textureData) {
+        stbi_image_free(textureData);
+        textureData = nullptr;
+    }
+    textureData = stbi_load(filename, &textureWidth, &textureHeight, &textureChannels, 3);
+    if (!textureData) {
+        cout << "Failed to load texture: " << filename << endl;
+        floorTexture.clear();
+        textureFingerprint = 0;
+        useTexture = false;
+        return false;
+    }
+    floorTexture.build(textureData, textureWidth, textureHeight);
+    textureFingerprint = hashBytes(0, textureData, (size_t)textureWidth * textureHeight * 3);
+    useTexture = true;
+    cout << "Loaded texture: " << filename << " (" << textureWidth << " x " << textureHeight << ", "
+         << floorTexture.levels.size() << " mip levels)" << endl;
+    return true;
+}
+
+// the light grid covers the bounded geometry and the floor
+void buildLightIndex() {
+    AABB region = sceneGeometry.bvh.bounds();
+    for (Object* obj : objects) {
+        Floor* floor = dynamic_cast<Floor*>(obj);
+        if (floor == nullptr) continue;
+        Vector3D corner = floor->reference_point;
+        region.expand(AABB(corner, corner + Vector3D(floor->width, floor->width, 0)));
+    }
+    lightGrid.build(region);
+}
+
+void printSceneSummary() {
+    cout << "Scene loaded successfully!" << endl;
+    cout << "Objects: " << objects.size() << endl;
+    cout << "Point Lights: " << pointLights.size() << endl;
+    cout << "Spot Lights: " << spotLights.size() << endl;
+    cout << "Recursion Level: " << recursion_level << endl;
+    cout << "Compiled: " << sceneGeometry.spheres.size() << " spheres, "
+         << sceneGeometry.triangles.size() << " triangles, "
+         << sceneGeometry.quadrics.size() << " quadrics, "
+         << sceneGeometry.objects.size() << " other, "
+         << materials.size() << " materials" << endl;
+    if (!sceneGeometry.quadrics.empty()) {
+        static const char* shapeNames[] = {"general", "planes", "spheres", "cylinders", "centred"};
+        int shapes[5] = {0, 0, 0, 0, 0};
+        for (const PackedQuadric& g : sceneGeometry.quadrics) shapes[g.shape]++;
+        cout << "Quadrics:";
+        for (int s = 0; s < 5; s++) {
+            if (shapes[s] > 0) cout << " " << shapes[s] << " " << shapeNames[s];
+        }
+        cout << endl;
+    }
+    if (!sceneGeometry.meshes.empty()) {
+        size_t triangles = sceneGeometry.meshTriangles();
+        cout << "Meshes: " << sceneGeometry.meshes.size() << " with " << triangles << " triangles, "
+             << fixed << setprecision(1) << sceneGeometry.meshBytes() / 1048576.0 << " MB ("
+             << (double)sceneGeometry.meshBytes() / max<size_t>(triangles, 1) << " bytes per triangle)"
+             << defaultfloat << endl;
+    }
+    if (!sceneGeometry.instances.empty()) {
+        size_t unique = 0;
+        for (const SceneGeometry& proto : sceneGeometry.prototypes) unique += proto.primitiveCount();
+        cout << "Instances: " << sceneGeometry.instances.size() << " of "
+             << sceneGeometry.prototypes.size() << " prototypes, placing "
+             << sceneGeometry.instancedPrimitives() << " primitives from " << unique << " stored" << endl;
+    }
+    cout << "BVH: " << sceneGeometry.bvh.refs.size() << " bounded, " << sceneGeometry.unbounded.size()
+         << " unbounded, " << sceneGeometry.bvh.nodes.size() << " nodes" << endl;
+    if (lightGrid.dims[0] > 0) {
+        int cells = lightGrid.dims[0] * lightGrid.dims[1] * lightGrid.dims[2];
+        cout << "Light grid: " << lightGrid.dims[0] << "x" << lightGrid.dims[1] << "x" << lightGrid.dims[2]
+             << ", " << fixed << setprecision(1) << (double)lightGrid.cellEntries() / cells
+             << " of " << lightGrid.bounded.size() << " bounded lights per cell, "
+             << lightGrid.everywhere.size() << " everywhere, "
+             << lightGrid.memoryBytes() / 1048576.0 << " MB" << defaultfloat << endl;
+    }
+}
+
+// optional "range R" after a light; without it the light has no falloff
+void readLightRange(SceneTokenizer& file, double& range) {
+    if (!file.accept("range")) return;
+    file >> range;
+    if (file && !(range > 0)) file.failAt("light range must be positive");
+}
+
+void readMaterial(SceneTokenizer& file, Material& m) {
+    file >> m.color[0] >> m.color[1] >> m.color[2];
+    file >> m.coEfficients[0] >> m.coEfficients[1] >> m.coEfficients[2] >> m.coEfficients[3];
+    file >> m.shine;
+}
+
+// Reads a sphere, triangle, general or mesh entry after its type word.
+// Objects come back in obj, meshes are appended to meshes; false for any
+// other type, with nothing read.
+bool readPrimitive(SceneTokenizer& file, string_view objectType, const char* path, Object*& obj,
+                   vector<pair<TriangleMesh, Material>>& meshes) {
+    obj = nullptr;
+    if (objectType == "sphere") {
+        double centerX, centerY, centerZ, radius;
+        file >> centerX >> centerY >> centerZ >> radius;
+        
+        Vector3D center(centerX, centerY, centerZ);
+        obj = new Sphere(center, radius);
+        
+    } 
+    else if (objectType == "triangle") {
+        double x1, y1, z1, x2, y2, z2, x3, y3, z3;
+        file >> x1 >> y1 >> z1 >> x2 >> y2 >> z2 >> x3 >> y3 >> z3;
+        
+        Vector3D a(x1, y1, z1);
+        Vector3D b(x2, y2, z2);
+        Vector3D c(x3, y3, z3);
+        obj = new Triangle(a, b, c);
+        
+    } 
+    else if (objectType == "general") {
+        double A, B, C, D, E, F, G, H, I, J;
+        file >> A >> B >> C >> D >> E >> F >> G >> H >> I >> J;
+
+        double refX, refY, refZ, length, width, height;
+        file >> refX >> refY >> refZ >> length >> width >> height;
+        
+        Vector3D reference(refX, refY, refZ);
+        obj = new GeneralQuadric(A, B, C, D, E, F, G, H, I, J, 
+                               reference, length, width, height);
+    }
+    else if (objectType == "mesh") {
+        // OBJ or PLY file, relative to the scene file
+        string_view meshFile;
+        file >> meshFile;
+        if (!file) return true;
+        filesystem::path meshPath(meshFile);
+        if (meshPath.is_relative()) meshPath = filesystem::path(path).parent_path() / meshPath;
+
+        TriangleMesh mesh;
+        string error;
+        if (!loadMesh(meshPath.string(), mesh, error)) {
+            file.failAt("could not load mesh: " + error);
+            return true;
+        }
+        // the scene file only names the mesh; its contents decide the pixels
+        if (!hashFile(meshPath.string().c_str(), sceneFingerprint)) {
+            file.failAt("could not read mesh " + meshPath.string());
+            return true;
+        }
+
+        Material m;
+        readMaterial(file, m);
+        meshes.push_back({move(mesh), m});
+    }
+    else {
+        return false;
+    }
+    
+    if (obj != nullptr) {
+        double r, g, b;
+        file >> r >> g >> b;
+        obj->setColor(r, g, b);
+        
+        double ambient, diffuse, specular, reflection;
+        file >> ambient >> diffuse >> specular >> reflection;
+        obj->setCoEfficients(ambient, diffuse, specular, reflection);
+        
+        int shine;
+        file >> shine;
+        obj->setShine(shine);
+    }
+    return true;
+}
+
+// a prototype as read, compiled into SceneGeometry::prototypes after parsing
+struct PendingPrototype {
+    string name;
+    vector<Object*> objects;
+    vector<pair<TriangleMesh, Material>> meshes;
+};
+
+// Loads a text scene, or a binary one written by 2005024_scene_convert.
+bool loadData(const char* path) {
+    sceneFingerprint = 0;
+    if (!hashFile(path, sceneFingerprint)) {
+        return false;
+    }
+    if (isBinaryScene(path)) {
+        cout << "Loading binary scene..." << "\n";
+        if (!loadBinaryScene(path)) return false;
+        buildLightIndex();
+        printSceneSummary();
+        return true;
+    }
+
+    SceneTokenizer file(path);
+    if (!file) {
+        cout << "Error: " << file.error() << endl;
+        return false;
+    }
+    
+    cout << "Loading scene..." << "\n";
+    file >> recursion_level;
+
+    file >> imageWidth;
+    imageHeight = imageWidth;
+
+    int numObjects = 0;
+    file >> numObjects;
+
+    // meshes, prototypes and instances go to sceneGeometry once it has been
+    // reset below
+    vector<pair<TriangleMesh, Material>> meshes;
+    vector<PendingPrototype> prototypes;
+    map<string, int, less<>> prototypeIndex;
+    vector<Instance> instances;
+    vector<Material> instanceMaterials;     // overrides, indexed by Instance::material until then
+
+    for (int i = 0; i < numObjects && file; i++) {
+        string_view objectType;
+        file >> objectType;
+        if (!file) break;
+
+        if (objectType == "prototype") {
+            // prototype <name> <count>, then count entries as above
+            PendingPrototype proto;
+            int count = 0;
+            file >> proto.name >> count;
+            if (file && prototypeIndex.count(proto.name)) {
+                file.failAt("prototype '" + proto.name + "' is already defined");
+            }
+            for (int k = 0; k < count && file; k++) {
+                string_view type;
+                file >> type;
+                Object* obj = nullptr;
+                if (file && !readPrimitive(file, type, path, obj, proto.meshes)) {
+                    file.failAt("a prototype holds spheres, triangles, generals and meshes, not '" +
+                                string(type) + "'");
+                }
+                if (obj != nullptr) proto.objects.push_back(obj);
+            }
+            prototypeIndex[proto.name] = prototypes.size();
+            prototypes.push_back(move(proto));
+        }
+        else if (objectType == "instance") {
+            // instance <name>, a 4x4 transform, then "keep" or a material
+            string_view name;
+            file >> name;
+            auto it = prototypeIndex.find(name);
+            if (file && it == prototypeIndex.end()) {
+                file.failAt("unknown prototype '" + string(name) + "'");
+                break;
+            }
+            Instance inst;
+            inst.prototype = file ? it->second : 0;
+            for (int row = 0; row < 4; row++) {
+                for (int col = 0; col < 4; col++) file >> inst.toWorld.m[row][col];
+            }
+            if (file && !inst.toWorld.affine()) {
+                file.failAt("instance transform must end in the row 0 0 0 1");
+            } else if (file && !inst.toWorld.inverse(inst.toLocal)) {
+                file.failAt("instance transform is singular");
+            }
+            inst.material = -1;
+            if (file && !file.accept("keep")) {
+                Material m;
+                readMaterial(file, m);
+                instanceMaterials.push_back(m);
+                inst.material = instanceMaterials.size() - 1;
+            }
+            instances.push_back(inst);
+        }
+        else {
+            Object* obj = nullptr;
+            if (!readPrimitive(file, objectType, path, obj, meshes)) {
+                file.failAt("unknown object type '" + string(objectType) + "'");
+            }
+            if (obj != nullptr) objects.push_back(obj);
+        }
+    }
+    
+    Object* floor = new Floor(1000, 20);
+    floor->setColor(1.0, 1.0, 1.0);
+    floor->setCoEfficients(0.3, 0.3, 0.2, 0.2);
+    floor->setShine(40);
+    objects.push_back(floor);
+
+    int numPointLights = 0;
+    file >> numPointLights;
+
+    for (int i = 0; i < numPointLights && file; i++) {
+        double posX, posY, posZ;
+        double colorR, colorG, colorB;
+        
+        file >> posX >> posY >> posZ;
+        file >> colorR >> colorG >> colorB;
+        
+        Vector3D position(posX, posY, posZ);
+        PointLight pl(position, colorR, colorG, colorB);
+        readLightRange(file, pl.range);
+        pointLights.push_back(pl);
+    }
+    
+    int numSpotLights = 0;
+    file >> numSpotLights;
+    
+    for (int i = 0; i < numSpotLights && file; i++) {
+        double posX, posY, posZ;
+        double colorR, colorG, colorB;
+        double dirX, dirY, dirZ;
+        double cutoffAngle;
+        
+        file >> posX >> posY >> posZ;
+        file >> colorR >> colorG >> colorB;
+        file >> dirX >> dirY >> dirZ;
+        file >> cutoffAngle;
+        
+        Vector3D position(posX, posY, posZ);
+        Vector3D direction(dirX, dirY, dirZ);
+        direction.normalize();
+
+        SpotLight sl(position, direction, cutoffAngle, colorR, colorG, colorB);
+        readLightRange(file, sl.range);
+        spotLights.push_back(sl);
+    }
+    
+    if (!file) {
+        cout << "Error: " << file.error() << endl;
+        for (PendingPrototype& proto : prototypes) {
+            for (Object* obj : proto.objects) delete obj;
+        }
+        return false;
+    }
+    file.close();
+
+    sceneGeometry.clear();
+    materials.clear();
+    for (Object* obj : objects) {
+        sceneGeometry.add(obj);
+    }
+    for (auto& mesh : meshes) {
+        sceneGeometry.add(move(mesh.first), mesh.second);
+    }
+    // prototype objects only live on in packed form
+    for (PendingPrototype& pending : prototypes) {
+        SceneGeometry proto;
+        for (Object* obj : pending.objects) {
+            proto.add(obj);
+            delete obj;
+        }
+        for (auto& mesh : pending.meshes) {
+            proto.add(move(mesh.first), mesh.second);
+        }
+        proto.build();
+        sceneGeometry.prototypes.push_back(move(proto));
+    }
+    for (Instance& inst : instances) {
+        if (inst.material >= 0) inst.material = materials.add(instanceMaterials[inst.material]);
+        sceneGeometry.add(inst);
+    }
+    sceneGeometry.build();
+    buildLightIndex();
+
+    printSceneSummary();
+    return true;
+}
+
+// Primary ray setup for one view. The view keeps the 80 degree vertical
+// field of view of the original 500 x 500 window and widens horizontally
+// for non-square images.
+struct ViewFrame {
+    Vector3D eye, topleft, r, u;
+    double du, dv;
+    double pixelSpread;     // angle one pixel subtends, the primary ray cone
+
+    ViewFrame(Camera camera, int width, int height) {
+        double windowHeight = 500.0;
+        double windowWidth = windowHeight * width / height;
+        double viewAngle = 80.0 * M_PI / 180.0;
+
+        double planeDistance = (windowHeight / 2.0) / tan(viewAngle / 2.0);
+
+        Vector3D l = camera.center - camera.eye;
+        l.normalize();
+
+        r = l.cross(camera.up);
+        r.normalize();
+
+        u = r.cross(l);
+        u.normalize();
+
+        topleft = camera.eye + l * planeDistance - r * (windowWidth / 2) + u * (windowHeight / 2);
+
+        du = windowWidth / width;
+        dv = windowHeight / height;
+
+        topleft = topleft + r * (0.5 * du) - u * (0.5 * dv);
+        eye = camera.eye;
+        pixelSpread = dv / planeDistance;
+    }
+
+    // ray through the centre of pixel (i, j)
+    Ray centerRay(int i, int j) const {
+        Vector3D curPixel = topleft + r * (i * du) - u * (j * dv);
+
+        Vector3D rayDir = curPixel - eye;
+        rayDir.normalize();
+        Ray ray(eye, rayDir);
+        ray.coneSpread = pixelSpread;
+        return ray;
+    }
+
+    // ray through (i + sx, j + sy) for sx, sy in [0, 1)
+    Ray sampleRay(int i, int j, double sx, double sy) const {
+        Vector3D curPixel = topleft + r * ((i + sx - 0.5) * du) - u * ((j + sy - 0.5) * dv);
+
+        Vector3D rayDir = curPixel - eye;
+        rayDir.normalize();
+        Ray ray(eye, rayDir);
+        ray.coneSpread = pixelSpread;
+        return ray;
+    }
+};
+
+// Final colours of a batch of camera rays, 3 doubles per ray (clamped to
+// [0, 1] unless hdrShading is on).
+// Neighbouring rays share SIMD packets, or the whole batch becomes one
+// wavefront in wavefront mode.
+void traceRays(vector<Ray>& rays, vector<double>& colors) {
+    STAT_ADD(STAT_CAMERA_RAYS, rays.size());
+    colors.assign(3 * rays.size(), 0.0);
+    if (wavefrontMode) {
+        thread_local WavefrontTracer tracer;
+        tracer.trace(rays, colors);
+        return;
+    }
+
+    PacketIsa isa = activePacketIsa();
+    int packetSize = packetWidth(isa);
+    for (size_t i0 = 0; i0 < rays.size(); i0 += packetSize) {
+        int n = min((size_t)packetSize, rays.size() - i0);
+        PacketQuery packet;
+        for (int k = 0; k < n; k++) {
+            packet.add(&rays[i0 + k]);
+        }
+        closestHitPacket(sceneGeometry, packet, isa);
+
+        for (int k = 0; k < n; k++) {
+            HitRecord hit;
+            double* finalColor = &colors[3 * (i0 + k)];
+            if (packet.finishHit(sceneGeometry, k, hit)) {
+                computePhongLighting(hit, finalColor, &rays[i0 + k], 1);
+            }
+            if (!hdrShading) {
+                for (int c = 0; c < 3; c++) {
+                    finalColor[c] = max(0.0, min(1.0, finalColor[c]));
+                }
+            }
+        }
+    }
+}
+
+// Adaptive anti-aliasing. Every pixel starts with aaBaseSamples stratified
+// samples (one jittered sample per cell of a square grid). Refinement splits
+// every cell of a pixel into 2 x 2 sub-cells: the sub-cell that already holds
+// the cell's sample keeps it and the other three get new ones, so refined
+// pixels stay stratified and no sample is wasted. A pixel is refined while
+// the standard error of its mean (worst channel) exceeds aaThreshold, and on
+// the first round also when a channel differs from one of its 8 neighbours by
+// more than aaThreshold; refinement stops at aaMaxSamples.
+int aaBaseSamples = 1;
+int aaMaxSamples = 1;       // 1 = a single ray through each pixel centre
+double aaThreshold = 0.05;
+
+struct SamplingStats {
+    int pixels;
+    int refinedPixels;
+    long long samples;
+};
+SamplingStats lastSamplingStats;
+
+// both counts must be squares whose sides differ by a power of two
+bool setAntialiasing(int baseSamples, int maxSamples) {
+    int m = (int)round(sqrt((double)baseSamples));
+    int n = (int)round(sqrt((double)maxSamples));
+    if (m < 1 || n < m || m * m != baseSamples || n * n != maxSamples || n % m != 0) {
+        return false;
+    }
+    int ratio = n / m;
+    if ((ratio & (ratio - 1)) != 0) {
+        return false;
+    }
+    aaBaseSamples = baseSamples;
+    aaMaxSamples = maxSamples;
+    return true;
+}
+
+// well-mixed 32-bit hash of a pixel and sample index (deterministic jitter)
+uint32_t sampleHash(uint32_t x, uint32_t y, uint32_t k) {
+    uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ k * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// Sample positions of the refinement hierarchy of pixel (i, j). Level 0 is
+// the base grid of side base; each level doubles the side.
+struct PixelSampler {
+    int i, j, base;
+
+    // position in [0, 1)^2 of the sample held by cell (cx, cy) of level
+    // level, and whether it was inherited from the parent cell
+    void position(int level, int cx, int cy, double& x, double& y, bool& inherited) const {
+        int side = base << level;
+        if (level > 0) {
+            double px, py;
+            bool unused;
+            position(level - 1, cx / 2, cy / 2, px, py, unused);
+            if ((int)(px * side) == cx && (int)(py * side) == cy) {
+                x = px;
+                y = py;
+                inherited = true;
+                return;
+            }
+        }
+        uint32_t h = sampleHash(i, j, (level << 24) | (cy * side + cx));
+        x = (cx + (h & 0xFFFF) / 65536.0) / side;
+        y = (cy + (h >> 16) / 65536.0) / side;
+        inherited = false;
+    }
+
+    // appends the rays that are new at level
+    void newRays(const ViewFrame& view, int level, vector<Ray>& rays) const {
+        int side = base << level;
+        for (int cy = 0; cy < side; cy++) {
+            for (int cx = 0; cx < side; cx++) {
+                double x, y;
+                bool inherited;
+                position(level, cx, cy, x, y, inherited);
+                if (!inherited) rays.push_back(view.sampleRay(i, j, x, y));
+            }
+        }
+    }
+};
+
+// fb holds image rows y0 .. y0 + fb.height - 1; neighbour contrast only looks
+// at rows inside it
+void renderAdaptive(const ViewFrame& view, int y0, Framebuffer& fb) {
+    const int width = fb.width, height = fb.height;
+    int base = (int)round(sqrt((double)aaBaseSamples));
+    int levels = 0;
+    while ((base << levels) * (base << levels) < aaMaxSamples) levels++;
+    int tileSize = wavefrontMode ? wavefrontTileSize : renderTileSize;
+
+    size_t pixels = (size_t)width * height;
+    vector<double> sum(3 * pixels, 0.0), sumSq(3 * pixels, 0.0);
+    vector<double> baseColor(3 * pixels);
+    vector<int> count(pixels, 0);
+    vector<char> active(pixels, 1);
+    atomic<long long> samples(0);
+    atomic<int> refined(0);
+
+    // traces the new samples of every pixel of tile that wants them at level
+    auto samplePass = [&](const Tile& tile, int level, const function<bool(int, int)>& wants) {
+        vector<Ray> rays;
+        vector<int> owner;
+        vector<double> colors;
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                int p = j * width + i;
+                if (!active[p]) continue;
+                if (!wants(i, j)) {
+                    active[p] = 0;
+                    continue;
+                }
+                size_t first = rays.size();
+                PixelSampler{i, j + y0, base}.newRays(view, level, rays);
+                owner.insert(owner.end(), rays.size() - first, p);
+            }
+        }
+        traceRays(rays, colors);
+
+        for (size_t r = 0; r < rays.size(); r++) {
+            int p = owner[r];
+            for (int c = 0; c < 3; c++) {
+                double v = colors[3 * r + c];
+                sum[3 * p + c] += v;
+                sumSq[3 * p + c] += v * v;
+            }
+            count[p]++;
+        }
+        samples += rays.size();
+    };
+
+    // largest standard error of the pixel mean over the three channels
+    auto standardError = [&](int p) {
+        double worst = 0.0;
+        for (int c = 0; c < 3; c++) {
+            double mean = sum[3 * p + c] / count[p];
+            double variance = max(0.0, sumSq[3 * p + c] / count[p] - mean * mean);
+            worst = max(worst, variance / count[p]);
+        }
+        return sqrt(worst);
+    };
+
+    renderTiles(width, height, tileSize, renderThreads, [&](const Tile& tile) {
+        samplePass(tile, 0, [](int, int) { return true; });
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                int p = j * width + i;
+                for (int c = 0; c < 3; c++) baseColor[3 * p + c] = sum[3 * p + c] / count[p];
+            }
+        }
+    });
+
+    // every pass only writes its own tile, and neighbours are read from baseColor,
+    // which is complete before the first refinement starts
+    for (int level = 1; level <= levels; level++) {
+        renderTiles(width, height, tileSize, renderThreads, [&](const Tile& tile) {
+            samplePass(tile, level, [&](int i, int j) {
+                int p = j * width + i;
+                bool refine = standardError(p) > aaThreshold;
+                for (int y = max(0, j - 1); level == 1 && !refine && y <= min(height - 1, j + 1); y++) {
+                    for (int x = max(0, i - 1); !refine && x <= min(width - 1, i + 1); x++) {
+                        int q = y * width + x;
+                        for (int c = 0; c < 3; c++) {
+                            if (fabs(baseColor[3 * q + c] - baseColor[3 * p + c]) > aaThreshold) refine = true;
+                        }
+                    }
+                }
+                if (refine && level == 1) refined++;
+                return refine;
+            });
+        });
+    }
+
+    renderTiles(width, height, tileSize, renderThreads, [&](const Tile& tile) {
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                int p = j * width + i;
+                double mean[3];
+                for (int c = 0; c < 3; c++) {
+                    mean[c] = sum[3 * p + c] / count[p];
+                }
+                fb.add(i, j, mean);
+            }
+        }
+    });
+
+    lastSamplingStats.pixels += pixels;
+    lastSamplingStats.refinedPixels += refined.load();
+    lastSamplingStats.samples += samples.load();
+}
+
+// Adds one pass of the scene as seen from camera to fb; every pixel gains
+// weight 1. fb holds the band of rows y0 .. y0 + fb.height - 1 of a width x
+// height image (the whole image by default). lastSamplingStats restarts with
+// the band at y0 = 0 of the first pass and collects the rest.
+void renderFrame(Camera camera, int width, int height, Framebuffer& fb, int y0 = 0) {
+    ViewFrame view(camera, width, height);
+    if (y0 == 0 && lightPass == 0) lastSamplingStats = {0, 0, 0};
+
+    if (aaMaxSamples > 1) {
+        renderAdaptive(view, y0, fb);
+        return;
+    }
+
+    // one batch per tile: packets of neighbouring pixels, or one wavefront
+    int tileSize = wavefrontMode ? wavefrontTileSize : renderTileSize;
+    renderTiles(fb.width, fb.height, tileSize, renderThreads, [&](const Tile& tile) {
+        vector<Ray> rays;
+        vector<double> colors;
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                rays.push_back(view.centerRay(i, j + y0));
+            }
+        }
+        traceRays(rays, colors);
+
+        int k = 0;
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++, k++) {
+                fb.add(i, j, &colors[3 * k]);
+            }
+        }
+    });
+    lastSamplingStats.pixels += fb.width * fb.height;
+    lastSamplingStats.samples += (long long)fb.width * fb.height;
+}
+
+int lightPassCount() {
+    return lightSamples > 0 ? max(1, lightPasses) : 1;
+}
+
+// renderFrame once per light pass (once unless many-light mode asks for
+// more), from firstPass on when fb already holds the earlier ones; passDone
+// hears the number of passes in fb after each
+void renderPasses(Camera camera, int width, int height, Framebuffer& fb, int y0 = 0, int firstPass = 0,
+                  const function<void(int)>& passDone = nullptr) {
+    int passes = lightPassCount();
+    for (lightPass = firstPass; lightPass < passes; lightPass++) {
+        renderFrame(camera, width, height, fb, y0);
+        if (passDone) passDone(lightPass + 1);
+    }
+    lightPass = 0;
+}
+
+// Renders the scene as seen from camera into image (width x height pixels)
+// and resolves it with resolveSettings.
+void renderImage(Camera camera, int width, int height, bitmap_image& image) {
+    Framebuffer fb;
+    fb.resize(width, height);
+    renderPasses(camera, width, height, fb);
+    resolveFramebuffer(fb, resolveSettings, image);
+}
+
+int streamBandRows = 64;
+
+// Hash of everything besides the view that decides the pixels: the scene
+// file, the mesh files it loads, whether the floor is textured (the
+// viewer's 't' toggles it) and with what, the size of the compiled
+// geometry, the precision and the shading, sampling and resolve settings.
+// Threads, ISA and the wavefront tracer change no pixel and are left out.
+uint64_t renderFingerprint() {
+    uint64_t h = hashValue(sceneFingerprint, useTexture);
+    h = hashValue(h, useTexture ? textureFingerprint : 0);
+    h = hashValue(h, sceneGeometry.primitiveCount());
+    h = hashValue(h, sceneGeometry.bvh.nodes.size());
+    h = hashValue(h, sizeof(Real));
+    h = hashValue(h, hdrShading);
+    h = hashValue(h, textureFilter);
+    h = hashValue(h, lightSamples);
+    h = hashValue(h, lightPassCount());
+    h = hashValue(h, aaBaseSamples);
+    h = hashValue(h, aaMaxSamples);
+    h = hashValue(h, aaThreshold);
+    h = hashValue(h, resolveSettings.exposure);
+    h = hashValue(h, resolveSettings.toneMap);
+    return hashValue(h, resolveSettings.srgb);
+}
+
+// renderFingerprint of one view, cut into bands of bandRows rows
+uint64_t viewFingerprint(const Camera& camera, int width, int height, int bandRows) {
+    uint64_t h = renderFingerprint();
+    for (const Vector3D* v : {&camera.eye, &camera.center, &camera.up}) {
+        double xyz[3] = {v->x, v->y, v->z};
+        h = hashValue(h, xyz);
+    }
+    int size[3] = {width, height, bandRows};
+    return hashValue(h, size);
+}
+
+// Renders straight into a BMP file streamBandRows rows at a time, so memory
+// is bounded by the band, not the image. The file matches what renderImage
+// and bitmap_image::save_image produce. Finished bands and the passes of
+// the band in progress are checkpointed (see 2005024_checkpoint.h), and
+// with resumeRenders a killed render picks up where it stopped.
+bool renderToFile(Camera camera, int width, int height, const string& filename) {
+    int bandRows = max(1, min(streamBandRows, height));
+    int bands = (height + bandRows - 1) / bandRows;
+    BmpStreamWriter writer;
+    RenderJournal journal;
+    if (!journal.open(writer, filename, width, height, bands, viewFingerprint(camera, width, height, bandRows))) {
+        return false;
+    }
+
+    int passes = lightPassCount();
+    Framebuffer fb;
+    vector<unsigned char> band(bandRows * writer.rowSize, 0);
+    for (int y0 = 0, b = 0; y0 < height; y0 += bandRows, b++) {
+        if (journal.done[b]) continue;
+        STAT_TIMER(STAT_TIMER_BAND, 0, y0);
+        int rows = min(bandRows, height - y0);
+        fb.resize(width, rows);
+        int firstPass = passes > 1 ? journal.loadPartial(b, fb) : 0;
+        renderPasses(camera, width, height, fb, y0, firstPass, [&](int done) {
+            journal.passDone(b, done, passes, fb, writer);
+        });
+        {
+            STAT_TIMER(STAT_TIMER_RESOLVE, 0, y0);
+            // the bottom row of the band comes first in the file
+            unsigned char* last = band.data() + (rows - 1) * writer.rowSize;
+            resolveFramebuffer(fb, resolveSettings, last, -(ptrdiff_t)writer.rowSize);
+        }
+        STAT_TIMER(STAT_TIMER_WRITE, 0, y0);
+        if (!writer.writeBand(y0, rows, band.data())) return false;
+        journal.bandDone(b, writer);
+    }
+    if (!writer.close()) {
+        cerr << "Error: Could not write " << filename << endl;
+        return false;
+    }
+    journal.finish();
+    return true;
+}
+
+// one line summary of lastSamplingStats
+string samplingReport() {
+    const SamplingStats& st = lastSamplingStats;
+    ostringstream out;
+    out << fixed << setprecision(2) << "Samples: " << (double)st.samples / st.pixels
+        << " per pixel (" << aaBaseSamples << " base, " << aaMaxSamples << " max), "
+        << 100.0 * st.refinedPixels / st.pixels << "% of pixels refined";
+    return out.str();
+}
+
+#ifdef RT_STATS
+// the settings a stats report records next to the counters
+StatsCapture describeCapture(const string& image, int width, int height, double seconds) {
+    StatsCapture capture;
+    capture.image = image;
+    capture.width = width;
+    capture.height = height;
+    capture.threads = renderThreads > 0 ? renderThreads : defaultThreadCount();
+    capture.isa = packetIsaName(activePacketIsa());
+    capture.wavefront = wavefrontMode;
+    capture.precision = sizeof(Real) == sizeof(float) ? "float" : "double";
+    capture.lightSamples = lightSamples;
+    capture.passes = lightPasses;
+    capture.seconds = seconds;
+    return capture;
+}
+#endif
+
+// releases everything loadData and loadFloorTexture allocated
+void freeScene() {
+    if (textureData) {
+        stbi_image_free(textureData);
+        textureData = nullptr;
+    }
+    floorTexture.clear();
+    textureFingerprint = 0;
+    for (Object* obj : objects) {
+        delete obj;
+    }
+    objects.clear();
+    pointLights.clear();
+    spotLights.clear();
+    sceneGeometry.clear();
+    materials.clear();
+}
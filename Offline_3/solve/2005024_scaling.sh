@@ -0,0 +1,200 @@
+#!/usr/bin/bash
+
+# End-to-end scaling benchmark: generates stress scenes with
+# 2005024_scene_gen and renders them with the headless renderer, sweeping
+# one parameter at a time while the others stay at their base values:
+#
+#   spheres    N, with M = K = 0
+#   triangles  M, with N = K = 0
+#   quadrics   K, with N = M = 0
+#   lights     L point lights, on the base sphere scene
+#   threads    render threads, on the base sphere scene
+#   size       image size, on the base sphere scene
+#
+# Every sweep runs for each layout (uniform, clustered, occluder).
+#
+# Usage: ./2005024_scaling.sh [results dir] [headless options...]
+# (default dir: scaling_results; relative paths start in this directory)
+#
+# The sweeps can be changed through the environment; the defaults are:
+#   LAYOUTS="uniform clustered occluder"
+#   SPHERES="1000 4000 16000 64000"     TRIANGLES="1000 4000 16000 64000"
+#   QUADRICS="500 2000 8000"            LIGHTS="1 4 16 64"
+#   THREADS="1 2 4 ... nproc"           SIZES="256 512 1024"
+#   BASE_SPHERES=4000  BASE_LIGHTS=4  BASE_SIZE=512  BASE_THREADS=nproc
+#
+# Results go to <dir>/results.tsv, one render per line:
+#   layout  sweep  spheres  triangles  quadrics  lights  size  threads  load_s  render_s
+# where load_s is the process time outside the render (parse and BVH
+# build). Each sweep is also pivoted into <dir>/<sweep>.tsv, render time
+# per layout, and printed. With gnuplot installed, <dir>/<sweep>.png plots
+# it (log-log for the counts, speedup over the fewest threads for the
+# thread sweep); <dir>/plot.gp can be rerun by hand later.
+
+cd "$(dirname "$0")" || exit 1
+
+dir="${1:-scaling_results}"
+shift
+mkdir -p "$dir" || exit 1
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cores=$(nproc)
+default_threads=""
+for ((t = 1; t < cores; t *= 2)); do
+    default_threads="$default_threads $t"
+done
+default_threads="$default_threads $cores"
+
+LAYOUTS="${LAYOUTS:-uniform clustered occluder}"
+SPHERES="${SPHERES:-1000 4000 16000 64000}"
+TRIANGLES="${TRIANGLES:-1000 4000 16000 64000}"
+QUADRICS="${QUADRICS:-500 2000 8000}"
+LIGHTS="${LIGHTS:-1 4 16 64}"
+THREADS="${THREADS:-$default_threads}"
+SIZES="${SIZES:-256 512 1024}"
+BASE_SPHERES="${BASE_SPHERES:-4000}"
+BASE_LIGHTS="${BASE_LIGHTS:-4}"
+BASE_SIZE="${BASE_SIZE:-512}"
+BASE_THREADS="${BASE_THREADS:-$cores}"
+
+for program in 2005024_scene_gen 2005024_headless; do
+    g++ "$program.cpp" -o "$work/$program" -O2 -pthread
+    if [ $? -ne 0 ]; then
+        echo "Compilation of $program failed."
+        exit 1
+    fi
+done
+
+results="$dir/results.tsv"
+echo -e "layout\tsweep\tspheres\ttriangles\tquadrics\tlights\tsize\tthreads\tload_s\trender_s" > "$results"
+
+now() {
+    date +%s.%N
+}
+
+# run <layout> <sweep> <spheres> <triangles> <quadrics> <lights> <size> <threads>
+run() {
+    local layout=$1 sweep=$2 n=$3 m=$4 k=$5 l=$6 size=$7 threads=$8
+    shift 8
+    local scene="$work/${layout}_${n}_${m}_${k}_${l}.txt"
+    if [ ! -f "$scene" ]; then
+        "$work/2005024_scene_gen" "$scene" --layout "$layout" -n "$n" -m "$m" -k "$k" -l "$l" \
+            -p "$work/$layout.pose" >/dev/null || exit 1
+    fi
+
+    local start end seconds
+    start=$(now)
+    seconds=$("$work/2005024_headless" "$scene" -p "$work/$layout.pose" -s "${size}x${size}" -j "$threads" \
+        -o "$work/out_%d.bmp" "$@" 2>&1 >/dev/null | grep "^View 1/" | sed 's/.*: \(.*\) s$/\1/')
+    end=$(now)
+    if [ -z "$seconds" ]; then
+        echo "Rendering $scene failed."
+        exit 1
+    fi
+    local load
+    load=$(awk -v a="$start" -v b="$end" -v r="$seconds" 'BEGIN { printf "%.4f", b - a - r }')
+    echo -e "$layout\t$sweep\t$n\t$m\t$k\t$l\t$size\t$threads\t$load\t$seconds" >> "$results"
+    echo "$layout $sweep: N=$n M=$m K=$k L=$l ${size}x$size, $threads thread(s): load $load s, render $seconds s"
+}
+
+for layout in $LAYOUTS; do
+    for n in $SPHERES; do
+        run "$layout" spheres "$n" 0 0 "$BASE_LIGHTS" "$BASE_SIZE" "$BASE_THREADS" "$@"
+    done
+    for m in $TRIANGLES; do
+        run "$layout" triangles 0 "$m" 0 "$BASE_LIGHTS" "$BASE_SIZE" "$BASE_THREADS" "$@"
+    done
+    for k in $QUADRICS; do
+        run "$layout" quadrics 0 0 "$k" "$BASE_LIGHTS" "$BASE_SIZE" "$BASE_THREADS" "$@"
+    done
+    for l in $LIGHTS; do
+        run "$layout" lights "$BASE_SPHERES" 0 0 "$l" "$BASE_SIZE" "$BASE_THREADS" "$@"
+    done
+    for t in $THREADS; do
+        run "$layout" threads "$BASE_SPHERES" 0 0 "$BASE_LIGHTS" "$BASE_SIZE" "$t" "$@"
+    done
+    for s in $SIZES; do
+        run "$layout" size "$BASE_SPHERES" 0 0 "$BASE_LIGHTS" "$s" "$BASE_THREADS" "$@"
+    done
+done
+
+# a TSV file as aligned columns
+show() {
+    awk -F'\t' '{ for (i = 1; i <= NF; i++) printf "%-12s", $i; print "" }' "$1"
+}
+
+# pivot one sweep into rows of its parameter and a render time column per layout
+declare -A column_of=([spheres]=3 [triangles]=4 [quadrics]=5 [lights]=6 [size]=7 [threads]=8)
+sweeps="spheres triangles quadrics lights threads size"
+for sweep in $sweeps; do
+    awk -F'\t' -v sweep="$sweep" -v col="${column_of[$sweep]}" -v layouts="$LAYOUTS" '
+        BEGIN { n = split(layouts, names, " ") }
+        NR > 1 && $2 == sweep {
+            if (!($col in seen)) { seen[$col] = 1; order[++rows] = $col }
+            time[$col, $1] = $10
+        }
+        END {
+            if (rows == 0) exit
+            line = sweep
+            for (i = 1; i <= n; i++) line = line "\t" names[i]
+            print line
+            for (r = 1; r <= rows; r++) {
+                line = order[r]
+                for (i = 1; i <= n; i++) line = line "\t" ((order[r], names[i]) in time ? time[order[r], names[i]] : "-")
+                print line
+            }
+        }' "$results" > "$dir/$sweep.tsv"
+    if [ ! -s "$dir/$sweep.tsv" ]; then
+        rm -f "$dir/$sweep.tsv"
+        continue
+    fi
+    echo
+    echo "Render seconds by $sweep:"
+    show "$dir/$sweep.tsv"
+done
+
+# speedup over the fewest threads, per layout
+if [ -f "$dir/threads.tsv" ]; then
+    awk -F'\t' -v OFS='\t' '
+        NR == 1 { print; next }
+        NR == 2 { for (i = 2; i <= NF; i++) first[i] = $i }
+        { line = $1
+          for (i = 2; i <= NF; i++) line = line OFS ($i + 0 > 0 ? sprintf("%.2f", first[i] / $i) : "-")
+          print line }' "$dir/threads.tsv" > "$dir/speedup.tsv"
+    echo
+    echo "Speedup over $(sed -n 2p "$dir/threads.tsv" | cut -f1) thread(s):"
+    show "$dir/speedup.tsv"
+fi
+
+# plots; the thread sweep shows the speedup
+{
+    echo "set terminal pngcairo size 800,560"
+    echo "set key top left"
+    echo "set grid"
+    echo "set datafile separator tab"
+    echo "set datafile missing \"-\""
+    for sweep in $sweeps; do
+        [ -f "$dir/$sweep.tsv" ] || continue
+        count=$(head -1 "$dir/$sweep.tsv" | awk -F'\t' '{ print NF }')
+        echo "set output '$dir/$sweep.png'"
+        echo "set xlabel '$sweep'"
+        if [ "$sweep" = threads ]; then
+            echo "unset logscale"
+            echo "set ylabel 'speedup'"
+            echo "plot for [c=2:$count] '$dir/speedup.tsv' using 1:c with linespoints title columnheader(c), x with lines dt 2 title 'linear'"
+        else
+            echo "set logscale xy"
+            echo "set ylabel 'render seconds'"
+            echo "plot for [c=2:$count] '$dir/$sweep.tsv' using 1:c with linespoints title columnheader(c)"
+        fi
+    done
+} > "$dir/plot.gp"
+
+echo
+if command -v gnuplot >/dev/null; then
+    gnuplot "$dir/plot.gp" && echo "Plots written to $dir/*.png"
+else
+    echo "gnuplot not found; run 'gnuplot $dir/plot.gp' where it is to draw the plots."
+fi
+echo "Results: $results"
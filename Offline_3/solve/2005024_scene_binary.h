@@ -0,0 +1,374 @@
+#pragma once
+#include "2005024_geometry.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary scene files: the compiled scene (packed primitive arrays, their
+// materials, the lights, meshes and the finished BVHs) stored as raw sections, so
+// loading is a memory map plus one bulk copy per array, with no parsing,
+// no per-primitive allocation and no BVH build. Write them with
+// 2005024_scene_convert; loadData picks the format from the magic.
+//
+// Layout: SceneFileHeader, then every section at a 64-byte aligned offset.
+// Sections hold the in-memory structs as they are, so a file only loads on
+// a build with the same struct layout and byte order; the header records
+// both and the loader refuses anything else.
+
+extern int imageWidth, imageHeight;
+
+enum SceneSection {
+    SECTION_MATERIALS,
+    SECTION_SPHERES,
+    SECTION_SPHERE_MATERIALS,
+    SECTION_TRIANGLES,
+    SECTION_TRIANGLE_NORMALS,
+    SECTION_TRIANGLE_MATERIALS,
+    SECTION_QUADRICS,
+    SECTION_QUADRIC_MATERIALS,
+    SECTION_POINT_LIGHTS,
+    SECTION_SPOT_LIGHTS,
+    SECTION_BVH_NODES,
+    SECTION_BVH_REFS,
+    SECTION_UNBOUNDED,
+    SECTION_MESHES,
+    SECTION_MESH_VERTICES,
+    SECTION_MESH_INDICES,
+    SECTION_MESH_NODES,
+    SECTION_COUNT
+};
+
+// one TriangleMesh: its slices of the three concatenated mesh sections
+struct SceneFileMesh {
+    uint64_t firstVertex, vertexCount;
+    uint64_t firstIndex, indexCount;
+    uint64_t firstNode, nodeCount;
+    int32_t material;
+    uint32_t reserved;
+};
+
+struct SceneFileSection {
+    uint64_t offset;
+    uint64_t count;
+    uint32_t elementSize;       // sizeof the stored struct, checked on load
+    uint32_t reserved;
+};
+
+struct SceneFileHeader {
+    static const uint32_t VERSION = 4;     // 2: meshes, 3: light ranges, 4: quadric shapes
+    static const uint32_t ORDER_MARK = 0x01020304;
+
+    char magic[8];              // "RTSCENE" and a NUL
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t headerSize;
+    int32_t recursionLevel;
+    int32_t imageWidth, imageHeight;
+    // the checkerboard floor every scene gets; it has no packed form and is
+    // rebuilt as the only PRIM_OBJECT (index 0)
+    double floorWidth, floorTileWidth;
+    int32_t floorMaterial;
+    uint32_t sectionCount;
+    SceneFileSection sections[SECTION_COUNT];
+};
+
+const char SCENE_FILE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+
+bool isBinaryScene(const char* path) {
+    char magic[8];
+    ifstream file(path, ios::binary);
+    return file.read(magic, 8) && memcmp(magic, SCENE_FILE_MAGIC, 8) == 0;
+}
+
+// Writes the compiled global scene to path. Only the floor may be left as a
+// PRIM_OBJECT, which holds for everything loadData reads from text; scenes
+// with instances have no binary form yet.
+bool saveBinaryScene(const char* path) {
+    const SceneGeometry& geo = sceneGeometry;
+    Floor* floor = geo.objects.size() == 1 ? dynamic_cast<Floor*>(geo.objects[0]) : nullptr;
+    if (floor == nullptr) {
+        cout << "Error: only scenes whose one unpacked object is the floor can be saved" << endl;
+        return false;
+    }
+    if (!geo.instances.empty()) {
+        cout << "Error: scenes with instances cannot be saved in the binary format" << endl;
+        return false;
+    }
+
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_FILE_MAGIC, 8);
+    header.version = SceneFileHeader::VERSION;
+    header.byteOrder = SceneFileHeader::ORDER_MARK;
+    header.headerSize = sizeof(SceneFileHeader);
+    header.recursionLevel = recursion_level;
+    header.imageWidth = imageWidth;
+    header.imageHeight = imageHeight;
+    header.floorWidth = floor->width;
+    header.floorTileWidth = floor->tileWidth;
+    header.floorMaterial = floor->materialId;
+    header.sectionCount = SECTION_COUNT;
+
+    // a section is written from one or more arrays of the same element type
+    struct Source {
+        vector<pair<const void*, size_t>> chunks;
+        size_t count, size;
+    };
+    auto source = [](const auto& v) {
+        return Source{{{v.data(), v.size()}}, v.size(), sizeof(v[0])};
+    };
+    auto meshSource = [&](auto member) {
+        typedef typename remove_reference<decltype(geo.meshes[0].*member)>::type Array;
+        Source src{{}, 0, sizeof(typename Array::value_type)};
+        for (const TriangleMesh& mesh : geo.meshes) {
+            const Array& v = mesh.*member;
+            src.chunks.push_back({v.data(), v.size()});
+            src.count += v.size();
+        }
+        return src;
+    };
+
+    vector<SceneFileMesh> meshRecords;
+    uint64_t vertexCount = 0, indexCount = 0, nodeCount = 0;
+    for (const TriangleMesh& mesh : geo.meshes) {
+        meshRecords.push_back({vertexCount, mesh.vertices.size(), indexCount, mesh.indices.size(),
+                               nodeCount, mesh.nodes.size(), mesh.material, 0});
+        vertexCount += mesh.vertices.size();
+        indexCount += mesh.indices.size();
+        nodeCount += mesh.nodes.size();
+    }
+
+    Source sources[SECTION_COUNT] = {
+        source(materials),
+        source(geo.spheres), source(geo.sphereMaterial),
+        source(geo.triangles), source(geo.triangleNormals), source(geo.triangleMaterial),
+        source(geo.quadrics), source(geo.quadricMaterial),
+        source(pointLights), source(spotLights),
+        source(geo.bvh.nodes), source(geo.bvh.refs), source(geo.unbounded),
+        source(meshRecords), meshSource(&TriangleMesh::vertices),
+        meshSource(&TriangleMesh::indices), meshSource(&TriangleMesh::nodes),
+    };
+
+    uint64_t offset = sizeof(SceneFileHeader);
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        offset = (offset + 63) & ~(uint64_t)63;
+        header.sections[s] = {offset, sources[s].count, (uint32_t)sources[s].size, 0};
+        offset += sources[s].count * sources[s].size;
+    }
+
+    ofstream file(path, ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cout << "Error: Could not create " << path << endl;
+        return false;
+    }
+    file.write((const char*)&header, sizeof(header));
+    const char zeros[64] = {};
+    uint64_t written = sizeof(header);
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        file.write(zeros, header.sections[s].offset - written);
+        for (auto& chunk : sources[s].chunks) {
+            file.write((const char*)chunk.first, chunk.second * sources[s].size);
+        }
+        written = header.sections[s].offset + sources[s].count * sources[s].size;
+    }
+    if (!file) {
+        cout << "Error: Could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Replaces the global scene with the one in path. Nothing is touched unless
+// the whole file validates.
+bool loadBinaryScene(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        cout << "Error: Could not open " << path << " file" << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SceneFileHeader)) {
+        close(fd);
+        cout << "Error: " << path << " is not a scene file" << endl;
+        return false;
+    }
+    size_t fileSize = st.st_size;
+    void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        cout << "Error: Could not map " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+    madvise(mapping, fileSize, MADV_SEQUENTIAL);
+    const char* base = (const char*)mapping;
+
+    auto fail = [&](const string& why) {
+        munmap(mapping, fileSize);
+        cout << "Error: " << path << ": " << why << endl;
+        return false;
+    };
+
+    SceneFileHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, SCENE_FILE_MAGIC, 8) != 0) return fail("not a scene file");
+    if (header.byteOrder != SceneFileHeader::ORDER_MARK) return fail("written with another byte order");
+    if (header.version != SceneFileHeader::VERSION) {
+        return fail("unsupported version " + to_string(header.version) +
+                    " (expected " + to_string(SceneFileHeader::VERSION) + ")");
+    }
+    if (header.headerSize != sizeof(SceneFileHeader) || header.sectionCount != SECTION_COUNT) {
+        return fail("header layout differs from this build");
+    }
+
+    const size_t elementSizes[SECTION_COUNT] = {
+        sizeof(Material),
+        sizeof(PackedSphere), sizeof(uint32_t),
+        sizeof(PackedTriangle), sizeof(Vector3D), sizeof(uint32_t),
+        sizeof(PackedQuadric), sizeof(uint32_t),
+        sizeof(PointLight), sizeof(SpotLight),
+        sizeof(BVHNode), sizeof(uint32_t), sizeof(PrimRef),
+        sizeof(SceneFileMesh), sizeof(MeshVertex), sizeof(uint32_t), sizeof(MeshNode),
+    };
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        const SceneFileSection& sec = header.sections[s];
+        if (sec.elementSize != elementSizes[s]) {
+            return fail("section " + to_string(s) + " layout differs from this build");
+        }
+        if (sec.offset % 64 != 0 || sec.offset > fileSize ||
+            sec.count > (fileSize - sec.offset) / sec.elementSize) {
+            return fail("section " + to_string(s) + " is truncated");
+        }
+    }
+
+    const SceneFileSection* sec = header.sections;
+    uint64_t numMaterials = sec[SECTION_MATERIALS].count;
+    if (header.floorMaterial < 0 || (uint64_t)header.floorMaterial >= numMaterials) {
+        return fail("bad floor material");
+    }
+    if (sec[SECTION_SPHERE_MATERIALS].count != sec[SECTION_SPHERES].count ||
+        sec[SECTION_TRIANGLE_NORMALS].count != sec[SECTION_TRIANGLES].count ||
+        sec[SECTION_TRIANGLE_MATERIALS].count != sec[SECTION_TRIANGLES].count ||
+        sec[SECTION_QUADRIC_MATERIALS].count != sec[SECTION_QUADRICS].count) {
+        return fail("primitive and material counts differ");
+    }
+
+    // one bulk copy per section; the mapping is dropped afterwards
+    auto copySection = [&](int s, auto& v) {
+        typedef typename remove_reference<decltype(v[0])>::type T;
+        const T* first = (const T*)(base + sec[s].offset);
+        v.assign(first, first + sec[s].count);
+    };
+
+    vector<Material> newMaterials;
+    copySection(SECTION_MATERIALS, newMaterials);
+
+    SceneGeometry geo;
+    copySection(SECTION_SPHERES, geo.spheres);
+    copySection(SECTION_SPHERE_MATERIALS, geo.sphereMaterial);
+    copySection(SECTION_TRIANGLES, geo.triangles);
+    copySection(SECTION_TRIANGLE_NORMALS, geo.triangleNormals);
+    copySection(SECTION_TRIANGLE_MATERIALS, geo.triangleMaterial);
+    copySection(SECTION_QUADRICS, geo.quadrics);
+    copySection(SECTION_QUADRIC_MATERIALS, geo.quadricMaterial);
+    // the stored shape picks array slots in the intersector; derive it
+    // again rather than trust the file
+    for (PackedQuadric& g : geo.quadrics) classifyQuadric(g);
+    copySection(SECTION_BVH_NODES, geo.bvh.nodes);
+    copySection(SECTION_BVH_REFS, geo.bvh.refs);
+    copySection(SECTION_UNBOUNDED, geo.unbounded);
+
+    // every mesh gets its own buffers, copied from its slice of the shared sections
+    vector<SceneFileMesh> meshRecords;
+    copySection(SECTION_MESHES, meshRecords);
+    geo.meshes.resize(meshRecords.size());
+    for (size_t m = 0; m < meshRecords.size(); m++) {
+        const SceneFileMesh& rec = meshRecords[m];
+        auto slice = [&](int s, uint64_t first, uint64_t count, auto& v) {
+            typedef typename remove_reference<decltype(v[0])>::type T;
+            if (first > sec[s].count || count > sec[s].count - first) return false;
+            const T* data = (const T*)(base + sec[s].offset) + first;
+            v.assign(data, data + count);
+            return true;
+        };
+        TriangleMesh& mesh = geo.meshes[m];
+        if (!slice(SECTION_MESH_VERTICES, rec.firstVertex, rec.vertexCount, mesh.vertices) ||
+            !slice(SECTION_MESH_INDICES, rec.firstIndex, rec.indexCount, mesh.indices) ||
+            !slice(SECTION_MESH_NODES, rec.firstNode, rec.nodeCount, mesh.nodes)) {
+            return fail("mesh " + to_string(m) + " lies outside its sections");
+        }
+        if (rec.material < 0 || (uint64_t)rec.material >= numMaterials || mesh.nodes.empty() ||
+            !mesh.valid()) {
+            return fail("bad mesh " + to_string(m));
+        }
+        mesh.material = rec.material;
+        mesh.name = string(path) + " mesh " + to_string(m);
+    }
+
+    // a corrupt index would be an out-of-bounds read in every render, so
+    // check them all once here
+    auto validRef = [&](PrimRef ref) {
+        uint32_t i = primIndex(ref);
+        switch (primType(ref)) {
+            case PRIM_SPHERE: return i < geo.spheres.size();
+            case PRIM_TRIANGLE: return i < geo.triangles.size();
+            case PRIM_QUADRIC: return i < geo.quadrics.size();
+            case PRIM_OBJECT: return i == 0;
+            case PRIM_MESH: return i < geo.meshes.size();
+            default: return false;
+        }
+    };
+    auto validMaterials = [&](const vector<uint32_t>& ids) {
+        for (uint32_t m : ids) if (m >= numMaterials) return false;
+        return true;
+    };
+    if (!validMaterials(geo.sphereMaterial) || !validMaterials(geo.triangleMaterial) ||
+        !validMaterials(geo.quadricMaterial)) {
+        return fail("material index out of range");
+    }
+    for (PrimRef ref : geo.bvh.refs) if (!validRef(ref)) return fail("bad BVH reference");
+    for (PrimRef ref : geo.unbounded) if (!validRef(ref)) return fail("bad unbounded reference");
+    // children come after their parent, and no path may outgrow the traversal stack
+    vector<int> depth(geo.bvh.nodes.size(), 0);
+    for (size_t n = 0; n < geo.bvh.nodes.size(); n++) {
+        const BVHNode& node = geo.bvh.nodes[n];
+        bool ok = node.count > 0
+            ? node.offset >= 0 && (size_t)node.offset + node.count <= geo.bvh.refs.size()
+            : node.offset > (int)n + 1 && (size_t)node.offset < geo.bvh.nodes.size() &&
+              depth[n] + 1 < BVH::STACK_SIZE;
+        if (!ok) return fail("bad BVH node " + to_string(n));
+        if (node.count == 0) depth[n + 1] = depth[node.offset] = depth[n] + 1;
+    }
+
+    vector<PointLight> newPointLights;
+    vector<SpotLight> newSpotLights;
+    copySection(SECTION_POINT_LIGHTS, newPointLights);
+    copySection(SECTION_SPOT_LIGHTS, newSpotLights);
+    munmap(mapping, fileSize);
+
+    for (Object* obj : objects) {
+        delete obj;
+    }
+    objects.clear();
+
+    Floor* floor = new Floor(header.floorWidth, header.floorTileWidth);
+    const Material& fm = newMaterials[header.floorMaterial];
+    floor->setColor(fm.color[0], fm.color[1], fm.color[2]);
+    floor->setCoEfficients(fm.coEfficients[0], fm.coEfficients[1], fm.coEfficients[2], fm.coEfficients[3]);
+    floor->setShine(fm.shine);
+    floor->primRef = makePrimRef(PRIM_OBJECT, 0);
+    floor->materialId = header.floorMaterial;
+    objects.push_back(floor);
+    geo.objects.push_back(floor);
+
+    materials.assign(move(newMaterials));
+    pointLights.swap(newPointLights);
+    spotLights.swap(newSpotLights);
+    geo.generation = sceneGeometry.generation + 1;
+    sceneGeometry = move(geo);
+
+    recursion_level = header.recursionLevel;
+    imageWidth = header.imageWidth;
+    imageHeight = header.imageHeight;
+    return true;
+}
@@ -0,0 +1,39 @@
+// Converts a text scene into the binary scene format (see
+// 2005024_scene_binary.h), which both renderers load without parsing or
+// building the BVH.
+//
+// Build (no GL libraries needed):
+//   g++ 2005024_scene_convert.cpp -o 2005024_scene_convert -O2 -pthread
+//
+// Usage:
+//   2005024_scene_convert <text scene> <binary scene>
+#define RT_HEADLESS
+#include "2005024_render.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        cerr << "usage: " << argv[0] << " <text scene> <binary scene>" << endl;
+        return 1;
+    }
+    if (isBinaryScene(argv[1])) {
+        cerr << "Error: " << argv[1] << " is already a binary scene" << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    if (!loadData(argv[1])) {
+        return 1;
+    }
+    double parsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (!saveBinaryScene(argv[2])) {
+        freeScene();
+        return 1;
+    }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Wrote " << argv[2] << " (text load and BVH build " << parsed << " s, total "
+         << total << " s)" << endl;
+
+    freeScene();
+    return 0;
+}
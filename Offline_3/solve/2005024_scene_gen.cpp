@@ -0,0 +1,381 @@
+// Procedural stress scenes: writes a text scene with N spheres, M triangles,
+// K quadrics and L lights placed by one of three layouts, so scaling
+// problems that the small hand-made scene hides can be measured.
+//
+//   uniform    everything spread evenly over the region
+//   clustered  objects and lights packed around a few random centres
+//   occluder   objects in the lower part of the region under one large
+//              roof (two triangles) that shadows them from every light
+//
+// The region is x, y in [-E, E], z in [0, E] above the floor; object sizes
+// shrink with the object count so the density stays about the same.
+// Quadrics cycle through axis-aligned ellipsoids, cylinders clipped along
+// their axis and rotated ellipsoids, one of each quadric path the tracer
+// has. The same seed always gives the same file.
+//
+// Build (no GL libraries needed):
+//   g++ 2005024_scene_gen.cpp -o 2005024_scene_gen -O2 -pthread
+//
+// Usage:
+//   2005024_scene_gen <output scene> [options]
+//     -n, --spheres N      spheres (default 1000)
+//     -m, --triangles M    triangles (default 0)
+//     -k, --quadrics K     quadrics (default 0)
+//     -l, --lights L       point lights (default 4)
+//         --spot-lights S  spot lights, pointing down (default 0)
+//         --layout NAME    uniform (default), clustered or occluder
+//         --clusters C     centres of the clustered layout (default 8)
+//         --extent E       half width of the region (default 100)
+//         --light-range R  give every light a range (default: no falloff)
+//         --size S         image size written to the scene (default 768)
+//         --depth D        recursion level written to the scene (default 4)
+//         --seed S         generator seed (default 1)
+//     -p, --poses FILE     also write a headless pose that frames the region
+//         --check          load the written scene with the renderer's loader
+#define RT_HEADLESS
+#include "2005024_render.h"
+
+enum SceneLayout { LAYOUT_UNIFORM, LAYOUT_CLUSTERED, LAYOUT_OCCLUDER };
+
+struct GeneratorOptions {
+    int spheres = 1000, triangles = 0, quadrics = 0;
+    int pointLights = 4, spotLights = 0;
+    SceneLayout layout = LAYOUT_UNIFORM;
+    int clusters = 8;
+    double extent = 100.0;
+    double lightRange = INFINITY;
+    int size = 768, depth = 4;
+    uint64_t seed = 1;
+};
+
+// Places objects and lights for one layout. Objects keep clear of the
+// floor by their size; the occluder layout keeps them under the roof.
+struct Placement {
+    const GeneratorOptions& opt;
+    vector<Vector3D> centres;
+    double top;                 // highest z an object reaches
+    double sigma;               // spread of a cluster
+
+    Placement(const GeneratorOptions& opt, SeededRandom& rng) : opt(opt) {
+        double e = opt.extent;
+        top = opt.layout == LAYOUT_OCCLUDER ? 0.6 * e : e;
+        sigma = 0.08 * e;
+        if (opt.layout == LAYOUT_CLUSTERED) {
+            for (int c = 0; c < opt.clusters; c++) {
+                centres.push_back(Vector3D(rng.range(-0.8 * e, 0.8 * e), rng.range(-0.8 * e, 0.8 * e),
+                                           rng.range(0.2 * e, 0.8 * e)));
+            }
+        }
+    }
+
+    double roofHeight() const {
+        return 0.7 * opt.extent;
+    }
+
+    Vector3D clampToRegion(Vector3D p, double size, double zTop) const {
+        double e = opt.extent;
+        p.x = min(max(p.x, -e + size), e - size);
+        p.y = min(max(p.y, -e + size), e - size);
+        p.z = min(max(p.z, size), max(zTop - size, size));
+        return p;
+    }
+
+    Vector3D object(SeededRandom& rng, double size) const {
+        double e = opt.extent;
+        if (opt.layout == LAYOUT_CLUSTERED) {
+            const Vector3D& c = centres[min((int)(rng.uniform() * centres.size()), (int)centres.size() - 1)];
+            Vector3D p(c.x + sigma * rng.normal(), c.y + sigma * rng.normal(), c.z + sigma * rng.normal());
+            return clampToRegion(p, size, top);
+        }
+        return clampToRegion(Vector3D(rng.range(-e, e), rng.range(-e, e), rng.range(0, top)), size, top);
+    }
+
+    Vector3D light(SeededRandom& rng) const {
+        double e = opt.extent;
+        if (opt.layout == LAYOUT_OCCLUDER) {
+            // above the roof, inside its shadow-casting footprint
+            return Vector3D(rng.range(-0.6 * e, 0.6 * e), rng.range(-0.6 * e, 0.6 * e),
+                            rng.range(0.8 * e, 1.2 * e));
+        }
+        if (opt.layout == LAYOUT_CLUSTERED) {
+            const Vector3D& c = centres[min((int)(rng.uniform() * centres.size()), (int)centres.size() - 1)];
+            Vector3D p(c.x + 2 * sigma * rng.normal(), c.y + 2 * sigma * rng.normal(),
+                       c.z + 2 * sigma * fabs(rng.normal()));
+            return clampToRegion(p, 1.0, 1.5 * e);
+        }
+        return Vector3D(rng.range(-e, e), rng.range(-e, e), rng.range(0.1 * e, 1.5 * e));
+    }
+};
+
+void writeVector(ostream& out, const Vector3D& v) {
+    out << v.x << " " << v.y << " " << v.z << "\n";
+}
+
+void writeMaterial(ostream& out, SeededRandom& rng) {
+    out << rng.range(0.2, 1.0) << " " << rng.range(0.2, 1.0) << " " << rng.range(0.2, 1.0) << "\n";
+    out << rng.range(0.2, 0.4) << " " << rng.range(0.2, 0.4) << " " << rng.range(0.1, 0.3) << " "
+        << rng.range(0.0, 0.3) << "\n";
+    out << (int)rng.range(5, 30) << "\n\n";
+}
+
+// (x - p)^T M (x - p) = 1 for M = R diag(1/a^2, 1/b^2, 1/c^2) R^T, expanded
+// into A..J; D, E, F multiply xy, xz and yz.
+void writeRotatedEllipsoid(ostream& out, const Vector3D& p, const double radii[3], SeededRandom& rng) {
+    // a random rotation from three orthonormal axes
+    Vector3D u = rng.unitVector();
+    Vector3D helper = fabs(u.x) < 0.9 ? Vector3D(1, 0, 0) : Vector3D(0, 1, 0);
+    Vector3D v = helper.cross(u);
+    v.normalize();
+    Vector3D w = u.cross(v);
+    double axes[3][3] = {{u.x, u.y, u.z}, {v.x, v.y, v.z}, {w.x, w.y, w.z}};
+
+    double m[3][3] = {};
+    for (int k = 0; k < 3; k++) {
+        double s = 1 / (radii[k] * radii[k]);
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) m[i][j] += s * axes[k][i] * axes[k][j];
+        }
+    }
+    double c[3] = {p.x, p.y, p.z};
+    double mc[3];
+    for (int i = 0; i < 3; i++) mc[i] = m[i][0] * c[0] + m[i][1] * c[1] + m[i][2] * c[2];
+    double J = c[0] * mc[0] + c[1] * mc[1] + c[2] * mc[2] - 1;
+
+    out << m[0][0] << " " << m[1][1] << " " << m[2][2] << " " << 2 * m[0][1] << " " << 2 * m[0][2] << " "
+        << 2 * m[1][2] << " " << -2 * mc[0] << " " << -2 * mc[1] << " " << -2 * mc[2] << " " << J << "\n";
+    // quadricBounds cannot bound cross terms; the clipping cube keeps it in the BVH
+    double r = max(radii[0], max(radii[1], radii[2]));
+    out << p.x - r << " " << p.y - r << " " << p.z - r << " " << 2 * r << " " << 2 * r << " " << 2 * r << "\n";
+}
+
+void writeQuadric(ostream& out, int index, const Vector3D& p, double size, SeededRandom& rng) {
+    double radii[3] = {size * rng.range(0.5, 1.0), size * rng.range(0.5, 1.0), size * rng.range(0.5, 1.0)};
+    out << "general\n";
+    if (index % 3 == 0) {
+        // axis-aligned ellipsoid, bounded without clipping
+        double A = 1 / (radii[0] * radii[0]), B = 1 / (radii[1] * radii[1]), C = 1 / (radii[2] * radii[2]);
+        out << A << " " << B << " " << C << " 0 0 0 " << -2 * A * p.x << " " << -2 * B * p.y << " "
+            << -2 * C * p.z << " " << A * p.x * p.x + B * p.y * p.y + C * p.z * p.z - 1 << "\n";
+        out << "0 0 0 0 0 0\n";
+    } else if (index % 3 == 1) {
+        // upright cylinder, clipped along z
+        double r = radii[0];
+        double A = 1 / (r * r);
+        out << A << " " << A << " 0 0 0 0 " << -2 * A * p.x << " " << -2 * A * p.y << " 0 "
+            << A * (p.x * p.x + p.y * p.y) - 1 << "\n";
+        out << p.x - r << " " << p.y - r << " " << p.z - radii[2] << " 0 0 " << 2 * radii[2] << "\n";
+    } else {
+        writeRotatedEllipsoid(out, p, radii, rng);
+    }
+}
+
+bool writeScene(const string& path, const GeneratorOptions& opt) {
+    ofstream out(path);
+    if (!out.is_open()) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    SeededRandom rng(opt.seed);
+    Placement place(opt, rng);
+
+    int objects = opt.spheres + opt.triangles + opt.quadrics;
+    int occluders = opt.layout == LAYOUT_OCCLUDER ? 2 : 0;
+    // a share of the region's volume per object, and sizes a fraction of
+    // its side
+    double volume = 4 * opt.extent * opt.extent * place.top;
+    double spacing = cbrt(volume / max(objects, 1));
+
+    out << setprecision(9);
+    out << opt.depth << "\n" << opt.size << "\n\n" << objects + occluders << "\n";
+
+    for (int i = 0; i < opt.spheres; i++) {
+        double radius = spacing * rng.range(0.15, 0.35);
+        out << "sphere\n";
+        writeVector(out, place.object(rng, radius));
+        out << radius << "\n";
+        writeMaterial(out, rng);
+    }
+
+    for (int i = 0; i < opt.triangles; i++) {
+        double size = spacing * rng.range(0.3, 0.6);
+        Vector3D c = place.object(rng, size);
+        out << "triangle\n";
+        for (int k = 0; k < 3; k++) writeVector(out, c + rng.unitVector() * size);
+        writeMaterial(out, rng);
+    }
+
+    for (int i = 0; i < opt.quadrics; i++) {
+        double size = spacing * rng.range(0.15, 0.35);
+        writeQuadric(out, i, place.object(rng, size), size, rng);
+        writeMaterial(out, rng);
+    }
+
+    if (occluders) {
+        // the roof: a square over 80% of the region, as two triangles
+        double e = 0.8 * opt.extent, z = place.roofHeight();
+        Vector3D a(-e, -e, z), b(e, -e, z), c(e, e, z), d(-e, e, z);
+        out << "triangle\n";
+        writeVector(out, a);
+        writeVector(out, b);
+        writeVector(out, c);
+        out << "0.6 0.6 0.6\n0.3 0.4 0.1 0.0\n10\n\n";
+        out << "triangle\n";
+        writeVector(out, a);
+        writeVector(out, c);
+        writeVector(out, d);
+        out << "0.6 0.6 0.6\n0.3 0.4 0.1 0.0\n10\n\n";
+    }
+
+    // many lights would only saturate the image; keep the total about that
+    // of four full-strength ones
+    int lights = opt.pointLights + opt.spotLights;
+    double strength = min(1.0, 4.0 / max(lights, 1));
+    auto writeLightColor = [&]() {
+        out << strength * rng.range(0.5, 1.0) << " " << strength * rng.range(0.5, 1.0) << " "
+            << strength * rng.range(0.5, 1.0) << "\n";
+    };
+    auto writeRange = [&]() {
+        if (opt.lightRange < INFINITY) out << "range " << opt.lightRange << "\n";
+    };
+
+    out << opt.pointLights << "\n";
+    for (int i = 0; i < opt.pointLights; i++) {
+        writeVector(out, place.light(rng));
+        writeLightColor();
+        writeRange();
+    }
+    out << "\n" << opt.spotLights << "\n";
+    for (int i = 0; i < opt.spotLights; i++) {
+        writeVector(out, place.light(rng));
+        writeLightColor();
+        out << "0 0 -1\n" << (int)rng.range(15, 45) << "\n";
+        writeRange();
+    }
+
+    if (!out) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+void printUsage(const char* program) {
+    cerr << "usage: " << program << " <output scene> [-n spheres] [-m triangles] [-k quadrics]"
+         << " [-l lights] [--spot-lights S] [--layout uniform|clustered|occluder] [--clusters C]"
+         << " [--extent E] [--light-range R] [--size S] [--depth D] [--seed S] [-p poses] [--check]"
+         << endl;
+}
+
+int main(int argc, char** argv) {
+    GeneratorOptions opt;
+    const char* outputPath = nullptr;
+    const char* posesPath = nullptr;
+    bool check = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                cerr << "Error: " << arg << " needs a value" << endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+        // counts and sizes: non-negative integers
+        auto count = [&](int& n, int least) {
+            const char* v = value();
+            n = atoi(v);
+            if (n < least || !isdigit((unsigned char)v[0])) {
+                cerr << "Error: " << arg << " needs an integer of at least " << least << endl;
+                exit(1);
+            }
+        };
+
+        if (arg == "-n" || arg == "--spheres") {
+            count(opt.spheres, 0);
+        } else if (arg == "-m" || arg == "--triangles") {
+            count(opt.triangles, 0);
+        } else if (arg == "-k" || arg == "--quadrics") {
+            count(opt.quadrics, 0);
+        } else if (arg == "-l" || arg == "--lights") {
+            count(opt.pointLights, 0);
+        } else if (arg == "--spot-lights") {
+            count(opt.spotLights, 0);
+        } else if (arg == "--layout") {
+            string name = value();
+            if (name == "uniform") opt.layout = LAYOUT_UNIFORM;
+            else if (name == "clustered") opt.layout = LAYOUT_CLUSTERED;
+            else if (name == "occluder") opt.layout = LAYOUT_OCCLUDER;
+            else {
+                cerr << "Error: unknown layout '" << name << "' (uniform, clustered or occluder)" << endl;
+                return 1;
+            }
+        } else if (arg == "--clusters") {
+            count(opt.clusters, 1);
+        } else if (arg == "--extent") {
+            opt.extent = atof(value());
+            if (!(opt.extent > 0)) {
+                cerr << "Error: --extent must be positive" << endl;
+                return 1;
+            }
+        } else if (arg == "--light-range") {
+            opt.lightRange = atof(value());
+            if (!(opt.lightRange > 0)) {
+                cerr << "Error: --light-range must be positive" << endl;
+                return 1;
+            }
+        } else if (arg == "--size") {
+            count(opt.size, 1);
+        } else if (arg == "--depth") {
+            count(opt.depth, 0);
+        } else if (arg == "--seed") {
+            opt.seed = strtoull(value(), nullptr, 10);
+        } else if (arg == "-p" || arg == "--poses") {
+            posesPath = value();
+        } else if (arg == "--check") {
+            check = true;
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (arg[0] != '-' && outputPath == nullptr) {
+            outputPath = argv[i];
+        } else {
+            cerr << "Error: unknown option " << arg << endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (outputPath == nullptr) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    if (!writeScene(outputPath, opt)) {
+        return 1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Wrote " << outputPath << ": " << opt.spheres << " spheres, " << opt.triangles << " triangles, "
+         << opt.quadrics << " quadrics, " << opt.pointLights << " point and " << opt.spotLights
+         << " spot lights (" << seconds << " s)" << endl;
+
+    if (posesPath != nullptr) {
+        // from outside a corner, a little above, looking at the region's middle
+        ofstream poses(posesPath);
+        double e = opt.extent;
+        poses << "# eye, center, up\n"
+              << 1.7 * e << " " << 1.3 * e << " " << 1.1 * e << "  0 0 " << 0.3 * e << "  0 0 1\n";
+        if (!poses) {
+            cerr << "Error: Could not write " << posesPath << endl;
+            return 1;
+        }
+    }
+
+    if (check) {
+        if (!loadData(outputPath)) {
+            return 1;
+        }
+        freeScene();
+    }
+    return 0;
+}
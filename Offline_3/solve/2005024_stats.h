@@ -0,0 +1,309 @@
+#pragma once
+#include<bits/stdc++.h>
+using namespace std;
+
+// Render instrumentation, compiled in with -DRT_STATS. Without it the
+// STAT_* macros expand to nothing and none of this is built.
+//
+// Every render worker counts into its own ThreadStats block with plain
+// increments: no atomics, no locks. Blocks are indexed by worker slot
+// (renderTiles binds slot id to its worker id, the calling thread is slot 0)
+// so the threads of successive bands reuse them; a capture reads them only
+// after renderTiles has joined its workers.
+#ifdef RT_STATS
+
+enum StatCounter {
+    STAT_CAMERA_RAYS,
+    STAT_REFLECTION_RAYS,
+    STAT_SHADOW_RAYS,
+    STAT_SHADOW_RAYS_BLOCKED,
+    STAT_SHADOW_RAYS_CULLED,    // lights dropped by range or cone before any shadow ray
+    STAT_PRIM_TESTS,            // ray-primitive tests; a packet test counts once per live lane
+    STAT_BVH_NODES,             // node visits; a packet visit counts once
+    STAT_PACKETS,
+    STAT_COUNT
+};
+
+const char* const statCounterNames[STAT_COUNT] = {
+    "cameraRays", "reflectionRays", "shadowRays", "shadowRaysBlocked", "shadowRaysCulled",
+    "primTests", "bvhNodes", "packets"
+};
+
+enum StatTimer {
+    STAT_TIMER_TILE,
+    STAT_TIMER_BAND,            // one band of renderToFile, tiles and resolve
+    STAT_TIMER_RESOLVE,
+    STAT_TIMER_WRITE,
+    STAT_TIMER_COUNT
+};
+
+const char* const statTimerNames[STAT_TIMER_COUNT] = {"tile", "band", "resolve", "write"};
+
+// shading hits per recursion level; deeper levels share the last bin
+const int STAT_MAX_DEPTH = 16;
+
+// one complete ("X") event of the Chrome trace
+struct StatEvent {
+    StatTimer timer;
+    int64_t start, duration;    // ns since statsBegin
+    int x, y;                   // tile origin, or the band's first row in y
+};
+
+struct TimerTotals {
+    uint64_t count = 0;
+    int64_t total = 0, longest = 0;     // ns
+};
+
+struct ThreadStats {
+    uint64_t counters[STAT_COUNT];
+    uint64_t depth[STAT_MAX_DEPTH];
+    TimerTotals timers[STAT_TIMER_COUNT];
+    vector<StatEvent> events;
+
+    ThreadStats() {
+        clear();
+    }
+
+    void clear() {
+        fill(counters, counters + STAT_COUNT, 0);
+        fill(depth, depth + STAT_MAX_DEPTH, 0);
+        fill(timers, timers + STAT_TIMER_COUNT, TimerTotals());
+        events.clear();
+    }
+};
+
+struct StatsRegistry {
+    mutex lock;                             // only taken to add a slot
+    vector<unique_ptr<ThreadStats>> slots;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool tracing = false;                   // keep per-event records for the trace
+
+    ThreadStats* slot(int id) {
+        lock_guard<mutex> guard(lock);
+        while ((int)slots.size() <= id) slots.emplace_back(new ThreadStats());
+        return slots[id].get();
+    }
+};
+
+StatsRegistry statsRegistry;
+thread_local ThreadStats* currentStats = nullptr;
+
+inline ThreadStats& threadStats() {
+    if (currentStats == nullptr) currentStats = statsRegistry.slot(0);
+    return *currentStats;
+}
+
+void statsBindWorker(int id) {
+    currentStats = statsRegistry.slot(id);
+}
+
+inline int64_t statsClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - statsRegistry.start).count();
+}
+
+// zeroes every slot and restarts the clock; no render may be running
+void statsBegin(bool tracing) {
+    lock_guard<mutex> guard(statsRegistry.lock);
+    for (auto& s : statsRegistry.slots) s->clear();
+    statsRegistry.start = chrono::steady_clock::now();
+    statsRegistry.tracing = tracing;
+}
+
+struct ScopedStatTimer {
+    StatTimer timer;
+    int x, y;
+    int64_t start;
+
+    ScopedStatTimer(StatTimer timer, int x = 0, int y = 0) : timer(timer), x(x), y(y) {
+        start = statsClock();
+    }
+
+    ~ScopedStatTimer() {
+        int64_t duration = statsClock() - start;
+        ThreadStats& s = threadStats();
+        TimerTotals& t = s.timers[timer];
+        t.count++;
+        t.total += duration;
+        t.longest = max(t.longest, duration);
+        if (statsRegistry.tracing) s.events.push_back({timer, start, duration, x, y});
+    }
+};
+
+#define STAT_ADD(counter, n) (threadStats().counters[counter] += (n))
+#define STAT_DEPTH(level) (threadStats().depth[min((level) - 1, STAT_MAX_DEPTH - 1)]++)
+#define STAT_CONCAT_(a, b) a##b
+#define STAT_CONCAT(a, b) STAT_CONCAT_(a, b)
+#define STAT_TIMER(...) ScopedStatTimer STAT_CONCAT(statTimer, __LINE__)(__VA_ARGS__)
+#define STAT_BIND_WORKER(id) statsBindWorker(id)
+
+// What the report says about the capture besides the counters.
+struct StatsCapture {
+    string image;
+    int width = 0, height = 0;
+    int threads = 0;
+    string isa;
+    bool wavefront = false;
+    string precision;
+    int lightSamples = 0, passes = 1;
+    double seconds = 0.0;
+};
+
+// totals over every slot
+struct StatsTotals {
+    uint64_t counters[STAT_COUNT] = {};
+    uint64_t depth[STAT_MAX_DEPTH] = {};
+    TimerTotals timers[STAT_TIMER_COUNT];
+
+    StatsTotals() {
+        for (auto& s : statsRegistry.slots) {
+            for (int c = 0; c < STAT_COUNT; c++) counters[c] += s->counters[c];
+            for (int d = 0; d < STAT_MAX_DEPTH; d++) depth[d] += s->depth[d];
+            for (int t = 0; t < STAT_TIMER_COUNT; t++) {
+                timers[t].count += s->timers[t].count;
+                timers[t].total += s->timers[t].total;
+                timers[t].longest = max(timers[t].longest, s->timers[t].longest);
+            }
+        }
+    }
+
+    uint64_t rays() const {
+        return counters[STAT_CAMERA_RAYS] + counters[STAT_REFLECTION_RAYS] + counters[STAT_SHADOW_RAYS];
+    }
+};
+
+string jsonString(const string& s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// one line for the console
+string statsSummary(const StatsCapture& capture) {
+    StatsTotals t;
+    double rays = t.rays();
+    ostringstream out;
+    out << fixed << setprecision(2) << "Stats: " << rays / max(capture.seconds, 1e-9) / 1e6
+        << " Mrays/s, " << t.counters[STAT_PRIM_TESTS] / max(rays, 1.0) << " tests/ray, "
+        << t.counters[STAT_SHADOW_RAYS_CULLED] << " shadow rays culled";
+    return out.str();
+}
+
+bool writeStatsReport(const string& path, const StatsCapture& capture) {
+    ofstream out(path);
+    if (!out.is_open()) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    StatsTotals t;
+    double rays = t.rays();
+    out << setprecision(10);
+    out << "{\n";
+    out << "  \"image\": " << jsonString(capture.image) << ",\n";
+    out << "  \"width\": " << capture.width << ",\n";
+    out << "  \"height\": " << capture.height << ",\n";
+    out << "  \"threads\": " << capture.threads << ",\n";
+    out << "  \"isa\": " << jsonString(capture.isa) << ",\n";
+    out << "  \"wavefront\": " << (capture.wavefront ? "true" : "false") << ",\n";
+    out << "  \"precision\": " << jsonString(capture.precision) << ",\n";
+    out << "  \"lightSamples\": " << capture.lightSamples << ",\n";
+    out << "  \"passes\": " << capture.passes << ",\n";
+    out << "  \"seconds\": " << capture.seconds << ",\n";
+
+    out << "  \"counters\": {";
+    for (int c = 0; c < STAT_COUNT; c++) {
+        out << (c ? ", " : "") << "\"" << statCounterNames[c] << "\": " << t.counters[c];
+    }
+    out << "},\n";
+
+    out << "  \"raysPerSecond\": " << rays / max(capture.seconds, 1e-9) << ",\n";
+    out << "  \"primTestsPerRay\": " << t.counters[STAT_PRIM_TESTS] / max(rays, 1.0) << ",\n";
+    out << "  \"bvhNodesPerRay\": " << t.counters[STAT_BVH_NODES] / max(rays, 1.0) << ",\n";
+
+    // shading hits per level, level 1 first, without the empty tail
+    int depth = STAT_MAX_DEPTH;
+    while (depth > 0 && t.depth[depth - 1] == 0) depth--;
+    out << "  \"depthHistogram\": [";
+    for (int d = 0; d < depth; d++) out << (d ? ", " : "") << t.depth[d];
+    out << "],\n";
+
+    out << "  \"timers\": {";
+    for (int k = 0; k < STAT_TIMER_COUNT; k++) {
+        const TimerTotals& timer = t.timers[k];
+        out << (k ? "," : "") << "\n    \"" << statTimerNames[k] << "\": {\"count\": " << timer.count
+            << ", \"totalSeconds\": " << timer.total * 1e-9
+            << ", \"meanMs\": " << (timer.count ? timer.total * 1e-6 / timer.count : 0.0)
+            << ", \"maxMs\": " << timer.longest * 1e-6 << "}";
+    }
+    out << "\n  },\n";
+
+    // busy time per worker shows how evenly tiles were spread
+    out << "  \"workers\": [";
+    for (size_t w = 0; w < statsRegistry.slots.size(); w++) {
+        const ThreadStats& s = *statsRegistry.slots[w];
+        out << (w ? "," : "") << "\n    {\"id\": " << w << ", \"tiles\": " << s.timers[STAT_TIMER_TILE].count
+            << ", \"busySeconds\": " << s.timers[STAT_TIMER_TILE].total * 1e-9
+            << ", \"rays\": " << s.counters[STAT_CAMERA_RAYS] + s.counters[STAT_REFLECTION_RAYS] +
+                                 s.counters[STAT_SHADOW_RAYS] << "}";
+    }
+    out << "\n  ]\n}\n";
+
+    if (!out) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Chrome trace event format: load the file in chrome://tracing or Perfetto.
+// One row per worker, one slice per tile, band, resolve and write; tile
+// origins are relative to their band, whose first row the band slice holds.
+bool writeTrace(const string& path, const StatsCapture& capture) {
+    ofstream out(path);
+    if (!out.is_open()) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "  {\"ph\": \"M\", \"name\": \"process_name\", \"pid\": 1, \"args\": {\"name\": "
+        << jsonString(capture.image) << "}}";
+    out << fixed << setprecision(3);
+    for (size_t w = 0; w < statsRegistry.slots.size(); w++) {
+        out << ",\n  {\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << w
+            << ", \"args\": {\"name\": \"worker " << w << "\"}}";
+        for (const StatEvent& e : statsRegistry.slots[w]->events) {
+            out << ",\n  {\"ph\": \"X\", \"name\": \"" << statTimerNames[e.timer] << "\", \"pid\": 1, \"tid\": " << w
+                << ", \"ts\": " << e.start * 1e-3 << ", \"dur\": " << e.duration * 1e-3;
+            if (e.timer == STAT_TIMER_TILE) {
+                out << ", \"args\": {\"x\": " << e.x << ", \"y\": " << e.y << "}";
+            } else {
+                out << ", \"args\": {\"row\": " << e.y << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+
+    if (!out) {
+        cerr << "Error: Could not write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+#else
+
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_DEPTH(level) ((void)0)
+#define STAT_TIMER(...) ((void)0)
+#define STAT_BIND_WORKER(id) ((void)0)
+
+#endif
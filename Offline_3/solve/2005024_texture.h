@@ -0,0 +1,184 @@
+#pragma once
+#include <bits/stdc++.h>
+using namespace std;
+
+enum TextureFilter {
+    FILTER_NEAREST,     // the original lookup: one texel of the full image
+    FILTER_BILINEAR,    // four texels of the full image
+    FILTER_TRILINEAR    // two bilinear lookups in the mip levels around the footprint
+};
+
+// An RGB image with its mip chain, stored for sampling rather than for
+// loading: texels are packed RGBA8 and laid out in 8 x 8 tiles (256 bytes,
+// four cache lines) with Morton order inside each tile, so a bilinear
+// footprint and its neighbours share a tile almost always. Each level is
+// the 2 x 2 box filter of the one before, down to 1 x 1.
+//
+// Coordinates follow sampleFloorTexture: u runs along the image rows, v
+// upwards from the last row. Filtered lookups repeat at the edges, as the
+// GL preview's GL_REPEAT does.
+struct MipTexture {
+    static const int TILE = 8;
+
+    struct Level {
+        int width = 0, height = 0;
+        int tilesX = 0;
+        vector<uint32_t> texels;
+
+        // spreads the three low bits of x to bits 0, 2, 4
+        static uint32_t spread(uint32_t x) {
+            return (x & 1) | ((x & 2) << 1) | ((x & 4) << 2);
+        }
+
+        size_t index(int x, int y) const {
+            size_t tile = (size_t)(y / TILE) * tilesX + x / TILE;
+            return tile * TILE * TILE + (spread(x & 7) | spread(y & 7) << 1);
+        }
+
+        uint32_t at(int x, int y) const {
+            return texels[index(x, y)];
+        }
+
+        void resize(int w, int h) {
+            width = w;
+            height = h;
+            tilesX = (w + TILE - 1) / TILE;
+            int tilesY = (h + TILE - 1) / TILE;
+            texels.assign((size_t)tilesX * tilesY * TILE * TILE, 0);
+        }
+    };
+
+    vector<Level> levels;
+
+    static uint32_t pack(int r, int g, int b) {
+        return (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16;
+    }
+
+    // byte to [0, 1]; the same doubles the original x / 255.0 gave
+    static const double* unitTable() {
+        static double table[256];
+        static bool ready = [] {
+            for (int i = 0; i < 256; i++) table[i] = i / 255.0;
+            return true;
+        }();
+        (void)ready;
+        return table;
+    }
+
+    bool empty() const {
+        return levels.empty();
+    }
+
+    void clear() {
+        levels.clear();
+    }
+
+    size_t memoryBytes() const {
+        size_t n = 0;
+        for (const Level& level : levels) n += level.texels.size() * sizeof(uint32_t);
+        return n;
+    }
+
+    // rgb holds width * height RGB8 texels, rows top to bottom
+    void build(const unsigned char* rgb, int width, int height) {
+        levels.clear();
+        if (rgb == nullptr || width <= 0 || height <= 0) return;
+
+        levels.emplace_back();
+        levels[0].resize(width, height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const unsigned char* p = rgb + ((size_t)y * width + x) * 3;
+                levels[0].texels[levels[0].index(x, y)] = pack(p[0], p[1], p[2]);
+            }
+        }
+
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            const Level& fine = levels.back();
+            Level coarse;
+            coarse.resize(max(1, fine.width / 2), max(1, fine.height / 2));
+            for (int y = 0; y < coarse.height; y++) {
+                for (int x = 0; x < coarse.width; x++) {
+                    // odd sizes drop into the last texel of the row or column
+                    int x0 = min(2 * x, fine.width - 1), x1 = min(2 * x + 1, fine.width - 1);
+                    int y0 = min(2 * y, fine.height - 1), y1 = min(2 * y + 1, fine.height - 1);
+                    uint32_t c[4] = {fine.at(x0, y0), fine.at(x1, y0), fine.at(x0, y1), fine.at(x1, y1)};
+                    int sum[3] = {0, 0, 0};
+                    for (uint32_t t : c) {
+                        for (int k = 0; k < 3; k++) sum[k] += (t >> (8 * k)) & 0xFF;
+                    }
+                    coarse.texels[coarse.index(x, y)] = pack((sum[0] + 2) / 4, (sum[1] + 2) / 4, (sum[2] + 2) / 4);
+                }
+            }
+            levels.push_back(move(coarse));
+        }
+    }
+
+    void unpack(uint32_t t, double* outColor) const {
+        const double* unit = unitTable();
+        outColor[0] = unit[t & 0xFF];
+        outColor[1] = unit[(t >> 8) & 0xFF];
+        outColor[2] = unit[(t >> 16) & 0xFF];
+    }
+
+    // exactly the original clamped lookup
+    void sampleNearest(double u, double v, double* outColor) const {
+        const Level& base = levels[0];
+        u = max(0.0, min(1.0, u));
+        v = max(0.0, min(1.0, v));
+        int x = (int)(u * (base.width - 1));
+        int y = (int)((1.0 - v) * (base.height - 1));
+        unpack(base.at(x, y), outColor);
+    }
+
+    void sampleBilinear(int level, double u, double v, double* outColor) const {
+        const Level& l = levels[level];
+        double x = u * l.width - 0.5;
+        double y = (1.0 - v) * l.height - 0.5;
+        double fx = floor(x), fy = floor(y);
+        double wx = x - fx, wy = y - fy;
+        auto wrap = [](double i, int n) {
+            int k = (int)fmod(i, (double)n);
+            return k < 0 ? k + n : k;
+        };
+        int x0 = wrap(fx, l.width), x1 = x0 + 1 == l.width ? 0 : x0 + 1;
+        int y0 = wrap(fy, l.height), y1 = y0 + 1 == l.height ? 0 : y0 + 1;
+
+        uint32_t c[4] = {l.at(x0, y0), l.at(x1, y0), l.at(x0, y1), l.at(x1, y1)};
+        double w[4] = {(1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy};
+        const double* unit = unitTable();
+        for (int k = 0; k < 3; k++) {
+            outColor[k] = w[0] * unit[(c[0] >> (8 * k)) & 0xFF] + w[1] * unit[(c[1] >> (8 * k)) & 0xFF] +
+                          w[2] * unit[(c[2] >> (8 * k)) & 0xFF] + w[3] * unit[(c[3] >> (8 * k)) & 0xFF];
+        }
+    }
+
+    // footprint is the width covered on the surface in uv units; it picks
+    // the level where it spans about one texel
+    void sampleTrilinear(double u, double v, double footprint, double* outColor) const {
+        const Level& base = levels[0];
+        double texels = footprint * max(base.width, base.height);
+        double lod = texels > 1.0 ? log2(texels) : 0.0;
+        int last = levels.size() - 1;
+        if (lod >= last) {
+            sampleBilinear(last, u, v, outColor);
+            return;
+        }
+        int level = (int)lod;
+        double f = lod - level;
+        sampleBilinear(level, u, v, outColor);
+        if (f > 0.0) {
+            double coarse[3];
+            sampleBilinear(level + 1, u, v, coarse);
+            for (int k = 0; k < 3; k++) outColor[k] += f * (coarse[k] - outColor[k]);
+        }
+    }
+
+    void sample(TextureFilter filter, double u, double v, double footprint, double* outColor) const {
+        switch (filter) {
+            case FILTER_NEAREST: sampleNearest(u, v, outColor); break;
+            case FILTER_BILINEAR: sampleBilinear(0, u, v, outColor); break;
+            default: sampleTrilinear(u, v, footprint, outColor); break;
+        }
+    }
+};
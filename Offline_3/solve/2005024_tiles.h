@@ -0,0 +1,95 @@
+#pragma once
+#include<bits/stdc++.h>
+#include "2005024_stats.h"
+using namespace std;
+
+struct Tile {
+    int x0, y0, x1, y1;     // pixel range [x0, x1) x [y0, y1)
+};
+
+// Per-worker tile deques. A worker pops from the front of its own deque and,
+// once that is empty, steals from the back of the others, so uneven tiles
+// (reflective objects vs. empty sky) even out across threads.
+struct TileScheduler {
+    struct WorkQueue {
+        mutex lock;
+        deque<int> tiles;
+    };
+
+    vector<Tile> tiles;
+    vector<unique_ptr<WorkQueue>> queues;
+
+    TileScheduler(int width, int height, int tileSize, int numWorkers) {
+        for (int y = 0; y < height; y += tileSize) {
+            for (int x = 0; x < width; x += tileSize) {
+                tiles.push_back({x, y, min(x + tileSize, width), min(y + tileSize, height)});
+            }
+        }
+
+        for (int w = 0; w < numWorkers; w++) {
+            queues.emplace_back(new WorkQueue());
+        }
+        // contiguous runs keep each worker on neighbouring tiles until it has to steal
+        int n = tiles.size();
+        for (int w = 0; w < numWorkers; w++) {
+            int begin = (long long)n * w / numWorkers;
+            int end = (long long)n * (w + 1) / numWorkers;
+            for (int t = begin; t < end; t++) queues[w]->tiles.push_back(t);
+        }
+    }
+
+    bool next(int worker, Tile& tile) {
+        {
+            WorkQueue& own = *queues[worker];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tiles.empty()) {
+                tile = tiles[own.tiles.front()];
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+        int numWorkers = queues.size();
+        for (int k = 1; k < numWorkers; k++) {
+            WorkQueue& victim = *queues[(worker + k) % numWorkers];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tiles.empty()) {
+                tile = tiles[victim.tiles.back()];
+                victim.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+int defaultThreadCount() {
+    unsigned int n = thread::hardware_concurrency();
+    return n == 0 ? 1 : (int)n;
+}
+
+// Calls renderTile for every tile of a width x height image on numThreads
+// workers (the calling thread is one of them). renderTile must only write
+// pixels inside the tile it is given.
+void renderTiles(int width, int height, int tileSize, int numThreads,
+                 const function<void(const Tile&)>& renderTile) {
+    if (numThreads <= 0) numThreads = defaultThreadCount();
+    TileScheduler scheduler(width, height, tileSize, numThreads);
+
+    auto worker = [&](int id) {
+        STAT_BIND_WORKER(id);
+        Tile tile;
+        while (scheduler.next(id, tile)) {
+            STAT_TIMER(STAT_TIMER_TILE, tile.x0, tile.y0);
+            renderTile(tile);
+        }
+    };
+
+    vector<thread> threads;
+    for (int id = 1; id < numThreads; id++) {
+        threads.emplace_back(worker, id);
+    }
+    worker(0);
+    for (thread& t : threads) {
+        t.join();
+    }
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include "2005024_packet.h"
+
+// Breadth-first ("wavefront") version of computePhongLighting. A batch of
+// camera rays is traced one bounce at a time: every stage (closest hit,
+// shading, shadow rays, reflection rays) runs over the whole queue before
+// the next one starts, so each loop keeps one kind of work hot in cache.
+//
+// Shading is split exactly where the recursion would add the reflected
+// colour: every hit becomes a PathVertex holding its unclamped direct light,
+// and once the deepest bounce is done the vertices are resolved bottom-up
+// with the same additions and clamps, so the image matches the recursive
+// tracer bit for bit.
+struct WavefrontTracer {
+    struct PathVertex {
+        double color[3];        // ambient + direct light, later the resolved colour
+        double reflectivity;
+        int child;              // vertex hit by this vertex's reflection ray, -1 if none
+    };
+
+    struct ShadowQuery {
+        int point;              // index into points (the current bounce)
+        int light;
+        Vector3D position;
+        const double* color;
+        double intensity;
+    };
+
+    vector<PathVertex> vertices;
+
+    // per-bounce queues, reused across bounces and tiles
+    vector<Ray> rays;
+    vector<int> owners;         // pixel for camera rays, parent vertex afterwards
+    vector<HitRecord> hits;
+    vector<char> found;
+    vector<ShadingPoint> points;
+    vector<int> pointVertex;
+    vector<ShadowQuery> shadows;
+    vector<int> shadowOrder;
+    vector<char> visible;
+    vector<Ray> nextRays;
+    vector<int> nextOwners;
+    vector<pair<uint64_t, int>> sortKeys;
+
+    // spreads the low 10 bits of x so that two zero bits separate each of them
+    static uint32_t expandBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
+
+    // Orders reflection rays by direction octant, then by the Morton code of
+    // their origin, so packets and BVH traversals see neighbouring rays.
+    void sortRays() {
+        AABB box = sceneGeometry.bvh.bounds();
+        Vector3D extent = box.hi - box.lo;
+        bool finite = !sceneGeometry.bvh.nodes.empty() &&
+                      isfinite(extent.x) && isfinite(extent.y) && isfinite(extent.z);
+
+        auto cell = [&](double v, double lo, double ext) {
+            if (!finite || ext <= 0) return 0u;
+            double f = (v - lo) / ext;
+            f = max(0.0, min(1.0, f));
+            return (uint32_t)(f * 1023.0);
+        };
+
+        sortKeys.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i++) {
+            const Ray& r = rays[i];
+            uint64_t octant = (r.dir.x < 0) | ((r.dir.y < 0) << 1) | ((r.dir.z < 0) << 2);
+            uint32_t morton = expandBits(cell(r.start.x, box.lo.x, extent.x)) |
+                              (expandBits(cell(r.start.y, box.lo.y, extent.y)) << 1) |
+                              (expandBits(cell(r.start.z, box.lo.z, extent.z)) << 2);
+            sortKeys[i] = {(octant << 30) | morton, (int)i};
+        }
+        sort(sortKeys.begin(), sortKeys.end());
+
+        nextRays.clear();
+        nextOwners.clear();
+        for (auto& key : sortKeys) {
+            nextRays.push_back(rays[key.second]);
+            nextOwners.push_back(owners[key.second]);
+        }
+        rays.swap(nextRays);
+        owners.swap(nextOwners);
+    }
+
+    void intersectQueue() {
+        PacketIsa isa = activePacketIsa();
+        int width = packetWidth(isa);
+
+        hits.assign(rays.size(), HitRecord());
+        found.assign(rays.size(), 0);
+        for (size_t i0 = 0; i0 < rays.size(); i0 += width) {
+            int n = min((size_t)width, rays.size() - i0);
+            PacketQuery packet;
+            for (int k = 0; k < n; k++) {
+                packet.add(&rays[i0 + k]);
+            }
+            closestHitPacket(sceneGeometry, packet, isa);
+            for (int k = 0; k < n; k++) {
+                found[i0 + k] = packet.finishHit(sceneGeometry, k, hits[i0 + k]);
+            }
+        }
+    }
+
+    // ambient term and the shadow rays of every hit in the queue
+    void shadeQueue(int level, vector<int>& pixelVertex) {
+        points.clear();
+        pointVertex.clear();
+        shadows.clear();
+
+        for (size_t i = 0; i < rays.size(); i++) {
+            if (!found[i]) continue;
+
+            int v = vertices.size();
+            vertices.push_back(PathVertex());
+            if (level == 1) {
+                pixelVertex[owners[i]] = v;
+            } else {
+                vertices[owners[i]].child = v;
+            }
+
+            ShadingPoint sp;
+            prepareShading(hits[i], &rays[i], sp, vertices[v].color);
+            STAT_DEPTH(level);
+            vertices[v].reflectivity = sp.mat.coEfficients[3];
+            vertices[v].child = -1;
+
+            int p = points.size();
+            points.push_back(sp);
+            pointVertex.push_back(v);
+
+            forEachLight(sp.point, level, [&](int li, double weight) {
+                ShadowQuery q;
+                q.point = p;
+                q.light = li;
+                if (lightReaches(li, sp.point, q.position, q.color, q.intensity)) {
+                    q.intensity *= weight;
+                    shadows.push_back(q);
+                } else {
+                    STAT_ADD(STAT_SHADOW_RAYS_CULLED, 1);
+                }
+            });
+        }
+    }
+
+    // shadow rays are traced light by light so the occluder cache stays warm
+    void traceShadows() {
+        int numLights = lightCount();
+        vector<int> start(numLights + 1, 0);
+        for (const ShadowQuery& q : shadows) start[q.light + 1]++;
+        for (int li = 0; li < numLights; li++) start[li + 1] += start[li];
+
+        shadowOrder.resize(shadows.size());
+        for (size_t i = 0; i < shadows.size(); i++) {
+            shadowOrder[start[shadows[i].light]++] = i;
+        }
+
+        visible.assign(shadows.size(), 0);
+        for (int i : shadowOrder) {
+            const ShadowQuery& q = shadows[i];
+            visible[i] = !occluded(q.position, points[q.point].point, points[q.point].prim,
+                                   points[q.point].part, q.light);
+        }
+    }
+
+    // light terms are added per vertex in light order, as the recursive loop does
+    void accumulateLights() {
+        for (size_t i = 0; i < shadows.size(); i++) {
+            if (!visible[i]) continue;
+            const ShadowQuery& q = shadows[i];
+            addLightTerm(points[q.point], q.position, q.color, q.intensity,
+                         vertices[pointVertex[q.point]].color);
+        }
+    }
+
+    void spawnReflections(int level) {
+        nextRays.clear();
+        nextOwners.clear();
+        if (level >= recursion_level) return;
+
+        size_t p = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            if (!found[i]) continue;
+            const ShadingPoint& sp = points[p];
+            int v = pointVertex[p++];
+            if (sp.mat.coEfficients[3] > 0) {
+                nextRays.push_back(reflectedRay(sp, &rays[i]));
+                nextOwners.push_back(v);
+            }
+        }
+        STAT_ADD(STAT_REFLECTION_RAYS, nextRays.size());
+    }
+
+    // Traces camera rays to their final colours (3 doubles per ray, black
+    // for misses), clamped per bounce unless hdrShading is on.
+    void trace(const vector<Ray>& cameraRays, vector<double>& colors) {
+        vertices.clear();
+        vector<int> pixelVertex(cameraRays.size(), -1);
+
+        rays = cameraRays;
+        owners.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i++) owners[i] = i;
+
+        for (int level = 1; !rays.empty(); level++) {
+            if (level > 1) sortRays();
+            intersectQueue();
+            shadeQueue(level, pixelVertex);
+            traceShadows();
+            accumulateLights();
+            spawnReflections(level);
+            rays.swap(nextRays);
+            owners.swap(nextOwners);
+        }
+
+        // children always come after their parent, so one backward pass resolves every path
+        for (int v = (int)vertices.size() - 1; v >= 0; v--) {
+            PathVertex& pv = vertices[v];
+            if (pv.child >= 0) {
+                for (int c = 0; c < 3; c++) {
+                    pv.color[c] += vertices[pv.child].color[c] * pv.reflectivity;
+                }
+            }
+            if (!hdrShading) {
+                for (int c = 0; c < 3; c++) {
+                    pv.color[c] = max(0.0, min(1.0, pv.color[c]));
+                }
+            }
+        }
+
+        colors.assign(3 * cameraRays.size(), 0.0);
+        for (size_t i = 0; i < cameraRays.size(); i++) {
+            if (pixelVertex[i] < 0) continue;
+            for (int c = 0; c < 3; c++) {
+                colors[3 * i + c] = vertices[pixelVertex[i]].color[c];
+            }
+        }
+    }
+};
@@ -11,7 +11,7 @@ filename=$(basename -- "$1")
 output="${filename%.*}"
 
 # Compile the OpenGL program
-g++ "$1" -o "$output" -lGL -lGLU -lglut
+g++ "$1" -o "$output" -O2 -pthread -lGL -lGLU -lglut
 
 # Check if compilation was successful
 if [ $? -eq 0 ]; then
@@ -0,0 +1,205 @@
+// Compares iostream extraction with SceneTokenizer on large scene files in
+// both text formats: the Offline_3 ray tracer scene (loadData) and the
+// Offline_2 transformation script (Modeling_Transformation). Each parser
+// walks the same grammar and folds every value into a checksum, so the
+// two must agree exactly; object construction is left out to time parsing
+// alone.
+//
+// Build:
+//   g++ 2005024_parse_bench.cpp -o 2005024_parse_bench -O2
+//
+// Usage:
+//   2005024_parse_bench [size in MB (default 100)] [directory for the files (default .)]
+#include "2005024_scene_tokenizer.h"
+
+struct Checksum {
+    double sum = 0.0;
+    long long values = 0;
+
+    void add(double v) {
+        sum += v;
+        values++;
+    }
+};
+
+// Offline_3 grammar, as read by loadData
+template <typename In, typename Word>
+bool parseRayScene(In& in, Checksum& check) {
+    int recursion, width, numObjects;
+    in >> recursion >> width >> numObjects;
+    check.add(recursion);
+    check.add(width);
+
+    double v;
+    int shine;
+    for (int i = 0; i < numObjects && in; i++) {
+        Word type;
+        in >> type;
+        int count = type == "sphere" ? 4 : type == "triangle" ? 9 : type == "general" ? 16 : -1;
+        if (count < 0) return false;
+        for (int k = 0; k < count + 7; k++) {
+            in >> v;
+            check.add(v);
+        }
+        in >> shine;
+        check.add(shine);
+    }
+
+    int numPointLights = 0, numSpotLights = 0;
+    in >> numPointLights;
+    for (int i = 0; i < numPointLights && in; i++) {
+        for (int k = 0; k < 6; k++) {
+            in >> v;
+            check.add(v);
+        }
+    }
+    in >> numSpotLights;
+    for (int i = 0; i < numSpotLights && in; i++) {
+        for (int k = 0; k < 10; k++) {
+            in >> v;
+            check.add(v);
+        }
+    }
+    return (bool)in;
+}
+
+// Offline_2 grammar, as read by Modeling_Transformation
+template <typename In, typename Word>
+bool parseTransformScript(In& in, Checksum& check) {
+    double v;
+    for (int k = 0; k < 13; k++) {
+        in >> v;
+        check.add(v);
+    }
+
+    Word command;
+    while (in >> command) {
+        int count = command == "triangle" ? 9 : command == "translate" || command == "scale" ? 3
+                  : command == "rotate" ? 4 : 0;
+        if (command == "end") return true;
+        if (count == 0 && command != "push" && command != "pop") return false;
+        for (int k = 0; k < count; k++) {
+            in >> v;
+            check.add(v);
+        }
+    }
+    return false;
+}
+
+void writeRayScene(const string& path, size_t bytes) {
+    mt19937 rng(1);
+    uniform_real_distribution<double> coord(-100.0, 100.0), unit(0.0, 1.0);
+    ostringstream body;
+    body << fixed << setprecision(6);
+    int objects = 0;
+    while ((size_t)body.tellp() < bytes) {
+        int kind = objects % 3;
+        if (kind == 0) {
+            body << "sphere\n" << coord(rng) << " " << coord(rng) << " " << coord(rng) << "\n"
+                 << 1 + 10 * unit(rng) << "\n";
+        } else if (kind == 1) {
+            body << "triangle\n";
+            for (int k = 0; k < 3; k++) {
+                body << coord(rng) << " " << coord(rng) << " " << coord(rng) << "\n";
+            }
+        } else {
+            body << "general\n1 1 1 0 0 0 0 0 0 -" << 100 * unit(rng) << "\n"
+                 << coord(rng) << " " << coord(rng) << " " << coord(rng) << " 0 0 20\n";
+        }
+        body << unit(rng) << " " << unit(rng) << " " << unit(rng) << "\n"
+             << "0.4 0.2 0.2 0.2\n" << 1 + (int)(30 * unit(rng)) << "\n\n";
+        objects++;
+    }
+
+    ofstream out(path);
+    out << "4\n768\n\n" << objects << "\n\n" << body.str()
+        << "2\n70.0 70.0 70.0\n1.0 0.0 0.0\n-70 70 70\n0.0 0.0 1.0\n\n"
+        << "1\n0 0 100\n1 1 1\n0 0 -1\n30\n";
+}
+
+void writeTransformScript(const string& path, size_t bytes) {
+    mt19937 rng(2);
+    uniform_real_distribution<double> coord(-50.0, 50.0);
+    ofstream out(path);
+    out << fixed << setprecision(6);
+    out << "0.0 0.0 50.0\n0.0 0.0 0.0\n0.0 1.0 0.0\n80.0 1.0 1.0 100.0\n";
+    size_t written = 0;
+    for (int n = 0; written < bytes; n++) {
+        if (n % 16 == 0) out << "push\nrotate\n30.0 0.0 0.0 1.0\ntranslate\n1.5 -2.5 3.0\n";
+        out << "triangle\n";
+        for (int k = 0; k < 3; k++) {
+            out << coord(rng) << " " << coord(rng) << " " << coord(rng) << "\n";
+        }
+        if (n % 16 == 15) out << "scale\n2.0 2.0 2.0\npop\n";
+        written = out.tellp();
+    }
+    out << "end\n";
+}
+
+template <typename F>
+double timeBest(F run) {
+    double best = INFINITY;
+    for (int rep = 0; rep < 3; rep++) {
+        auto start = chrono::steady_clock::now();
+        run();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+template <typename Parse, typename ParseFast>
+bool compare(const string& name, const string& path, Parse parseStream, ParseFast parseTokens) {
+    double mb = filesystem::file_size(path) / 1e6;
+    Checksum slow, fast;
+    bool slowOk = false, fastOk = false;
+
+    double streamTime = timeBest([&] {
+        ifstream in(path);
+        slow = Checksum();
+        slowOk = parseStream(in, slow);
+    });
+    double tokenTime = timeBest([&] {
+        SceneTokenizer in(path);
+        fast = Checksum();
+        fastOk = parseTokens(in, fast);
+        if (!fastOk && !in) cerr << in.error() << endl;
+    });
+
+    bool same = slowOk && fastOk && slow.values == fast.values &&
+                memcmp(&slow.sum, &fast.sum, sizeof(double)) == 0;
+    cout << fixed << setprecision(3) << name << " (" << setprecision(1) << mb << " MB, "
+         << fast.values << " values)\n"
+         << setprecision(3)
+         << "  iostream       " << streamTime << " s  " << setprecision(1) << mb / streamTime << " MB/s\n"
+         << setprecision(3)
+         << "  SceneTokenizer " << tokenTime << " s  " << setprecision(1) << mb / tokenTime << " MB/s\n"
+         << "  speedup        " << streamTime / tokenTime << "x, results "
+         << (same ? "identical" : "DIFFER") << endl;
+    return same;
+}
+
+int main(int argc, char** argv) {
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 100;
+    string dir = argc > 2 ? argv[2] : ".";
+    string rayPath = dir + "/bench_ray_scene.txt";
+    string scriptPath = dir + "/bench_transform_scene.txt";
+
+    cout << "Writing " << megabytes << " MB test files to " << dir << "..." << endl;
+    writeRayScene(rayPath, megabytes * 1000000);
+    writeTransformScript(scriptPath, megabytes * 1000000);
+
+    bool ok = compare("Offline_3 scene", rayPath,
+                      [](ifstream& in, Checksum& c) { return parseRayScene<ifstream, string>(in, c); },
+                      [](SceneTokenizer& in, Checksum& c) {
+                          return parseRayScene<SceneTokenizer, string_view>(in, c);
+                      });
+    ok &= compare("Offline_2 scene", scriptPath,
+                  [](ifstream& in, Checksum& c) { return parseTransformScript<ifstream, string>(in, c); },
+                  [](SceneTokenizer& in, Checksum& c) {
+                      return parseTransformScript<SceneTokenizer, string_view>(in, c);
+                  });
+
+    remove(rayPath.c_str());
+    remove(scriptPath.c_str());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+#pragma once
+#include <bits/stdc++.h>
+#include <charconv>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+// Whitespace-separated tokens straight out of a memory-mapped file, shared
+// by the Offline_2 and Offline_3 scene readers. Numbers are parsed with
+// std::from_chars (behind an exact fast path for plain decimals): no
+// locale, no copies, and the same correctly rounded doubles iostream
+// produces.
+//
+// Reads work like istream extraction: `tok >> a >> b` leaves the targets
+// untouched once something went wrong, and the tokenizer converts to false.
+// Unlike istream a number must fill its whole token, and the first failure
+// is kept as "file:line:col: message" in error().
+struct SceneTokenizer {
+    string path;
+    const char* data = nullptr;
+    const char* cur = nullptr;
+    const char* end = nullptr;
+    size_t mappedSize = 0;
+
+    int line = 1;
+    const char* lineStart = nullptr;
+    // position of the last token, for error messages
+    int tokenLine = 1, tokenColumn = 1;
+
+    bool failed = false;
+    string message;
+
+    SceneTokenizer() {}
+    explicit SceneTokenizer(const string& filename) { open(filename); }
+    SceneTokenizer(const SceneTokenizer&) = delete;
+    SceneTokenizer& operator=(const SceneTokenizer&) = delete;
+    ~SceneTokenizer() { close(); }
+
+    bool open(const string& filename) {
+        close();
+        path = filename;
+        failed = false;
+        message.clear();
+        line = tokenLine = tokenColumn = 1;
+
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return fail("Could not open " + filename + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return fail("Could not read " + filename + ": " + strerror(errno));
+        }
+        if (st.st_size > 0) {
+            void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ::close(fd);
+                return fail("Could not map " + filename + ": " + strerror(errno));
+            }
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            mappedSize = st.st_size;
+            data = (const char*)mapping;
+        }
+        ::close(fd);
+        cur = lineStart = data;
+        end = data + mappedSize;
+        return true;
+    }
+
+    void close() {
+        if (mappedSize > 0) munmap((void*)data, mappedSize);
+        data = cur = end = lineStart = nullptr;
+        mappedSize = 0;
+    }
+
+    explicit operator bool() const { return !failed; }
+    bool operator!() const { return failed; }
+
+    const string& error() const { return message; }
+
+    // records the first failure only; later reads are no-ops anyway
+    bool fail(const string& what) {
+        if (!failed) {
+            failed = true;
+            message = what;
+        }
+        return false;
+    }
+
+    bool failAt(const string& what) {
+        return fail(path + ":" + to_string(tokenLine) + ":" + to_string(tokenColumn) + ": " + what);
+    }
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+    }
+
+    void skipSpace() {
+        while (cur < end && isSpace(*cur)) {
+            if (*cur == '\n') {
+                line++;
+                lineStart = cur + 1;
+            }
+            cur++;
+        }
+    }
+
+    // true when only whitespace is left
+    bool atEnd() {
+        skipSpace();
+        return cur >= end;
+    }
+
+    // for line-based formats: true when nothing but blanks is left on this line
+    bool atLineEnd() {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) cur++;
+        return cur >= end || *cur == '\n';
+    }
+
+    // drops the rest of the current line, newline included
+    void skipLine() {
+        while (cur < end && *cur != '\n') cur++;
+        if (cur < end) {
+            cur++;
+            line++;
+            lineStart = cur;
+        }
+    }
+
+    // consumes the next token if it is word; for optional keywords
+    bool accept(string_view word) {
+        if (failed) return false;
+        skipSpace();
+        size_t n = word.size();
+        if ((size_t)(end - cur) < n || string_view(cur, n) != word) return false;
+        if (cur + n < end && !isSpace(cur[n])) return false;
+        cur += n;
+        return true;
+    }
+
+    // next token, or an empty view (and a failure) at the end of the file
+    string_view next(const char* expected) {
+        if (failed) return string_view();
+        skipSpace();
+        tokenLine = line;
+        tokenColumn = cur - lineStart + 1;
+        if (cur >= end) {
+            failAt(string("expected ") + expected + ", found end of file");
+            return string_view();
+        }
+        const char* first = cur;
+        while (cur < end && !isSpace(*cur)) cur++;
+        return string_view(first, cur - first);
+    }
+
+    // Clinger's fast path for plain decimals ("-12.345"): a mantissa below
+    // 2^53 scaled by an exact power of ten rounds once, so the result is the
+    // correctly rounded value from_chars would give. Anything else (exponents,
+    // long mantissas, inf/nan) is left to from_chars.
+    static bool parseSimpleDouble(const char* first, const char* last, double& value) {
+        static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                        1e20, 1e21, 1e22};
+        bool negative = first < last && *first == '-';
+        if (negative) first++;
+        uint64_t mantissa = 0;
+        int digits = 0, fraction = 0;
+        bool dot = false;
+        for (const char* p = first; p < last; p++) {
+            if (*p >= '0' && *p <= '9') {
+                if (++digits > 19) return false;
+                mantissa = mantissa * 10 + (*p - '0');
+                fraction += dot;
+            } else if (*p == '.' && !dot) {
+                dot = true;
+            } else {
+                return false;
+            }
+        }
+        if (digits == 0 || mantissa > (1ull << 53) || fraction > 22) return false;
+        value = (double)mantissa / powers[fraction];
+        if (negative) value = -value;
+        return true;
+    }
+
+    template <typename T>
+    bool number(T& value, const char* expected) {
+        string_view token = next(expected);
+        if (failed) return false;
+        const char* first = token.data();
+        const char* last = first + token.size();
+        // istream accepts a leading '+', from_chars does not
+        if (first + 1 < last && *first == '+' && first[1] != '-') first++;
+        T parsed;
+        if constexpr (is_same<T, double>::value) {
+            if (parseSimpleDouble(first, last, parsed)) {
+                value = parsed;
+                return true;
+            }
+        }
+        auto result = from_chars(first, last, parsed);
+        if (result.ec != errc() || result.ptr != last) {
+            string shown(token.substr(0, 40));
+            return failAt(string("expected ") + expected + ", found '" + shown + "'");
+        }
+        value = parsed;
+        return true;
+    }
+
+    SceneTokenizer& operator>>(double& value) {
+        number(value, "a number");
+        return *this;
+    }
+
+    SceneTokenizer& operator>>(float& value) {
+        number(value, "a number");
+        return *this;
+    }
+
+    SceneTokenizer& operator>>(int& value) {
+        number(value, "an integer");
+        return *this;
+    }
+
+    SceneTokenizer& operator>>(string_view& word) {
+        string_view token = next("a word");
+        if (!failed) word = token;
+        return *this;
+    }
+
+    SceneTokenizer& operator>>(string& word) {
+        string_view token = next("a word");
+        if (!failed) word.assign(token);
+        return *this;
+    }
+};